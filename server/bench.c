@@ -0,0 +1,356 @@
+/* GOAL: - time the server's hot functions one at a time, so that
+           a change to one of them is judged by numbers, not guesses.
+
+   USAGE:
+     make bench && ./bench > before.json
+     ... change server.c ...
+     make bench && ./bench > after.json
+
+   bench includes server.c whole, so it times exactly the code the
+   server runs.  Each case builds its game from --seed, so that runs
+   are repeatable, then repeats its operation, doubling the count
+   until that takes --min-millis, and reports nanoseconds per
+   operation.  --only runs just the cases whose names contain the
+   given string.
+
+   The output is JSON, a case per line:
+     {"seed":12345,"results":[
+      {"name":"get_occupancy/enemies=4","iterations":8388608,"ns_per_op":21.7},
+      ...
+     ]}
+ */
+
+#define SNIPEZ_EMBEDDED
+#include "server.c"
+
+/* the occupancy, move and render cases play in a maze this many
+   cells on a side, with a player per BENCH_CELLS_PER_USER cells */
+#define BENCH_GAME_SIZE         64
+#define BENCH_CELLS_PER_USER    16
+
+/* random tiles to visit, over and over */
+#define BENCH_N_POINTS          4096
+
+static unsigned bench_seed = 12345;
+static unsigned bench_min_millis = 200;
+static const char *bench_only;
+static unsigned n_results;
+
+static const unsigned enemy_densities[] = { 0, 1, 4, 16 };
+static const struct { unsigned width, height; } viewports[] = {
+  { DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT },
+  { 1600, 1000 },
+  { MAX_CANVAS_SIZE, MAX_CANVAS_SIZE },         /* an overview */
+};
+static const unsigned game_sizes[] = { 16, 64, 256 };
+
+typedef struct _BenchState BenchState;
+struct _BenchState
+{
+  Game *game;
+  unsigned n_users;
+  User **users;
+  uint16_t point_x[BENCH_N_POINTS];
+  uint16_t point_y[BENCH_N_POINTS];
+  unsigned size;                        /* create_game */
+  unsigned width, height;               /* render_view */
+  FrameSnapshot snapshot;
+  DskJsonValue *frame;
+  z_stream *deflate;
+  int deflate_level;
+};
+
+/* Run 'n' operations and return how many microseconds they took. */
+typedef uint64_t (*BenchFunc) (BenchState *state, unsigned n);
+
+/* keeps results from being optimized away */
+static volatile unsigned bench_sink;
+
+static dsk_boolean
+bench_wanted (const char *name)
+{
+  return bench_only == NULL || strstr (name, bench_only) != NULL;
+}
+
+static void
+run_case (const char *name, BenchFunc func, BenchState *state)
+{
+  unsigned n = 1;
+  uint64_t usecs;
+  func (state, 1);                      /* warm up */
+  for (;;)
+    {
+      usecs = func (state, n);
+      if (usecs >= bench_min_millis * 1000ull || n >= 1u << 30)
+        break;
+      n *= 2;
+    }
+  printf ("%s\n {\"name\":\"%s\",\"iterations\":%u,\"ns_per_op\":%.1f}",
+          n_results++ ? "," : "", name, n, usecs * 1000.0 / n);
+  fflush (stdout);
+}
+
+/* A BENCH_GAME_SIZE maze with players and
+   'enemies_per_cell' enemies scattered over it. */
+static void
+bench_state_init (BenchState *state, unsigned enemies_per_cell)
+{
+  GameRules rules = GAME_RULES_DEFAULT;
+  unsigned size = BENCH_GAME_SIZE;
+  unsigned i;
+  char name[32];
+
+  memset (state, 0, sizeof (BenchState));
+  random_seed (bench_seed);
+  state->game = create_game ("bench", size, size, &rules);
+  state->n_users = size * size / BENCH_CELLS_PER_USER;
+  state->users = dsk_malloc (sizeof (User *) * state->n_users);
+  for (i = 0; i < state->n_users; i++)
+    {
+      snprintf (name, sizeof (name), "player%u", i);
+      state->users[i] = create_user (state->game, name,
+                                     DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT);
+    }
+  for (i = 0; i < size * size * enemies_per_cell; i++)
+    {
+      unsigned x = random_int_range (size * CELL_SIZE);
+      unsigned y = random_int_range (size * CELL_SIZE);
+      Occupant dummy;
+      if (get_occupancy (state->game, x, y, &dummy) == OCC_EMPTY)
+        add_entity (state->game, ENTITY_ENEMY, x, y, PACK_VELOCITY (0, 0));
+    }
+  for (i = 0; i < BENCH_N_POINTS; i++)
+    {
+      state->point_x[i] = random_int_range (size * CELL_SIZE);
+      state->point_y[i] = random_int_range (size * CELL_SIZE);
+    }
+}
+
+static void
+bench_state_clear (BenchState *state)
+{
+  if (state->frame != NULL)
+    dsk_json_value_free (state->frame);
+  if (state->deflate != NULL)
+    {
+      deflateEnd (state->deflate);
+      dsk_free (state->deflate);
+    }
+  snapshot_clear (&state->snapshot);
+  if (state->game != NULL)
+    destroy_game (state->game);
+  dsk_free (state->users);
+}
+
+/* --- the cases --- */
+static uint64_t
+bench_get_occupancy (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i, sum = 0;
+  Occupant occupant;
+  for (i = 0; i < n; i++)
+    {
+      unsigned p = i % BENCH_N_POINTS;
+      sum += get_occupancy (state->game, state->point_x[p], state->point_y[p],
+                            &occupant);
+    }
+  bench_sink = sum;
+  return get_monotonic_usecs () - start;
+}
+
+static uint64_t
+bench_move_object (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      unsigned p = i % BENCH_N_POINTS;
+      move_object (&state->users[i % state->n_users]->base,
+                   state->point_x[p], state->point_y[p]);
+    }
+  return get_monotonic_usecs () - start;
+}
+
+static uint64_t
+bench_move_entity (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned n_enemies = state->game->pools[ENTITY_ENEMY].n_entities;
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      unsigned p = i % BENCH_N_POINTS;
+      move_entity (state->game, ENTITY_ENEMY, i % n_enemies,
+                   state->point_x[p], state->point_y[p]);
+    }
+  return get_monotonic_usecs () - start;
+}
+
+/* Each game is made from the same seed, so each is the same work;
+   freeing them is not timed. */
+static uint64_t
+bench_create_game (BenchState *state, unsigned n)
+{
+  GameRules rules = GAME_RULES_DEFAULT;
+  uint64_t usecs = 0;
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      uint64_t start;
+      Game *game;
+      random_seed (bench_seed);
+      start = get_monotonic_usecs ();
+      game = create_game ("bench", state->size, state->size, &rules);
+      usecs += get_monotonic_usecs () - start;
+      destroy_game (game);
+    }
+  return usecs;
+}
+
+static uint64_t
+bench_snapshot_take (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i;
+  for (i = 0; i < n; i++)
+    snapshot_take (&state->snapshot, state->game);
+  return get_monotonic_usecs () - start;
+}
+
+/* A player's view, as the render thread makes it for each frame. */
+static uint64_t
+bench_render_view (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      User *user = state->users[i % state->n_users];
+      DskJsonValue *frame = render_view (&state->snapshot,
+                                         user->base.x, user->base.y,
+                                         state->width, state->height, user);
+      dsk_json_value_free (frame);
+    }
+  return get_monotonic_usecs () - start;
+}
+
+/* The rendered frame to JSON text, as respond_user_update() does. */
+static uint64_t
+bench_frame_to_json (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+      dsk_json_value_to_buffer (state->frame, -1, &buffer);
+      bench_sink = buffer.size;
+      dsk_buffer_clear (&buffer);
+    }
+  return get_monotonic_usecs () - start;
+}
+
+/* ... and then gzipped, as for browsers that accept it. */
+static uint64_t
+bench_respond_frame (BenchState *state, unsigned n)
+{
+  uint64_t start = get_monotonic_usecs ();
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+      DskBuffer gzipped = DSK_BUFFER_STATIC_INIT;
+      dsk_json_value_to_buffer (state->frame, -1, &buffer);
+      if (!gzip_frame (&state->deflate, &state->deflate_level, &buffer, &gzipped))
+        dsk_die ("error compressing frame");
+      bench_sink = gzipped.size;
+      dsk_buffer_clear (&buffer);
+      dsk_buffer_clear (&gzipped);
+    }
+  return get_monotonic_usecs () - start;
+}
+
+/* --- main program --- */
+int main(int argc, char **argv)
+{
+  BenchState state;
+  char name[64];
+  unsigned d, v, s;
+
+  dsk_cmdline_init ("snipez benchmarks",
+                    "Time the server's hot functions, printing JSON",
+                    NULL, 0);
+  dsk_cmdline_add_uint ("seed", "Random Seed",
+                        "N", 0, &bench_seed);
+  dsk_cmdline_add_uint ("min-millis", "Time to Spend on Each Case",
+                        "MILLIS", 0, &bench_min_millis);
+  dsk_cmdline_add_string ("only", "Run Only Cases Whose Names Contain this",
+                          "STRING", 0, &bench_only);
+  dsk_cmdline_process_args (&argc, &argv);
+
+  printf ("{\"seed\":%u,\"results\":[", bench_seed);
+
+  for (d = 0; d < DSK_N_ELEMENTS (enemy_densities); d++)
+    {
+      unsigned density = enemy_densities[d];
+
+      bench_state_init (&state, density);
+
+      snprintf (name, sizeof (name), "get_occupancy/enemies=%u", density);
+      if (bench_wanted (name))
+        run_case (name, bench_get_occupancy, &state);
+      snprintf (name, sizeof (name), "snapshot_take/enemies=%u", density);
+      if (bench_wanted (name))
+        run_case (name, bench_snapshot_take, &state);
+
+      snapshot_take (&state.snapshot, state.game);
+      for (v = 0; v < DSK_N_ELEMENTS (viewports); v++)
+        {
+          state.width = viewports[v].width;
+          state.height = viewports[v].height;
+          snprintf (name, sizeof (name), "render_view/%ux%u/enemies=%u",
+                    state.width, state.height, density);
+          if (bench_wanted (name))
+            run_case (name, bench_render_view, &state);
+        }
+
+      if (density == 4)
+        {
+          User *user = state.users[0];
+          state.frame = render_view (&state.snapshot, user->base.x, user->base.y,
+                                     DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT,
+                                     user);
+          snprintf (name, sizeof (name), "frame_to_json/%ux%u/enemies=%u",
+                    DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT, density);
+          if (bench_wanted (name))
+            run_case (name, bench_frame_to_json, &state);
+          snprintf (name, sizeof (name), "respond_frame/%ux%u/enemies=%u",
+                    DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT, density);
+          if (bench_wanted (name))
+            run_case (name, bench_respond_frame, &state);
+
+          /* these move things about, so they come last */
+          snprintf (name, sizeof (name), "move_object/enemies=%u", density);
+          if (bench_wanted (name))
+            run_case (name, bench_move_object, &state);
+          snprintf (name, sizeof (name), "move_entity/enemies=%u", density);
+          if (bench_wanted (name))
+            run_case (name, bench_move_entity, &state);
+        }
+      bench_state_clear (&state);
+    }
+
+  memset (&state, 0, sizeof (state));
+  for (s = 0; s < DSK_N_ELEMENTS (game_sizes); s++)
+    {
+      state.size = game_sizes[s];
+      snprintf (name, sizeof (name), "create_game/%ux%u", state.size, state.size);
+      if (bench_wanted (name))
+        run_case (name, bench_create_game, &state);
+    }
+
+  printf ("\n]}\n");
+  return 0;
+}
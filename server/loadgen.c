@@ -0,0 +1,797 @@
+/* GOAL: - find out how many players a snipez server (or the router)
+           can keep happy, before real players find out for us.
+
+   loadgen plays like many copies of snipez.html at once.  Each
+   player starts or joins a game, then long-polls /update in a loop,
+   holding down random keys, just as the page does.
+
+   USAGE:
+     ./server -p 8001 &
+     ./loadgen --server 8001 --players 10000 --players-per-game 8 --duration 60
+
+   Every REPORT_SECS, and at the end for the whole run, it prints:
+     frames/s       /update responses with a frame, per second
+     latency        from sending an /update to the end of its response,
+                    in milliseconds; most of it is waiting for the next
+                    frame, so compare it with the server's period
+     missed frames  frames rendered for a player that it never saw
+     missed ticks   ticks that went by between frames beyond those the
+                    server meant to skip (its frame_interval), per frame
+     bytes/frame    body bytes as sent, gzipped unless --no-gzip
+     empty          /update answered with no frame (204)
+     errors         failed requests and connections, and frames
+                    that could not be decoded
+
+   Each player has a socket of its own, kept alive between requests,
+   as a browser's would be.  The first player of each game creates it;
+   the others join once it exists.  Players start at --ramp per
+   second, so as not to arrive all at once.
+
+   Server is given as HOST:PORT, or just PORT for 127.0.0.1.
+ */
+
+#include "../../dsk/dsk.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#define REPORT_SECS             5
+#define RECONNECT_MILLIS        1000
+#define RAMP_MILLIS             10
+
+/* each request, each key is let go or pressed with this probability */
+#define INPUT_CHANGE_PROBABILITY 0.1
+
+/* responses with longer headers than this are refused */
+#define MAX_HEADER_SIZE         8192
+
+/* latencies are kept in buckets: below 16 usecs exactly, then 16 per
+   power of two, so that percentiles are good to about 6% */
+#define LATENCY_SUB_BUCKETS     16
+#define N_LATENCY_BUCKETS       (LATENCY_SUB_BUCKETS * 40)
+
+/* --- statistics --- */
+typedef struct _Stats Stats;
+struct _Stats
+{
+  uint64_t frames, empty, errors;
+  uint64_t body_bytes;
+  uint64_t missed_frames, missed_ticks;
+  uint64_t max_latency;
+  uint64_t latency_buckets[N_LATENCY_BUCKETS];
+};
+static Stats interval_stats, total_stats;
+static uint64_t start_usecs, interval_start_usecs;
+
+static uint64_t
+get_monotonic_usecs (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned
+latency_bucket (uint64_t usecs)
+{
+  unsigned e;
+  if (usecs < LATENCY_SUB_BUCKETS)
+    return usecs;
+  e = 63 - __builtin_clzll (usecs);     /* at least 4 */
+  if (e - 4 >= N_LATENCY_BUCKETS / LATENCY_SUB_BUCKETS - 1)
+    return N_LATENCY_BUCKETS - 1;
+  return LATENCY_SUB_BUCKETS * (e - 3)
+       + ((usecs >> (e - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the least latency that falls in 'bucket' */
+static uint64_t
+latency_bucket_start (unsigned bucket)
+{
+  unsigned e;
+  if (bucket < LATENCY_SUB_BUCKETS)
+    return bucket;
+  e = bucket / LATENCY_SUB_BUCKETS + 3;
+  return ((uint64_t) 1 << e)
+       + ((uint64_t) (bucket % LATENCY_SUB_BUCKETS) << (e - 4));
+}
+
+static double
+latency_percentile (const Stats *stats, double fraction)
+{
+  uint64_t n = stats->frames + stats->empty;
+  uint64_t target = n * fraction, seen = 0;
+  unsigned i;
+  for (i = 0; i < N_LATENCY_BUCKETS; i++)
+    {
+      seen += stats->latency_buckets[i];
+      if (seen > target)
+        return latency_bucket_start (i) / 1000.0;
+    }
+  return stats->max_latency / 1000.0;
+}
+
+static void
+print_stats (const char *label, const Stats *stats, uint64_t usecs,
+             unsigned n_playing)
+{
+  double secs = usecs / 1e6;
+  printf ("%-6s players %u  frames/s %.0f  latency p50 %.1f p90 %.1f p99 %.1f max %.1f"
+          "  missed frames %.2f%%  missed ticks %.3f  bytes/frame %.0f"
+          "  empty %llu  errors %llu\n",
+          label, n_playing,
+          secs > 0 ? stats->frames / secs : 0.0,
+          latency_percentile (stats, 0.50),
+          latency_percentile (stats, 0.90),
+          latency_percentile (stats, 0.99),
+          stats->max_latency / 1000.0,
+          stats->frames + stats->missed_frames == 0 ? 0.0
+            : 100.0 * stats->missed_frames / (stats->frames + stats->missed_frames),
+          stats->frames ? (double) stats->missed_ticks / stats->frames : 0.0,
+          stats->frames ? (double) stats->body_bytes / stats->frames : 0.0,
+          (unsigned long long) stats->empty,
+          (unsigned long long) stats->errors);
+  fflush (stdout);
+}
+
+/* --- players --- */
+typedef struct _Player Player;
+struct _Player
+{
+  char name[32];
+  char game[32];
+  Player *creator;                      /* of its game; itself if it creates it */
+  dsk_boolean started;
+  dsk_boolean in_game;
+
+  int fd;                               /* -1 if not connected */
+  dsk_boolean connecting;
+  char *path;                           /* of the request in progress */
+  uint64_t sent_usecs;
+  DskBuffer outgoing;
+
+  /* the response coming in */
+  char *incoming;
+  unsigned incoming_length, incoming_alloced;
+
+  /* the keys held down */
+  int move_x, move_y, bullet_x, bullet_y;
+  unsigned seq;
+
+  /* from the last frame */
+  dsk_boolean has_frame;
+  unsigned last_frame, last_update;
+};
+
+static struct sockaddr_in server_addr;
+static const char *server_name;
+static unsigned n_players = 100;
+static unsigned players_per_game = 4;
+static unsigned ramp_per_sec = 500;
+static unsigned duration_secs;
+static unsigned canvas_width = 700, canvas_height = 400;
+static dsk_boolean no_gzip;
+static Player *players;
+static unsigned n_started, n_playing;
+static unsigned run_id;
+
+static z_stream inflater;
+static char *inflated;
+static unsigned inflated_alloced;
+
+static void player_send (Player *player, char *path);
+static void player_start (Player *player);
+
+static void
+player_close (Player *player)
+{
+  if (player->fd >= 0)
+    dsk_main_close_fd (player->fd);
+  player->fd = -1;
+  player->connecting = DSK_FALSE;
+  player->incoming_length = 0;
+  dsk_buffer_clear (&player->outgoing);
+}
+
+static void
+retry_timer_callback (void *data)
+{
+  Player *player = data;
+  char *path = player->path;
+  player->path = NULL;
+  if (player->in_game)
+    player_send (player, path);
+  else
+    {
+      dsk_free (path);
+      player_start (player);
+    }
+}
+
+/* The request failed: count it, and try it again in a while.
+   A player that has lost its game starts again from the beginning. */
+static void
+player_failed (Player *player, dsk_boolean lost_game)
+{
+  interval_stats.errors++;
+  total_stats.errors++;
+  player_close (player);
+  if (lost_game && player->in_game)
+    {
+      player->in_game = DSK_FALSE;
+      player->has_frame = DSK_FALSE;
+      n_playing--;
+    }
+  dsk_main_add_timer_millis (RECONNECT_MILLIS, retry_timer_callback, player);
+}
+
+static void
+append_update_path (Player *player, DskBuffer *out)
+{
+  if ((double) rand () / RAND_MAX < INPUT_CHANGE_PROBABILITY)
+    player->move_x = rand () % 3 - 1;
+  if ((double) rand () / RAND_MAX < INPUT_CHANGE_PROBABILITY)
+    player->move_y = rand () % 3 - 1;
+  if ((double) rand () / RAND_MAX < INPUT_CHANGE_PROBABILITY)
+    player->bullet_x = rand () % 3 - 1;
+  if ((double) rand () / RAND_MAX < INPUT_CHANGE_PROBABILITY)
+    player->bullet_y = rand () % 3 - 1;
+  dsk_buffer_printf (out, "/update?user=%s&dx=%d&dy=%d&bx=%d&by=%d&seq=%u",
+                     player->name, player->move_x, player->move_y,
+                     player->bullet_x, player->bullet_y, ++player->seq);
+}
+
+static void
+send_update (Player *player)
+{
+  DskBuffer path = DSK_BUFFER_STATIC_INIT;
+  append_update_path (player, &path);
+  player_send (player, dsk_buffer_empty_to_string (&path));
+}
+
+/* The value of "key": in the frame's info element, or -1.
+   The frame must be NUL-terminated. */
+static long
+frame_info_number (const char *frame, const char *key)
+{
+  char quoted[32];
+  const char *at;
+  snprintf (quoted, sizeof (quoted), "\"%s\"", key);
+  at = strstr (frame, quoted);
+  if (at == NULL)
+    return -1;
+  at += strlen (quoted);
+  while (*at == ' ' || *at == ':')
+    at++;
+  return *at ? strtol (at, NULL, 10) : -1;
+}
+
+/* Big views compress well over 16 times, so the buffer is grown
+   until the whole frame fits. */
+static const char *
+gunzip (const char *body, unsigned length, unsigned *length_out)
+{
+  int rv;
+  if (inflated_alloced < length * 16 + 4096)
+    {
+      inflated_alloced = length * 16 + 4096;
+      inflated = dsk_realloc (inflated, inflated_alloced);
+    }
+  inflateReset (&inflater);
+  inflater.next_in = (Bytef *) body;
+  inflater.avail_in = length;
+  inflater.next_out = (Bytef *) inflated;
+  inflater.avail_out = inflated_alloced - 1;
+  while ((rv = inflate (&inflater, Z_FINISH)) == Z_BUF_ERROR
+      && inflater.avail_out == 0)
+    {
+      unsigned used = inflated_alloced - 1;
+      inflated_alloced *= 2;
+      inflated = dsk_realloc (inflated, inflated_alloced);
+      inflater.next_out = (Bytef *) inflated + used;
+      inflater.avail_out = inflated_alloced - 1 - used;
+    }
+  if (rv != Z_STREAM_END)
+    return NULL;
+  *length_out = inflated_alloced - 1 - inflater.avail_out;
+  inflated[*length_out] = 0;
+  return inflated;
+}
+
+static void
+record_frame (Player *player, const char *body, unsigned length, dsk_boolean gzipped)
+{
+  long frame, update, interval;
+  if (gzipped && (body = gunzip (body, length, &length)) == NULL)
+    {
+      interval_stats.errors++;
+      total_stats.errors++;
+      return;
+    }
+  frame = frame_info_number (body, "frame");
+  update = frame_info_number (body, "update");
+  interval = frame_info_number (body, "frame_interval");
+  if (frame < 0 || update < 0)
+    return;
+  if (player->has_frame && (unsigned) frame > player->last_frame)
+    {
+      uint64_t missed = frame - player->last_frame - 1;
+      uint64_t ticks = update - player->last_update;
+      interval_stats.missed_frames += missed;
+      total_stats.missed_frames += missed;
+      if (interval > 0 && ticks > (uint64_t) interval)
+        {
+          interval_stats.missed_ticks += ticks - interval;
+          total_stats.missed_ticks += ticks - interval;
+        }
+    }
+  player->has_frame = DSK_TRUE;
+  player->last_frame = frame;
+  player->last_update = update;
+}
+
+static void
+handle_response (Player *player, int status,
+                 const char *body, unsigned body_length,
+                 dsk_boolean gzipped)
+{
+  uint64_t latency;
+  unsigned i;
+  if (!player->in_game)
+    {
+      if (status != 200)
+        {
+          dsk_warning ("%s: %s: %d %.*s", player->name, player->path,
+                       status, (int) DSK_MIN (body_length, 80), body);
+          if (!player->creator->in_game)
+            {
+              /* its game is gone: join again once the creator has
+                 made it anew */
+              interval_stats.errors++;
+              total_stats.errors++;
+              player->started = DSK_FALSE;
+              dsk_free (player->path);
+              player->path = NULL;
+              return;
+            }
+          player_failed (player, DSK_FALSE);
+          return;
+        }
+      player->in_game = DSK_TRUE;
+      n_playing++;
+      dsk_free (player->path);
+      player->path = NULL;
+
+      /* now the game exists, the rest of its players can join */
+      if (player->creator == player)
+        for (i = 1; i < players_per_game && player + i < players + n_started; i++)
+          if (!player[i].started)
+            player_start (player + i);
+      send_update (player);
+      return;
+    }
+
+  latency = get_monotonic_usecs () - player->sent_usecs;
+  switch (status)
+    {
+    case 200:
+      interval_stats.frames++;
+      total_stats.frames++;
+      interval_stats.body_bytes += body_length;
+      total_stats.body_bytes += body_length;
+      record_frame (player, body, body_length, gzipped);
+      break;
+    case 204:
+      interval_stats.empty++;
+      total_stats.empty++;
+      break;
+    default:
+      /* the server no longer knows us */
+      player_failed (player, DSK_TRUE);
+      return;
+    }
+  interval_stats.latency_buckets[latency_bucket (latency)]++;
+  total_stats.latency_buckets[latency_bucket (latency)]++;
+  if (latency > interval_stats.max_latency)
+    interval_stats.max_latency = latency;
+  if (latency > total_stats.max_latency)
+    total_stats.max_latency = latency;
+  dsk_free (player->path);
+  player->path = NULL;
+  send_update (player);
+}
+
+/* The length of the chunked body at 'body', if it is all there, or 0. */
+static unsigned
+chunked_length (const char *body, unsigned length)
+{
+  const char *at = body, *end = body + length;
+  for (;;)
+    {
+      char *size_end;
+      unsigned long size;
+      const char *data;
+      if (memchr (at, '\n', end - at) == NULL)
+        return 0;
+      size = strtoul (at, &size_end, 16);
+      data = strstr (size_end, "\r\n");
+      if (data == NULL || data + 2 + size + 2 > end)
+        return 0;
+      at = data + 2 + size + 2;
+      if (size == 0)
+        return at - body;
+    }
+}
+
+/* Undo chunked transfer-encoding, in place. */
+static unsigned
+dechunk (char *body)
+{
+  const char *in = body;
+  char *out = body;
+  for (;;)
+    {
+      char *size_end;
+      unsigned long size = strtoul (in, &size_end, 16);
+      const char *data = strstr (size_end, "\r\n") + 2;
+      if (size == 0)
+        break;
+      memmove (out, data, size);
+      out += size;
+      in = data + size + 2;
+    }
+  return out - body;
+}
+
+static const char *
+find_header (const char *headers, const char *key)
+{
+  unsigned key_length = strlen (key);
+  const char *line;
+  for (line = strstr (headers, "\r\n"); line != NULL; line = strstr (line, "\r\n"))
+    {
+      line += 2;
+      if (strncasecmp (line, key, key_length) == 0 && line[key_length] == ':')
+        {
+          line += key_length + 1;
+          while (*line == ' ' || *line == '\t')
+            line++;
+          return line;
+        }
+    }
+  return NULL;
+}
+
+/* Handle every complete response in 'incoming'.  Returns FALSE
+   if the connection must be closed. */
+static dsk_boolean
+handle_incoming (Player *player, dsk_boolean at_eof)
+{
+  while (player->incoming_length > 0)
+    {
+      char *in = player->incoming;
+      char *header_end, *body;
+      const char *value;
+      unsigned header_length, total, body_length;
+      int status, content_length;
+      dsk_boolean chunked, gzipped, keep_alive;
+
+      in[player->incoming_length] = 0;
+      header_end = strstr (in, "\r\n\r\n");
+      if (header_end == NULL)
+        {
+          if (player->incoming_length >= MAX_HEADER_SIZE)
+            return DSK_FALSE;
+          return !at_eof;
+        }
+      header_length = header_end + 4 - in;
+      if (strncmp (in, "HTTP/1.", 7) != 0 || in[8] != ' ')
+        return DSK_FALSE;
+      status = atoi (in + 9);
+      *header_end = 0;
+      value = find_header (in, "Transfer-Encoding");
+      chunked = value != NULL && strncasecmp (value, "chunked", 7) == 0;
+      value = find_header (in, "Content-Encoding");
+      gzipped = value != NULL && strncasecmp (value, "gzip", 4) == 0;
+      value = find_header (in, "Connection");
+      keep_alive = !(value != NULL && strncasecmp (value, "close", 5) == 0)
+                && in[7] == '1';
+      value = find_header (in, "Content-Length");
+      content_length = value != NULL ? (int) strtoul (value, NULL, 10) : -1;
+      *header_end = '\r';
+
+      body = in + header_length;
+      if (status == 204 || status == 304)
+        total = 0;
+      else if (chunked)
+        {
+          total = chunked_length (body, player->incoming_length - header_length);
+          if (total == 0)
+            return !at_eof;
+        }
+      else if (content_length >= 0)
+        {
+          total = content_length;
+          if (header_length + total > player->incoming_length)
+            return !at_eof;
+        }
+      else if (at_eof)
+        {
+          total = player->incoming_length - header_length;
+          keep_alive = DSK_FALSE;
+        }
+      else
+        return DSK_TRUE;
+
+      body_length = chunked ? dechunk (body) : total;
+      body[body_length] = 0;
+      memmove (in, body + total, player->incoming_length - header_length - total + 1);
+      player->incoming_length -= header_length + total;
+      if (!keep_alive)
+        player_close (player);
+      handle_response (player, status, body, body_length, gzipped);
+      if (!keep_alive)
+        return DSK_TRUE;
+    }
+  return !at_eof;
+}
+
+static void
+handle_player_fd (DskFileDescriptor fd, unsigned events, void *data)
+{
+  Player *player = data;
+  int n;
+  DSK_UNUSED (events);
+  if (player->outgoing.size > 0)
+    {
+      if (player->connecting)
+        {
+          int err = 0;
+          socklen_t len = sizeof (err);
+          if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            {
+              player_failed (player, DSK_FALSE);
+              return;
+            }
+          player->connecting = DSK_FALSE;
+        }
+      if (dsk_buffer_writev (&player->outgoing, fd) < 0)
+        {
+          if (errno != EAGAIN && errno != EINTR)
+            player_failed (player, DSK_FALSE);
+          return;
+        }
+      if (player->outgoing.size == 0)
+        dsk_main_watch_fd (fd, DSK_EVENT_READABLE, handle_player_fd, player);
+      return;
+    }
+
+  if (player->incoming_alloced - player->incoming_length < 4096)
+    {
+      player->incoming_alloced = player->incoming_alloced * 2 + 8192;
+      player->incoming = dsk_realloc (player->incoming, player->incoming_alloced);
+    }
+  n = read (fd, player->incoming + player->incoming_length,
+            player->incoming_alloced - player->incoming_length - 1);
+  if (n < 0)
+    {
+      if (errno != EAGAIN && errno != EINTR)
+        player_failed (player, player->in_game && player->path == NULL);
+      return;
+    }
+  player->incoming_length += n;
+  if (!handle_incoming (player, n == 0))
+    {
+      if (player->path != NULL)
+        player_failed (player, DSK_FALSE);
+      else
+        player_close (player);
+    }
+}
+
+static void
+player_connect (Player *player)
+{
+  player->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (player->fd < 0)
+    {
+      dsk_warning ("error creating socket: %s", strerror (errno));
+      return;
+    }
+  fcntl (player->fd, F_SETFL, fcntl (player->fd, F_GETFL) | O_NONBLOCK);
+  if (connect (player->fd, (struct sockaddr *) &server_addr, sizeof (server_addr)) < 0
+   && errno != EINPROGRESS)
+    {
+      close (player->fd);
+      player->fd = -1;
+      return;
+    }
+  player->connecting = DSK_TRUE;
+}
+
+/* GET 'path', which is taken over, on the player's connection. */
+static void
+player_send (Player *player, char *path)
+{
+  dsk_free (player->path);
+  player->path = path;
+  if (player->fd < 0)
+    player_connect (player);
+  if (player->fd < 0)
+    {
+      player_failed (player, DSK_FALSE);
+      return;
+    }
+  dsk_buffer_printf (&player->outgoing,
+                     "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                     path, server_name,
+                     no_gzip ? "" : "Accept-Encoding: gzip\r\n");
+  player->sent_usecs = get_monotonic_usecs ();
+  dsk_main_watch_fd (player->fd, DSK_EVENT_WRITABLE, handle_player_fd, player);
+}
+
+static void
+player_start (Player *player)
+{
+  DskBuffer path = DSK_BUFFER_STATIC_INIT;
+  player->started = DSK_TRUE;
+  dsk_buffer_printf (&path, "/%s?user=%s&game=%s&w=%u&h=%u",
+                     player->creator == player ? "newgame" : "join",
+                     player->name, player->game,
+                     canvas_width, canvas_height);
+  player_send (player, dsk_buffer_empty_to_string (&path));
+}
+
+/* Start the creators of new games at --ramp players per second;
+   the other players in each game start once it is created. */
+static void
+ramp_timer_callback (void *data)
+{
+  uint64_t elapsed = get_monotonic_usecs () - start_usecs;
+  uint64_t due = DSK_MIN ((uint64_t) n_players, elapsed * ramp_per_sec / 1000000 + 1);
+  DSK_UNUSED (data);
+  while (n_started < due)
+    {
+      Player *player = players + n_started++;
+      if (player->creator == player)
+        player_start (player);
+      else if (player->creator->in_game && !player->started)
+        player_start (player);
+    }
+  if (n_started < n_players)
+    dsk_main_add_timer_millis (RAMP_MILLIS, ramp_timer_callback, NULL);
+}
+
+static void
+report_timer_callback (void *data)
+{
+  uint64_t now = get_monotonic_usecs ();
+  char label[16];
+  DSK_UNUSED (data);
+  snprintf (label, sizeof (label), "%.0fs", (now - start_usecs) / 1e6);
+  print_stats (label, &interval_stats, now - interval_start_usecs, n_playing);
+  memset (&interval_stats, 0, sizeof (interval_stats));
+  interval_start_usecs = now;
+  if (duration_secs > 0 && now - start_usecs >= duration_secs * 1000000ull)
+    {
+      print_stats ("total", &total_stats, now - start_usecs, n_playing);
+      exit (0);
+    }
+  dsk_main_add_timer_millis (REPORT_SECS * 1000, report_timer_callback, NULL);
+}
+
+/* Allow a socket per player, if we may. */
+static void
+raise_fd_limit (void)
+{
+  struct rlimit limit;
+  if (getrlimit (RLIMIT_NOFILE, &limit) < 0)
+    return;
+  if (limit.rlim_cur < n_players + 64)
+    {
+      limit.rlim_cur = DSK_MIN (limit.rlim_max, (rlim_t) n_players + 64);
+      setrlimit (RLIMIT_NOFILE, &limit);
+    }
+  if (limit.rlim_cur < n_players + 64)
+    dsk_warning ("only %u file descriptors allowed: not enough for %u players",
+                 (unsigned) limit.rlim_cur, n_players);
+}
+
+static DSK_CMDLINE_CALLBACK_DECLARE (handle_server)
+{
+  const char *colon = strchr (arg_value, ':');
+  char host[64];
+  DSK_UNUSED (arg_name);
+  DSK_UNUSED (callback_data);
+  server_addr.sin_family = AF_INET;
+  if (colon == NULL)
+    strcpy (host, "127.0.0.1");
+  else if ((size_t) (colon - arg_value) < sizeof (host))
+    {
+      memcpy (host, arg_value, colon - arg_value);
+      host[colon - arg_value] = 0;
+    }
+  else
+    host[0] = 0;
+  if (inet_pton (AF_INET, host, &server_addr.sin_addr) != 1)
+    {
+      dsk_set_error (error, "bad server address %s", arg_value);
+      return DSK_FALSE;
+    }
+  server_addr.sin_port = htons (atoi (colon ? colon + 1 : arg_value));
+  server_name = arg_value;
+  return DSK_TRUE;
+}
+
+static DSK_CMDLINE_CALLBACK_DECLARE (handle_canvas)
+{
+  DSK_UNUSED (arg_name);
+  DSK_UNUSED (callback_data);
+  if (sscanf (arg_value, "%ux%u", &canvas_width, &canvas_height) != 2)
+    {
+      dsk_set_error (error, "error parsing WIDTHxHEIGHT for --canvas");
+      return DSK_FALSE;
+    }
+  return DSK_TRUE;
+}
+
+int main(int argc, char **argv)
+{
+  unsigned i;
+
+  dsk_cmdline_init ("snipez load generator",
+                    "Play many snipez players at once, and report how the server copes",
+                    NULL, 0);
+  dsk_cmdline_add_func ("server", "Address of the snipez server (or router)",
+                        "[HOST:]PORT", DSK_CMDLINE_MANDATORY,
+                        handle_server, NULL);
+  dsk_cmdline_add_uint ("players", "Number of Players",
+                        "N", 0, &n_players);
+  dsk_cmdline_add_uint ("players-per-game", "Number of Players in Each Game",
+                        "N", 0, &players_per_game);
+  dsk_cmdline_add_uint ("ramp", "Players to Start per Second",
+                        "N", 0, &ramp_per_sec);
+  dsk_cmdline_add_uint ("duration", "Seconds to Run (0 for ever)",
+                        "SECS", 0, &duration_secs);
+  dsk_cmdline_add_func ("canvas", "Canvas Size Each Player Reports",
+                        "WIDTHxHEIGHT", 0, handle_canvas, NULL);
+  dsk_cmdline_add_boolean ("no-gzip", "Don't Ask for Gzipped Frames",
+                           NULL, 0, &no_gzip);
+  dsk_cmdline_add_shortcut ('s', "server");
+  dsk_cmdline_add_shortcut ('n', "players");
+  dsk_cmdline_process_args (&argc, &argv);
+
+  if (n_players == 0 || players_per_game == 0 || ramp_per_sec == 0)
+    dsk_die ("--players, --players-per-game and --ramp must be positive");
+  raise_fd_limit ();
+  if (inflateInit2 (&inflater, 16 + MAX_WBITS) != Z_OK)
+    dsk_die ("error initializing zlib");
+
+  /* names are unique to this run, so runs don't collide */
+  run_id = getpid ();
+  players = dsk_malloc0 (sizeof (Player) * n_players);
+  for (i = 0; i < n_players; i++)
+    {
+      Player *player = players + i;
+      player->creator = players + i - i % players_per_game;
+      player->fd = -1;
+      snprintf (player->name, sizeof (player->name), "lg%u-%u", run_id, i);
+      snprintf (player->game, sizeof (player->game), "lg%u-g%u", run_id, i / players_per_game);
+    }
+
+  start_usecs = interval_start_usecs = get_monotonic_usecs ();
+  ramp_timer_callback (NULL);
+  dsk_main_add_timer_millis (REPORT_SECS * 1000, report_timer_callback, NULL);
+  return dsk_main_run ();
+}
@@ -0,0 +1,1737 @@
+/* GOAL: - spread games over several snipez servers, so that
+           together they can use every core of a machine (or several).
+
+   The router stands in front of a number of snipez servers, its
+   "backends", and looks to clients like a single server.
+
+   USAGE:
+     ./server -p 8001 &
+     ./server -p 8002 &
+     ./router -p 8000 --backend 8001 --backend 8002
+
+   Each game lives entirely on one backend.  The router keeps a
+   directory of which backend has each game and each player, and
+   forwards /join, /update, /watch, /leave and /destroy to the one
+   that has it.  New games go to the least loaded backend, going by
+   the /stats each backend reports.  /games is answered by the router
+   itself, from the backends' own lobbies merged together; the
+   directory is rebuilt from those lobbies too, so the router can be
+   restarted without disturbing any games.  Anything else, such as the
+   page itself, can be answered by any backend.
+
+   A game can also be moved between backends while it is being played,
+   with /migrate?game=NAME[&to=BACKEND], or by the router itself when
+   one backend is overloaded and moving its busiest game would help.
+   The game is frozen and written out by the old backend's /export,
+   and read in by the new one's /import; meanwhile, requests for it
+   and its players are held here, then sent on to wherever it ended up.
+   Games are only moved if the router is given the backends'
+   --admin-token, which /migrate must then be sent as X-Admin-Token.
+
+   Backends are given as HOST:PORT, or just PORT for 127.0.0.1.
+   Requests to them are plain HTTP/1.1.  The connections are kept
+   open afterwards, up to MAX_IDLE_CONNECTIONS per backend, for the
+   next request to that backend.
+ */
+
+#include "../../dsk/dsk.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* how often each backend is asked for its /stats and /games */
+#define POLL_MILLIS             500
+
+/* A backend that takes longer than this to answer any request is
+   taken to be dead.  It must be longer than a server holds an /update
+   waiting for a frame: see PENDING_TIMEOUT_USECS in server.c. */
+#define FETCH_TIMEOUT_MILLIS    10000
+
+/* A game placed on a backend since its last /stats counts as this
+   much load, so that a burst of new games is not all placed on the
+   same backend. */
+#define PLACED_GAME_LOAD        0.05
+
+/* A backend more loaded than this (1 being its LOAD_TARGET) has its
+   busiest game moved, if there is somewhere it would be less loaded;
+   then no more moves are started for MIGRATE_COOLDOWN_POLLS polls. */
+#define MIGRATE_LOAD            1.0
+#define MIGRATE_COOLDOWN_POLLS  20
+
+/* connections kept open to each backend between requests */
+#define MAX_IDLE_CONNECTIONS    64
+
+/* responses with longer headers than this are refused */
+#define MAX_HEADER_SIZE         8192
+#define MAX_RESPONSE_HEADERS    16
+
+typedef struct _Backend Backend;
+struct _Backend
+{
+  char *name;                           /* as given by --backend */
+  struct sockaddr_in addr;
+  dsk_boolean alive;                    /* answered its last /stats, and
+                                           has not let a request time out */
+  double load;                          /* from /stats; 1 is fully loaded */
+  unsigned n_games;
+  unsigned n_placed;                    /* games placed since its last /stats */
+  unsigned n_polls;                     /* poll requests outstanding */
+  char *busiest_game;                   /* from /stats, or NULL */
+  double busiest_load;
+
+  /* its lobby, the last /games it sent, or NULL */
+  char *lobby;
+  char *lobby_etag;
+
+  /* open connections to it that no request is using */
+  int *idle_fds;
+  unsigned n_idle_fds, idle_fds_alloced;
+};
+static Backend *backends;
+static unsigned n_backends;
+
+/* the backends' --admin-token, or NULL */
+static const char *admin_token;
+
+/* --- the directory --- */
+/* Games and players are few, and kept in ordinary linked lists,
+   as they are in the server. */
+typedef struct _Migration Migration;
+typedef struct _DirectoryEntry DirectoryEntry;
+struct _DirectoryEntry
+{
+  char *name;
+  Backend *backend;
+  unsigned n_pending;                   /* forwarded requests that may create or drop it */
+  unsigned serial;                      /* of the last request that confirmed it */
+  Migration *migration;                 /* if being moved, or NULL */
+  DirectoryEntry *next;
+};
+static DirectoryEntry *game_directory, *user_directory;
+
+static DirectoryEntry *
+directory_lookup (DirectoryEntry *list, const char *name)
+{
+  for (; list != NULL; list = list->next)
+    if (strcmp (list->name, name) == 0)
+      return list;
+  return NULL;
+}
+
+static DirectoryEntry *
+directory_set (DirectoryEntry **list_inout,
+               const char *name,
+               Backend *backend,
+               unsigned serial)
+{
+  DirectoryEntry *entry = directory_lookup (*list_inout, name);
+  if (entry == NULL)
+    {
+      entry = dsk_malloc0 (sizeof (DirectoryEntry));
+      entry->name = dsk_strdup (name);
+      entry->next = *list_inout;
+      *list_inout = entry;
+    }
+  else if ((int) (serial - entry->serial) < 0)
+    return entry;               /* we have heard of it more recently */
+  entry->backend = backend;
+  entry->serial = serial;
+  return entry;
+}
+
+static void
+directory_remove (DirectoryEntry **list_inout, DirectoryEntry *entry)
+{
+  while (*list_inout != entry)
+    list_inout = &(*list_inout)->next;
+  *list_inout = entry->next;
+  dsk_free (entry->name);
+  dsk_free (entry);
+}
+
+/* Forget the entries for 'backend' that were not confirmed
+   since request 'serial', and are not being created. */
+static void
+directory_sweep (DirectoryEntry **list_inout,
+                 Backend *backend,
+                 unsigned serial)
+{
+  while (*list_inout != NULL)
+    {
+      DirectoryEntry *entry = *list_inout;
+      if (entry->backend == backend
+       && entry->n_pending == 0
+       && (int) (serial - entry->serial) > 0)
+        directory_remove (list_inout, entry);
+      else
+        list_inout = &entry->next;
+    }
+}
+
+/* --- reading JSON from the backends --- */
+/* The backends' documents are small, and made by dsk, so rather
+   than parse them into values we just walk over their text. */
+static const char *
+skip_json_space (const char *at)
+{
+  while (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r')
+    at++;
+  return at;
+}
+
+static const char *
+skip_json_string (const char *at)
+{
+  dsk_assert (*at == '"');
+  for (at++; *at != '"'; at++)
+    {
+      if (*at == 0)
+        return at;
+      if (*at == '\\' && at[1] != 0)
+        at++;
+    }
+  return at + 1;
+}
+
+/* Skip the value at 'at', up to the ',' or closing bracket after it. */
+static const char *
+skip_json_value (const char *at)
+{
+  unsigned depth = 0;
+  while (*at != 0)
+    {
+      if (*at == '"')
+        {
+          at = skip_json_string (at);
+          continue;
+        }
+      if (*at == '[' || *at == '{')
+        depth++;
+      else if (*at == ']' || *at == '}')
+        {
+          if (depth == 0)
+            break;
+          depth--;
+        }
+      else if (*at == ',' && depth == 0)
+        break;
+      at++;
+    }
+  return at;
+}
+
+/* The string at 'at', unescaped, or NULL if it is not a string.
+   Characters outside ASCII come out as '?'; they are only ever
+   compared with other names read the same way. */
+static char *
+parse_json_string (const char *at)
+{
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  at = skip_json_space (at);
+  if (*at != '"')
+    return NULL;
+  for (at++; *at != '"' && *at != 0; at++)
+    {
+      char c = *at;
+      if (c == '\\' && at[1] != 0)
+        {
+          at++;
+          switch (*at)
+            {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u':
+              {
+                unsigned code = 0, i;
+                for (i = 0; i < 4 && at[1] != 0; i++)
+                  {
+                    char h = *++at;
+                    code = code * 16 + (h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+                  }
+                c = code < 0x80 ? (char) code : '?';
+                break;
+              }
+            default: c = *at; break;
+            }
+        }
+      dsk_buffer_append_byte (&buffer, c);
+    }
+  return dsk_buffer_empty_to_string (&buffer);
+}
+
+/* Find the value of member 'key' of the object at 'at'. */
+static const char *
+json_member (const char *at, const char *key)
+{
+  at = skip_json_space (at);
+  if (*at != '{')
+    return NULL;
+  at = skip_json_space (at + 1);
+  while (*at == '"')
+    {
+      char *name = parse_json_string (at);
+      dsk_boolean found = strcmp (name, key) == 0;
+      dsk_free (name);
+      at = skip_json_space (skip_json_string (at));
+      if (*at != ':')
+        return NULL;
+      at = skip_json_space (at + 1);
+      if (found)
+        return at;
+      at = skip_json_value (at);
+      if (*at != ',')
+        return NULL;
+      at = skip_json_space (at + 1);
+    }
+  return NULL;
+}
+
+static double
+json_member_number (const char *object, const char *key)
+{
+  const char *at = json_member (object, key);
+  return at ? strtod (at, NULL) : 0;
+}
+
+/* Step through an array: 'at' starts at the '[', and each call
+   returns the next element, or NULL at the end. */
+static const char *
+json_array_next (const char **at_inout)
+{
+  const char *at = skip_json_space (*at_inout);
+  const char *elt;
+  if (*at != '[' && *at != ',')
+    return NULL;
+  elt = skip_json_space (at + 1);
+  if (*elt == ']' || *elt == 0)
+    return NULL;
+  *at_inout = skip_json_value (elt);
+  return elt;
+}
+
+/* --- requests to the backends --- */
+typedef enum
+{
+  CHUNK_SIZE,                           /* the line giving its size */
+  CHUNK_DATA,
+  CHUNK_DATA_END,                       /* the CRLF after the data */
+  CHUNK_TRAILER,                        /* after the last chunk */
+  CHUNK_DONE
+} ChunkState;
+
+typedef struct _Fetch Fetch;
+typedef void (*FetchCallback) (Fetch *fetch);
+struct _Fetch
+{
+  Backend *backend;
+  unsigned serial;                      /* increases with each request */
+  int fd;
+  dsk_boolean reused;                   /* fd was idle, not newly opened */
+  DskDispatchTimer *timer;              /* times it out, or fails it at once */
+  char *request_text;                   /* kept in case it must be resent */
+  unsigned request_length;
+  DskBuffer outgoing, incoming;
+  unsigned header_length;               /* 0 until the headers are in */
+  int64_t content_length;               /* -1 means up to EOF */
+
+  /* a chunked body is decoded into 'dechunked' as it arrives */
+  dsk_boolean chunked;
+  ChunkState chunk_state;
+  unsigned chunk_left;
+  DskBuffer dechunked;
+
+  FetchCallback callback;
+  void *data;
+
+  /* the response, when 'callback' is invoked */
+  int status;                           /* 0 if the backend did not answer */
+  char *header_text;
+  unsigned n_headers;
+  DskHttpHeaderMisc headers[MAX_RESPONSE_HEADERS];
+  char *body;
+  unsigned body_length;
+};
+static unsigned fetch_serial;
+
+static void backend_down (Backend *backend);
+static void maybe_migrate (void);
+static void migration_hold (Migration *migration,
+                            DskHttpServerRequest *request,
+                            void (*handler) (DskHttpServerRequest *));
+
+static const char *
+fetch_header (Fetch *fetch, const char *key)
+{
+  unsigned i;
+  for (i = 0; i < fetch->n_headers; i++)
+    if (strcasecmp (fetch->headers[i].key, key) == 0)
+      return fetch->headers[i].value;
+  return NULL;
+}
+
+static const char *
+request_header (DskHttpServerRequest *request, const char *key)
+{
+  DskHttpRequest *req = request->request;
+  unsigned i;
+  for (i = 0; i < req->n_unparsed_headers; i++)
+    if (strcasecmp (req->unparsed_headers[i].key, key) == 0)
+      return req->unparsed_headers[i].value;
+  return NULL;
+}
+
+/* Parse the status line and headers, which end at 'header_length'. */
+static dsk_boolean
+fetch_parse_headers (Fetch *fetch)
+{
+  char *line, *next;
+  const char *value;
+  fetch->header_text = dsk_malloc (fetch->header_length + 1);
+  dsk_buffer_read (&fetch->incoming, fetch->header_length, fetch->header_text);
+  fetch->header_text[fetch->header_length] = 0;
+
+  line = fetch->header_text;
+  if (strncmp (line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+    return DSK_FALSE;
+  fetch->status = atoi (line + 9);
+  for (line = strstr (line, "\r\n") + 2; *line != '\r' && *line != 0; line = next)
+    {
+      char *colon;
+      next = strstr (line, "\r\n");
+      *next = 0;
+      next += 2;
+      colon = strchr (line, ':');
+      if (colon == NULL || fetch->n_headers == MAX_RESPONSE_HEADERS)
+        continue;
+      *colon++ = 0;
+      while (*colon == ' ' || *colon == '\t')
+        colon++;
+      fetch->headers[fetch->n_headers].key = line;
+      fetch->headers[fetch->n_headers].value = colon;
+      fetch->n_headers++;
+    }
+
+  fetch->content_length = -1;
+  value = fetch_header (fetch, "Content-Length");
+  if (value != NULL)
+    fetch->content_length = strtoull (value, NULL, 10);
+  value = fetch_header (fetch, "Transfer-Encoding");
+  fetch->chunked = value != NULL && strcasecmp (value, "chunked") == 0;
+  if (fetch->chunked)
+    fetch->content_length = -1;
+  if (fetch->status == 204 || fetch->status == 304)
+    {
+      fetch->chunked = DSK_FALSE;
+      fetch->content_length = 0;
+    }
+  return DSK_TRUE;
+}
+
+/* Take a line ending in CRLF from the front of 'incoming', without
+   the CRLF.  Returns 1 if it was there, 0 if it has not all arrived,
+   or -1 if it is longer than 'max'. */
+static int
+fetch_read_line (Fetch *fetch, char *line, unsigned max)
+{
+  unsigned n = dsk_buffer_peek (&fetch->incoming, max, line);
+  char *end;
+  line[n < max ? n : max - 1] = 0;
+  end = strstr (line, "\r\n");
+  if (end == NULL)
+    return n == max ? -1 : 0;
+  *end = 0;
+  dsk_buffer_discard (&fetch->incoming, end + 2 - line);
+  return 1;
+}
+
+/* Decode what has arrived of a chunked body.
+   Returns FALSE if it is not valid. */
+static dsk_boolean
+fetch_dechunk (Fetch *fetch)
+{
+  char line[256];
+  for (;;)
+    {
+      int got;
+      char *end;
+      switch (fetch->chunk_state)
+        {
+        case CHUNK_DATA:
+          while (fetch->chunk_left > 0 && fetch->incoming.size > 0)
+            {
+              char buf[4096];
+              unsigned n = dsk_buffer_read (&fetch->incoming,
+                                            DSK_MIN (fetch->chunk_left, sizeof (buf)),
+                                            buf);
+              dsk_buffer_append (&fetch->dechunked, n, buf);
+              fetch->chunk_left -= n;
+            }
+          if (fetch->chunk_left > 0)
+            return DSK_TRUE;
+          fetch->chunk_state = CHUNK_DATA_END;
+          break;
+        case CHUNK_DONE:
+          return DSK_TRUE;
+        default:
+          got = fetch_read_line (fetch, line, sizeof (line));
+          if (got <= 0)
+            return got == 0;
+          if (fetch->chunk_state == CHUNK_SIZE)
+            {
+              fetch->chunk_left = strtoul (line, &end, 16);
+              if (end == line)
+                return DSK_FALSE;
+              fetch->chunk_state = fetch->chunk_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            }
+          else if (fetch->chunk_state == CHUNK_DATA_END)
+            {
+              if (line[0] != 0)
+                return DSK_FALSE;
+              fetch->chunk_state = CHUNK_SIZE;
+            }
+          else if (line[0] == 0)        /* the end of the trailer */
+            fetch->chunk_state = CHUNK_DONE;
+          break;
+        }
+    }
+}
+
+/* Whether the whole response is in, and nothing more. */
+static dsk_boolean
+fetch_response_complete (Fetch *fetch)
+{
+  if (fetch->header_length == 0)
+    return DSK_FALSE;
+  if (fetch->chunked)
+    return fetch->chunk_state == CHUNK_DONE && fetch->incoming.size == 0;
+  return fetch->content_length >= 0
+      && fetch->incoming.size == fetch->content_length;
+}
+
+static void
+handle_idle_fd (DskFileDescriptor fd, unsigned events, void *data)
+{
+  Backend *backend = data;
+  unsigned i;
+  DSK_UNUSED (events);
+
+  /* closed by the backend, or it is confused: either way, forget it */
+  for (i = 0; i < backend->n_idle_fds; i++)
+    if (backend->idle_fds[i] == (int) fd)
+      {
+        backend->idle_fds[i] = backend->idle_fds[--backend->n_idle_fds];
+        break;
+      }
+  dsk_main_close_fd (fd);
+}
+
+/* Keep a connection whose response is done for the next request. */
+static void
+backend_put_idle_fd (Backend *backend, int fd)
+{
+  if (backend->n_idle_fds == MAX_IDLE_CONNECTIONS)
+    {
+      dsk_main_close_fd (fd);
+      return;
+    }
+  if (backend->n_idle_fds == backend->idle_fds_alloced)
+    {
+      backend->idle_fds_alloced = backend->idle_fds_alloced ? backend->idle_fds_alloced * 2 : 8;
+      backend->idle_fds = dsk_realloc (backend->idle_fds,
+                                       sizeof (int) * backend->idle_fds_alloced);
+    }
+  backend->idle_fds[backend->n_idle_fds++] = fd;
+  dsk_main_watch_fd (fd, DSK_EVENT_READABLE, handle_idle_fd, backend);
+}
+
+static dsk_boolean fetch_connect (Fetch *fetch);
+
+static void
+fetch_finish (Fetch *fetch, dsk_boolean ok)
+{
+  const char *connection;
+
+  /* A connection that was idle may have been closed by the backend
+     just as we sent the request: if so, send it again on a new one. */
+  if (!ok && fetch->reused && fetch->timer != NULL
+   && fetch->header_length == 0 && fetch->incoming.size == 0)
+    {
+      dsk_main_close_fd (fetch->fd);
+      dsk_buffer_clear (&fetch->outgoing);
+      if (fetch_connect (fetch))
+        return;
+    }
+
+  if (fetch->timer != NULL)
+    dsk_dispatch_remove_timer (fetch->timer);
+  connection = fetch_header (fetch, "Connection");
+  if (fetch->fd < 0)
+    ;
+  else if (ok && fetch_response_complete (fetch)
+        && strncmp (fetch->header_text, "HTTP/1.1 ", 9) == 0
+        && (connection == NULL || strcasecmp (connection, "close") != 0))
+    backend_put_idle_fd (fetch->backend, fetch->fd);
+  else
+    dsk_main_close_fd (fetch->fd);
+  if (ok && fetch->header_length > 0)
+    {
+      DskBuffer *body = fetch->chunked ? &fetch->dechunked : &fetch->incoming;
+      unsigned length = body->size;
+      if (fetch->content_length >= 0 && length > fetch->content_length)
+        length = fetch->content_length;
+      fetch->body = dsk_malloc (length + 1);
+      fetch->body_length = dsk_buffer_read (body, length, fetch->body);
+      fetch->body[fetch->body_length] = 0;
+    }
+  else
+    ok = DSK_FALSE;
+  if (!ok)
+    {
+      fetch->status = 0;
+      fetch->n_headers = 0;
+      fetch->body_length = 0;
+    }
+
+  fetch->callback (fetch);
+
+  dsk_free (fetch->request_text);
+  dsk_buffer_clear (&fetch->outgoing);
+  dsk_buffer_clear (&fetch->incoming);
+  dsk_buffer_clear (&fetch->dechunked);
+  dsk_free (fetch->header_text);
+  dsk_free (fetch->body);
+  dsk_free (fetch);
+}
+
+static void
+handle_fetch_fd (DskFileDescriptor fd, unsigned events, void *data)
+{
+  Fetch *fetch = data;
+  DSK_UNUSED (events);
+  if (fetch->outgoing.size > 0)
+    {
+      int err = 0;
+      socklen_t len = sizeof (err);
+      if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+          fetch_finish (fetch, DSK_FALSE);
+          return;
+        }
+      if (dsk_buffer_writev (&fetch->outgoing, fd) < 0)
+        {
+          if (errno != EAGAIN && errno != EINTR)
+            fetch_finish (fetch, DSK_FALSE);
+          return;
+        }
+      if (fetch->outgoing.size == 0)
+        dsk_main_watch_fd (fd, DSK_EVENT_READABLE, handle_fetch_fd, fetch);
+      return;
+    }
+
+  switch (dsk_buffer_readv (&fetch->incoming, fd))
+    {
+    case -1:
+      if (errno != EAGAIN && errno != EINTR)
+        fetch_finish (fetch, DSK_FALSE);
+      return;
+    case 0:
+      /* the response ends with the connection, unless it said otherwise */
+      fetch_finish (fetch, fetch->header_length > 0
+                        && (fetch->chunked
+                            ? fetch->chunk_state == CHUNK_DONE
+                            : fetch->content_length < 0
+                           || fetch->incoming.size >= fetch->content_length));
+      return;
+    }
+  if (fetch->header_length == 0)
+    {
+      char buf[MAX_HEADER_SIZE + 1];
+      unsigned n = dsk_buffer_peek (&fetch->incoming, MAX_HEADER_SIZE, buf);
+      char *end;
+      buf[n] = 0;
+      end = strstr (buf, "\r\n\r\n");
+      if (end == NULL)
+        {
+          if (n == MAX_HEADER_SIZE)
+            fetch_finish (fetch, DSK_FALSE);
+          return;
+        }
+      fetch->header_length = end + 4 - buf;
+      if (!fetch_parse_headers (fetch))
+        {
+          fetch_finish (fetch, DSK_FALSE);
+          return;
+        }
+    }
+  if (fetch->chunked)
+    {
+      if (!fetch_dechunk (fetch))
+        fetch_finish (fetch, DSK_FALSE);
+      else if (fetch->chunk_state == CHUNK_DONE)
+        fetch_finish (fetch, DSK_TRUE);
+    }
+  else if (fetch->content_length >= 0
+        && fetch->incoming.size >= fetch->content_length)
+    fetch_finish (fetch, DSK_TRUE);
+}
+
+static void
+fetch_failed_timer_callback (void *data)
+{
+  Fetch *fetch = data;
+  fetch->timer = NULL;
+  fetch_finish (fetch, DSK_FALSE);
+}
+
+/* Whatever the request, a backend this slow is no use to anyone:
+   stop sending it games until it answers a /stats again. */
+static void
+fetch_timeout_callback (void *data)
+{
+  Fetch *fetch = data;
+  fetch->timer = NULL;
+  if (fetch->backend->alive)
+    dsk_warning ("backend %s timed out", fetch->backend->name);
+  backend_down (fetch->backend);
+  fetch_finish (fetch, DSK_FALSE);
+}
+
+/* Send the request over an idle connection to the backend, if it
+   has one, or else over a new one.  FALSE if it cannot be sent. */
+static dsk_boolean
+fetch_connect (Fetch *fetch)
+{
+  Backend *backend = fetch->backend;
+  dsk_buffer_append (&fetch->outgoing, fetch->request_length, fetch->request_text);
+  fetch->reused = DSK_FALSE;
+  while (backend->n_idle_fds > 0)
+    {
+      char c;
+      fetch->fd = backend->idle_fds[--backend->n_idle_fds];
+      if (recv (fetch->fd, &c, 1, MSG_PEEK) < 0
+       && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+          fetch->reused = DSK_TRUE;
+          dsk_main_watch_fd (fetch->fd, DSK_EVENT_WRITABLE, handle_fetch_fd, fetch);
+          return DSK_TRUE;
+        }
+      dsk_main_close_fd (fetch->fd);    /* closed, or sent us junk */
+    }
+
+  fetch->fd = socket (AF_INET, SOCK_STREAM, 0);
+  if (fetch->fd >= 0)
+    {
+      fcntl (fetch->fd, F_SETFL, fcntl (fetch->fd, F_GETFL) | O_NONBLOCK);
+      if (connect (fetch->fd, (struct sockaddr *) &backend->addr,
+                   sizeof (backend->addr)) == 0
+       || errno == EINPROGRESS)
+        {
+          dsk_main_watch_fd (fetch->fd, DSK_EVENT_WRITABLE, handle_fetch_fd, fetch);
+          return DSK_TRUE;
+        }
+      close (fetch->fd);
+      fetch->fd = -1;
+    }
+  return DSK_FALSE;
+}
+
+/* GET 'path' from 'backend', passing on the client's preferences,
+   and any admin token for /destroy, from 'request', if not NULL;
+   or, if 'form' is not NULL, POST it.
+   'callback' is always invoked, but never before this returns. */
+static Fetch *
+fetch_start (Backend *backend,
+             const char *path,
+             DskHttpServerRequest *request,
+             const char *if_none_match,
+             DskBuffer *form,
+             FetchCallback callback,
+             void *data)
+{
+  static const char *passed_headers[] = { "Accept-Encoding", "If-None-Match", "X-Admin-Token" };
+  Fetch *fetch = dsk_malloc0 (sizeof (Fetch));
+  unsigned i;
+  fetch->backend = backend;
+  fetch->serial = ++fetch_serial;
+  fetch->callback = callback;
+  fetch->data = data;
+
+  dsk_buffer_printf (&fetch->outgoing,
+                     "%s %s HTTP/1.1\r\nHost: %s\r\n",
+                     form ? "POST" : "GET", path, backend->name);
+  for (i = 0; request != NULL && i < DSK_N_ELEMENTS (passed_headers); i++)
+    {
+      const char *value = request_header (request, passed_headers[i]);
+      if (value != NULL)
+        dsk_buffer_printf (&fetch->outgoing, "%s: %s\r\n", passed_headers[i], value);
+    }
+  if (if_none_match != NULL)
+    dsk_buffer_printf (&fetch->outgoing, "If-None-Match: %s\r\n", if_none_match);
+  if (request == NULL && admin_token != NULL)
+    {
+      /* our own request, such as an /export */
+      dsk_buffer_printf (&fetch->outgoing, "X-Admin-Token: %s\r\n", admin_token);
+    }
+  if (form != NULL)
+    dsk_buffer_printf (&fetch->outgoing,
+                       "Content-Type: application/x-www-form-urlencoded\r\n"
+                       "Content-Length: %u\r\n", form->size);
+  dsk_buffer_append_string (&fetch->outgoing, "\r\n");
+  if (form != NULL)
+    {
+      /* copy, so the caller can post it again */
+      char *copy = dsk_malloc (form->size);
+      unsigned size = dsk_buffer_peek (form, form->size, copy);
+      dsk_buffer_append (&fetch->outgoing, size, copy);
+      dsk_free (copy);
+    }
+  fetch->request_length = fetch->outgoing.size;
+  fetch->request_text = dsk_malloc (fetch->request_length);
+  dsk_buffer_read (&fetch->outgoing, fetch->request_length, fetch->request_text);
+
+  if (fetch_connect (fetch))
+    fetch->timer = dsk_main_add_timer_millis (FETCH_TIMEOUT_MILLIS,
+                                              fetch_timeout_callback, fetch);
+  else
+    fetch->timer = dsk_main_add_timer_millis (0, fetch_failed_timer_callback, fetch);
+  return fetch;
+}
+
+/* --- the lobby --- */
+static unsigned lobby_version;
+static unsigned long lobby_epoch;       /* keeps ETags unique across restarts */
+static char *lobby_document;            /* the unfiltered list, or NULL */
+static unsigned lobby_document_length;
+
+static void
+lobby_changed (void)
+{
+  lobby_version++;
+  dsk_free (lobby_document);
+  lobby_document = NULL;
+}
+
+/* Record everything in 'backend's lobby as being there,
+   and forget what it no longer has. */
+static void
+rebuild_directory (Backend *backend, unsigned serial)
+{
+  const char *at = backend->lobby;
+  const char *entry;
+  while (at != NULL && (entry = json_array_next (&at)) != NULL)
+    {
+      const char *name_at = json_member (entry, "name");
+      const char *players = json_member (entry, "players");
+      const char *player;
+      char *name = name_at ? parse_json_string (name_at) : NULL;
+      if (name == NULL)
+        continue;
+      directory_set (&game_directory, name, backend, serial);
+      dsk_free (name);
+      while (players != NULL && (player = json_array_next (&players)) != NULL)
+        {
+          char *user = parse_json_string (player);
+          if (user == NULL)
+            continue;
+          directory_set (&user_directory, user, backend, serial);
+          dsk_free (user);
+        }
+    }
+  directory_sweep (&game_directory, backend, serial);
+  directory_sweep (&user_directory, backend, serial);
+}
+
+static void
+handle_lobby_response (Fetch *fetch)
+{
+  Backend *backend = fetch->backend;
+  backend->n_polls--;
+  if (fetch->status == 200)
+    {
+      const char *etag = fetch_header (fetch, "ETag");
+      dsk_free (backend->lobby);
+      dsk_free (backend->lobby_etag);
+      backend->lobby = fetch->body;
+      backend->lobby_etag = etag ? dsk_strdup (etag) : NULL;
+      fetch->body = NULL;
+      lobby_changed ();
+    }
+  else if (fetch->status != 304)
+    return;
+  rebuild_directory (backend, fetch->serial);
+}
+
+/* No new games go to a dead backend, and its games leave the lobby. */
+static void
+backend_down (Backend *backend)
+{
+  backend->alive = DSK_FALSE;
+  if (backend->lobby != NULL)
+    {
+      dsk_free (backend->lobby);
+      dsk_free (backend->lobby_etag);
+      backend->lobby = backend->lobby_etag = NULL;
+      lobby_changed ();
+    }
+}
+
+static void
+handle_stats_response (Fetch *fetch)
+{
+  Backend *backend = fetch->backend;
+  const char *busiest_at;
+  backend->n_polls--;
+  if (fetch->status != 200)
+    {
+      if (backend->alive)
+        dsk_warning ("backend %s is not responding", backend->name);
+      backend_down (backend);
+      return;
+    }
+  backend->alive = DSK_TRUE;
+  backend->load = DSK_MAX (json_member_number (fetch->body, "sim_load"),
+                           json_member_number (fetch->body, "render_load"));
+  backend->n_games = json_member_number (fetch->body, "games");
+  backend->n_placed = 0;
+  dsk_free (backend->busiest_game);
+  busiest_at = json_member (fetch->body, "busiest_game");
+  backend->busiest_game = busiest_at ? parse_json_string (busiest_at) : NULL;
+  backend->busiest_load = json_member_number (fetch->body, "busiest_load");
+}
+
+static void
+poll_timer_callback (void *data)
+{
+  unsigned i;
+  DSK_UNUSED (data);
+  for (i = 0; i < n_backends; i++)
+    {
+      Backend *backend = backends + i;
+      if (backend->n_polls > 0)
+        continue;               /* still waiting on the last one */
+      backend->n_polls = 2;
+      fetch_start (backend, "/stats", NULL, NULL, NULL, handle_stats_response, NULL);
+      fetch_start (backend, "/games", NULL, backend->lobby_etag, NULL,
+                   handle_lobby_response, NULL);
+    }
+  maybe_migrate ();
+  dsk_main_add_timer_millis (POLL_MILLIS, poll_timer_callback, NULL);
+}
+
+static dsk_boolean
+etag_matches (DskHttpServerRequest *request, const char *etag)
+{
+  const char *if_none_match = request_header (request, "If-None-Match");
+  return if_none_match != NULL
+      && (strstr (if_none_match, etag) != NULL
+       || strcmp (if_none_match, "*") == 0);
+}
+
+/* The backends' lobbies, one after another, as the server would
+   have listed them: see handle_get_games_list() in server.c. */
+static void
+handle_get_games_list (DskHttpServerRequest *request)
+{
+  DskCgiVariable *match_var = dsk_http_server_request_lookup_cgi (request, "match");
+  DskCgiVariable *offset_var = dsk_http_server_request_lookup_cgi (request, "offset");
+  DskCgiVariable *limit_var = dsk_http_server_request_lookup_cgi (request, "limit");
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc headers[2];
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  dsk_boolean filtered = match_var != NULL || offset_var != NULL || limit_var != NULL;
+  char etag[48];
+
+  if (lobby_epoch == 0)
+    lobby_epoch = time (NULL);
+  snprintf (etag, sizeof (etag), "\"router-%lx-%x\"", lobby_epoch, lobby_version);
+  headers[0].key = "ETag";
+  headers[0].value = etag;
+  headers[1].key = "Cache-Control";
+  headers[1].value = "no-cache";
+  header_options.n_unparsed_headers = DSK_N_ELEMENTS (headers);
+  header_options.unparsed_headers = headers;
+  options.header_options = &header_options;
+  options.content_type = "application/json";
+
+  if (etag_matches (request, etag))
+    {
+      header_options.status_code = DSK_HTTP_STATUS_NOT_MODIFIED;
+      options.content_length = 0;
+      options.content_body = (const uint8_t *) "";
+      dsk_http_server_request_respond (request, &options);
+      return;
+    }
+
+  if (filtered || lobby_document == NULL)
+    {
+      unsigned offset = offset_var ? strtoul (offset_var->value, NULL, 10) : 0;
+      unsigned limit = limit_var ? strtoul (limit_var->value, NULL, 10) : (unsigned) -1;
+      unsigned n_matched = 0, n_listed = 0;
+      unsigned i;
+      dsk_buffer_append_byte (&buffer, '[');
+      for (i = 0; i < n_backends && n_listed < limit; i++)
+        {
+          const char *at = backends[i].lobby;
+          const char *entry;
+          while (at != NULL && n_listed < limit
+              && (entry = json_array_next (&at)) != NULL)
+            {
+              if (match_var != NULL)
+                {
+                  const char *name_at = json_member (entry, "name");
+                  char *name = name_at ? parse_json_string (name_at) : NULL;
+                  dsk_boolean matched = name != NULL
+                                     && strstr (name, match_var->value) != NULL;
+                  dsk_free (name);
+                  if (!matched)
+                    continue;
+                }
+              if (n_matched++ < offset)
+                continue;
+              if (n_listed++ > 0)
+                dsk_buffer_append_byte (&buffer, ',');
+              dsk_buffer_append (&buffer, at - entry, entry);
+            }
+        }
+      dsk_buffer_append_byte (&buffer, ']');
+      if (!filtered)
+        {
+          lobby_document_length = buffer.size;
+          lobby_document = dsk_buffer_empty_to_string (&buffer);
+        }
+    }
+  if (filtered)
+    options.source_buffer = &buffer;
+  else
+    {
+      options.content_length = lobby_document_length;
+      options.content_body = (const uint8_t *) lobby_document;
+    }
+  dsk_http_server_request_respond (request, &options);
+  dsk_buffer_clear (&buffer);
+}
+
+/* --- forwarding --- */
+/* a request being forwarded to a backend */
+typedef struct _Forward Forward;
+struct _Forward
+{
+  DskHttpServerRequest *request;
+  DirectoryEntry *game, *user;          /* entries it may create or drop, or NULL */
+  dsk_boolean leaving;                  /* 'user' is gone if it succeeds */
+};
+
+static void
+handle_forward_response (Fetch *fetch)
+{
+  Forward *forward = fetch->data;
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  static const char *passed_headers[] = { "ETag", "Cache-Control" };
+  DskHttpHeaderMisc headers[DSK_N_ELEMENTS (passed_headers)];
+  unsigned i;
+
+  if (forward->game != NULL)
+    {
+      forward->game->n_pending--;
+      if (fetch->status == 200)
+        forward->game->serial = fetch->serial;
+    }
+  if (forward->user != NULL)
+    {
+      forward->user->n_pending--;
+      if (fetch->status == 200)
+        forward->user->serial = fetch->serial;
+      /* Otherwise the name would stay taken until the next lobby poll. */
+      if (fetch->status == 200
+       && forward->leaving
+       && forward->user->n_pending == 0
+       && forward->user->migration == NULL)
+        directory_remove (&user_directory, forward->user);
+    }
+  if (fetch->status == 0)
+    {
+      char buf[512];
+      snprintf (buf, sizeof (buf), "server %s is not responding", fetch->backend->name);
+      dsk_http_server_request_respond_error (forward->request, DSK_HTTP_STATUS_BAD_GATEWAY, buf);
+      dsk_free (forward);
+      return;
+    }
+
+  for (i = 0; i < DSK_N_ELEMENTS (passed_headers); i++)
+    {
+      headers[header_options.n_unparsed_headers].key = (char *) passed_headers[i];
+      headers[header_options.n_unparsed_headers].value = (char *) fetch_header (fetch, passed_headers[i]);
+      if (headers[header_options.n_unparsed_headers].value != NULL)
+        header_options.n_unparsed_headers++;
+    }
+  header_options.unparsed_headers = headers;
+  header_options.status_code = fetch->status;
+  header_options.content_encoding = fetch_header (fetch, "Content-Encoding");
+  options.header_options = &header_options;
+  options.content_type = fetch_header (fetch, "Content-Type");
+  options.content_length = fetch->body_length;
+  options.content_body = (const uint8_t *) fetch->body;
+  dsk_http_server_request_respond (forward->request, &options);
+  dsk_free (forward);
+}
+
+static Forward *
+forward_request (DskHttpServerRequest *request,
+                 Backend *backend,
+                 DirectoryEntry *game,
+                 DirectoryEntry *user)
+{
+  Forward *forward = dsk_malloc (sizeof (Forward));
+  forward->request = request;
+  forward->game = game;
+  forward->user = user;
+  forward->leaving = DSK_FALSE;
+  if (game != NULL)
+    game->n_pending++;
+  if (user != NULL)
+    user->n_pending++;
+  fetch_start (backend, request->request->path, request, NULL, NULL,
+               handle_forward_response, forward);
+  return forward;
+}
+
+/* The least loaded backend that is up, other than 'exclude', or NULL. */
+static Backend *
+choose_backend (Backend *exclude)
+{
+  Backend *best = NULL;
+  double best_load = 0;
+  unsigned i;
+  for (i = 0; i < n_backends; i++)
+    {
+      Backend *backend = backends + i;
+      double load = backend->load + backend->n_placed * PLACED_GAME_LOAD;
+      if (!backend->alive || backend == exclude)
+        continue;
+      if (best == NULL
+       || load < best_load
+       || (load == best_load && backend->n_games < best->n_games))
+        {
+          best = backend;
+          best_load = load;
+        }
+    }
+  return best;
+}
+
+static void
+respond_no_backend (DskHttpServerRequest *request)
+{
+  dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_SERVICE_UNAVAILABLE,
+                                         "no servers available");
+}
+
+/* Look up a required CGI variable, responding if it is missing. */
+static DskCgiVariable *
+require_cgi (DskHttpServerRequest *request, const char *name)
+{
+  DskCgiVariable *var = dsk_http_server_request_lookup_cgi (request, name);
+  if (var == NULL)
+    {
+      char buf[64];
+      snprintf (buf, sizeof (buf), "missing %s=", name);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+    }
+  return var;
+}
+
+/* Look up a game or user in the directory, responding if it is not there. */
+static DirectoryEntry *
+require_entry (DskHttpServerRequest *request,
+               DirectoryEntry *list,
+               const char *what,
+               const char *name)
+{
+  DirectoryEntry *entry = directory_lookup (list, name);
+  if (entry == NULL)
+    {
+      char buf[512];
+      snprintf (buf, sizeof (buf), "%s %s not found", what, name);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+    }
+  return entry;
+}
+
+static void
+handle_create_new_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var, *user_var;
+  Backend *backend;
+  char buf[512];
+  if ((game_var = require_cgi (request, "game")) == NULL
+   || (user_var = require_cgi (request, "user")) == NULL)
+    return;
+  if (directory_lookup (game_directory, game_var->value) != NULL)
+    {
+      snprintf (buf, sizeof (buf), "game %s already exists", game_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  if (directory_lookup (user_directory, user_var->value) != NULL)
+    {
+      snprintf (buf, sizeof (buf), "user %s already in a game", user_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  backend = choose_backend (NULL);
+  if (backend == NULL)
+    {
+      respond_no_backend (request);
+      return;
+    }
+  backend->n_placed++;
+  backend->n_games++;
+  forward_request (request, backend,
+                   directory_set (&game_directory, game_var->value, backend, fetch_serial),
+                   directory_set (&user_directory, user_var->value, backend, fetch_serial));
+}
+
+static void
+handle_join_existing_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var, *user_var;
+  DirectoryEntry *game, *user;
+  char buf[512];
+  if ((game_var = require_cgi (request, "game")) == NULL
+   || (user_var = require_cgi (request, "user")) == NULL
+   || (game = require_entry (request, game_directory, "game", game_var->value)) == NULL)
+    return;
+  if (game->migration != NULL)
+    {
+      migration_hold (game->migration, request, handle_join_existing_game);
+      return;
+    }
+  user = directory_lookup (user_directory, user_var->value);
+  if (user != NULL && user->backend != game->backend)
+    {
+      snprintf (buf, sizeof (buf), "user %s already in a game", user_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  forward_request (request, game->backend, NULL,
+                   directory_set (&user_directory, user_var->value,
+                                  game->backend, fetch_serial));
+}
+
+static void
+handle_update_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *user_var;
+  DirectoryEntry *user;
+  if ((user_var = require_cgi (request, "user")) == NULL
+   || (user = require_entry (request, user_directory, "user", user_var->value)) == NULL)
+    return;
+  if (user->migration != NULL)
+    migration_hold (user->migration, request, handle_update_game);
+  else
+    forward_request (request, user->backend, NULL, NULL);
+}
+
+static void
+handle_watch_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var;
+  DirectoryEntry *game;
+  if ((game_var = require_cgi (request, "game")) == NULL
+   || (game = require_entry (request, game_directory, "game", game_var->value)) == NULL)
+    return;
+  if (game->migration != NULL)
+    migration_hold (game->migration, request, handle_watch_game);
+  else
+    forward_request (request, game->backend, NULL, NULL);
+}
+
+static void
+handle_leave_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *user_var;
+  DirectoryEntry *user;
+  if ((user_var = require_cgi (request, "user")) == NULL
+   || (user = require_entry (request, user_directory, "user", user_var->value)) == NULL)
+    return;
+  if (user->migration != NULL)
+    migration_hold (user->migration, request, handle_leave_game);
+  else
+    forward_request (request, user->backend, NULL, user)->leaving = DSK_TRUE;
+}
+
+static void
+handle_destroy_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var;
+  DirectoryEntry *game;
+  if ((game_var = require_cgi (request, "game")) == NULL
+   || (game = require_entry (request, game_directory, "game", game_var->value)) == NULL)
+    return;
+  if (game->migration != NULL)
+    migration_hold (game->migration, request, handle_destroy_game);
+  else
+    forward_request (request, game->backend, NULL, NULL);
+}
+
+/* The page and its assets are the same on every backend. */
+static void
+handle_other (DskHttpServerRequest *request)
+{
+  Backend *backend = choose_backend (NULL);
+  if (backend == NULL)
+    respond_no_backend (request);
+  else
+    forward_request (request, backend, NULL, NULL);
+}
+
+/* --- migration --- */
+typedef void (*RequestHandler) (DskHttpServerRequest *request);
+
+typedef struct _HeldRequest HeldRequest;
+struct _HeldRequest
+{
+  DskHttpServerRequest *request;
+  RequestHandler handler;               /* to run again when the move is over */
+};
+
+struct _Migration
+{
+  DirectoryEntry *game;
+  Backend *source, *target;
+  DskHttpServerRequest *request;        /* the /migrate, or NULL if automatic */
+  DskBuffer form;                       /* state=..., once exported */
+
+  /* the game's players, as far as the lobby knows */
+  unsigned n_users;
+  DirectoryEntry **users;
+
+  unsigned n_held, held_alloced;
+  HeldRequest *held;
+};
+static unsigned n_migrations;
+static unsigned migrate_cooldown;       /* polls before another automatic move */
+
+static void
+append_urlencoded (DskBuffer *out, const char *str, unsigned length)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  unsigned i;
+  for (i = 0; i < length; i++)
+    {
+      unsigned char c = str[i];
+      if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+       || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.')
+        dsk_buffer_append_byte (out, c);
+      else
+        {
+          char esc[3] = { '%', hex[c >> 4], hex[c & 15] };
+          dsk_buffer_append (out, 3, esc);
+        }
+    }
+}
+
+static void
+migration_hold (Migration *migration,
+                DskHttpServerRequest *request,
+                RequestHandler handler)
+{
+  if (migration->n_held == migration->held_alloced)
+    {
+      migration->held_alloced = migration->held_alloced ? migration->held_alloced * 2 : 16;
+      migration->held = dsk_realloc (migration->held,
+                                     sizeof (HeldRequest) * migration->held_alloced);
+    }
+  migration->held[migration->n_held].request = request;
+  migration->held[migration->n_held].handler = handler;
+  migration->n_held++;
+}
+
+static void
+migration_entry_done (DirectoryEntry *entry)
+{
+  entry->migration = NULL;
+  entry->n_pending--;
+}
+
+/* Answer the /migrate, if any, and send on the requests held
+   meanwhile, to wherever the game is now. */
+static void
+finish_migration (Migration *migration,
+                  DskHttpStatus status,
+                  const char *message)
+{
+  unsigned i;
+  migration_entry_done (migration->game);
+  for (i = 0; i < migration->n_users; i++)
+    migration_entry_done (migration->users[i]);
+  if (migration->request != NULL)
+    {
+      if (status == DSK_HTTP_STATUS_OK)
+        {
+          DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+          options.content_type = "text/plain";
+          options.content_length = strlen (message);
+          options.content_body = (const uint8_t *) message;
+          dsk_http_server_request_respond (migration->request, &options);
+        }
+      else
+        dsk_http_server_request_respond_error (migration->request, status, message);
+    }
+  for (i = 0; i < migration->n_held; i++)
+    migration->held[i].handler (migration->held[i].request);
+  dsk_buffer_clear (&migration->form);
+  dsk_free (migration->users);
+  dsk_free (migration->held);
+  dsk_free (migration);
+  n_migrations--;
+}
+
+static void
+handle_rollback_response (Fetch *fetch)
+{
+  Migration *migration = fetch->data;
+  char buf[512];
+  if (fetch->status != 200)
+    {
+      dsk_warning ("could not move game %s back to %s either: it is lost",
+                   migration->game->name, migration->source->name);
+      snprintf (buf, sizeof (buf), "game %s was lost", migration->game->name);
+    }
+  else
+    snprintf (buf, sizeof (buf), "game %s could not be moved to %s",
+              migration->game->name, migration->target->name);
+  finish_migration (migration, DSK_HTTP_STATUS_BAD_GATEWAY, buf);
+}
+
+static void
+handle_import_response (Fetch *fetch)
+{
+  Migration *migration = fetch->data;
+  Backend *target = migration->target;
+  const char *at = fetch->body, *elt;
+  char buf[512];
+  unsigned i;
+  if (fetch->status != 200)
+    {
+      /* put it back where it was */
+      dsk_warning ("error moving game %s to %s: %s",
+                   migration->game->name, target->name,
+                   fetch->status ? fetch->body : "not responding");
+      fetch_start (migration->source, "/import", NULL, NULL, &migration->form,
+                   handle_rollback_response, migration);
+      return;
+    }
+
+  directory_set (&game_directory, migration->game->name, target, fetch->serial);
+  for (i = 0; i < migration->n_users; i++)
+    directory_set (&user_directory, migration->users[i]->name, target, fetch->serial);
+
+  /* players who joined since the lobby was last polled */
+  while ((elt = json_array_next (&at)) != NULL)
+    {
+      char *name = parse_json_string (elt);
+      if (name != NULL)
+        directory_set (&user_directory, name, target, fetch->serial);
+      dsk_free (name);
+    }
+  target->n_games++;
+  target->n_placed++;
+  if (migration->source->n_games > 0)
+    migration->source->n_games--;
+  snprintf (buf, sizeof (buf), "game %s moved from %s to %s",
+            migration->game->name, migration->source->name, target->name);
+  finish_migration (migration, DSK_HTTP_STATUS_OK, buf);
+}
+
+static void
+handle_export_response (Fetch *fetch)
+{
+  Migration *migration = fetch->data;
+  if (fetch->status != 200)
+    {
+      char buf[512];
+      snprintf (buf, sizeof (buf), "game %s could not be taken from %s: %s",
+                migration->game->name, migration->source->name,
+                fetch->status ? fetch->body : "not responding");
+      finish_migration (migration,
+                        fetch->status ? fetch->status : DSK_HTTP_STATUS_BAD_GATEWAY,
+                        buf);
+      return;
+    }
+  dsk_buffer_append_string (&migration->form, "state=");
+  append_urlencoded (&migration->form, fetch->body, fetch->body_length);
+  fetch_start (migration->target, "/import", NULL, NULL, &migration->form,
+               handle_import_response, migration);
+}
+
+/* Move 'game' to 'target'.  Its requests are held from now
+   until the new backend has it, or the old one has it back. */
+static void
+start_migration (DirectoryEntry *game,
+                 Backend *target,
+                 DskHttpServerRequest *request)
+{
+  Migration *migration = dsk_malloc0 (sizeof (Migration));
+  const char *at = game->backend->lobby;
+  const char *entry;
+  DskBuffer path = DSK_BUFFER_STATIC_INIT;
+  char *path_str;
+
+  migration->game = game;
+  migration->source = game->backend;
+  migration->target = target;
+  migration->request = request;
+  game->migration = migration;
+  game->n_pending++;
+  n_migrations++;
+
+  /* the players, so their /updates are held too */
+  while (at != NULL && (entry = json_array_next (&at)) != NULL)
+    {
+      const char *name_at = json_member (entry, "name");
+      const char *players = json_member (entry, "players");
+      const char *player;
+      char *name = name_at ? parse_json_string (name_at) : NULL;
+      dsk_boolean is_game = name != NULL && strcmp (name, game->name) == 0;
+      dsk_free (name);
+      if (!is_game)
+        continue;
+      while (players != NULL && (player = json_array_next (&players)) != NULL)
+        {
+          char *user_name = parse_json_string (player);
+          DirectoryEntry *user = user_name ? directory_lookup (user_directory, user_name) : NULL;
+          dsk_free (user_name);
+          if (user == NULL || user->backend != game->backend || user->migration != NULL)
+            continue;
+          user->migration = migration;
+          user->n_pending++;
+          migration->users = dsk_realloc (migration->users,
+                                          sizeof (DirectoryEntry *) * (migration->n_users + 1));
+          migration->users[migration->n_users++] = user;
+        }
+      break;
+    }
+
+  dsk_buffer_append_string (&path, "/export?game=");
+  append_urlencoded (&path, game->name, strlen (game->name));
+  path_str = dsk_buffer_empty_to_string (&path);
+  fetch_start (migration->source, path_str, NULL, NULL, NULL,
+               handle_export_response, migration);
+  dsk_free (path_str);
+}
+
+/* If a backend is overloaded, move its busiest game somewhere it
+   would make things better rather than just move the problem. */
+static void
+maybe_migrate (void)
+{
+  Backend *source = NULL, *target;
+  DirectoryEntry *game;
+  unsigned i;
+  if (migrate_cooldown > 0)
+    {
+      migrate_cooldown--;
+      return;
+    }
+  if (n_migrations > 0 || admin_token == NULL)
+    return;
+  for (i = 0; i < n_backends; i++)
+    if (backends[i].alive
+     && backends[i].busiest_game != NULL
+     && (source == NULL || backends[i].load > source->load))
+      source = backends + i;
+  if (source == NULL || source->load <= MIGRATE_LOAD)
+    return;
+  target = choose_backend (source);
+  if (target == NULL || target->load + source->busiest_load >= source->load)
+    return;
+  game = directory_lookup (game_directory, source->busiest_game);
+  if (game == NULL || game->backend != source || game->migration != NULL)
+    return;
+  dsk_warning ("%s is overloaded: moving game %s to %s",
+               source->name, game->name, target->name);
+  start_migration (game, target, NULL);
+  migrate_cooldown = MIGRATE_COOLDOWN_POLLS;
+}
+
+static Backend *
+find_backend (const char *name)
+{
+  unsigned i;
+  for (i = 0; i < n_backends; i++)
+    if (strcmp (backends[i].name, name) == 0)
+      return backends + i;
+  return NULL;
+}
+
+/* As in server.c: compares in a time that depends on their
+   length, but not on where they differ. */
+static dsk_boolean
+tokens_equal (const char *a, const char *b)
+{
+  size_t length = strlen (b);
+  unsigned diff = 0;
+  size_t i;
+  if (strlen (a) != length)
+    return DSK_FALSE;
+  for (i = 0; i < length; i++)
+    diff |= (unsigned char) a[i] ^ (unsigned char) b[i];
+  return diff == 0;
+}
+
+static void
+handle_migrate_game (DskHttpServerRequest *request)
+{
+  const char *token = request_header (request, "X-Admin-Token");
+  DskCgiVariable *game_var, *to_var;
+  DirectoryEntry *game;
+  Backend *target;
+  char buf[512];
+  if (admin_token == NULL || token == NULL || !tokens_equal (token, admin_token))
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_FORBIDDEN,
+                                             admin_token == NULL
+                                             ? "no --admin-token was given"
+                                             : "bad X-Admin-Token");
+      return;
+    }
+  if ((game_var = require_cgi (request, "game")) == NULL
+   || (game = require_entry (request, game_directory, "game", game_var->value)) == NULL)
+    return;
+  if (game->migration != NULL)
+    {
+      snprintf (buf, sizeof (buf), "game %s is already being moved", game->name);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_CONFLICT, buf);
+      return;
+    }
+  to_var = dsk_http_server_request_lookup_cgi (request, "to");
+  if (to_var != NULL)
+    {
+      target = find_backend (to_var->value);
+      if (target == NULL)
+        {
+          snprintf (buf, sizeof (buf), "no backend %s", to_var->value);
+          dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+          return;
+        }
+    }
+  else
+    target = choose_backend (game->backend);
+  if (target == NULL || target == game->backend)
+    {
+      snprintf (buf, sizeof (buf), "nowhere to move game %s", game->name);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  start_migration (game, target, request);
+}
+
+static DSK_CMDLINE_CALLBACK_DECLARE (handle_backend)
+{
+  Backend *backend;
+  const char *colon = strchr (arg_value, ':');
+  char host[64];
+  DSK_UNUSED (arg_name);
+  DSK_UNUSED (callback_data);
+
+  backends = dsk_realloc (backends, sizeof (Backend) * (n_backends + 1));
+  backend = backends + n_backends;
+  memset (backend, 0, sizeof (Backend));
+  backend->addr.sin_family = AF_INET;
+  if (colon == NULL)
+    strcpy (host, "127.0.0.1");
+  else if ((size_t) (colon - arg_value) < sizeof (host))
+    {
+      memcpy (host, arg_value, colon - arg_value);
+      host[colon - arg_value] = 0;
+    }
+  else
+    host[0] = 0;
+  if (inet_pton (AF_INET, host, &backend->addr.sin_addr) != 1)
+    {
+      dsk_set_error (error, "bad backend address %s", arg_value);
+      return DSK_FALSE;
+    }
+  backend->addr.sin_port = htons (atoi (colon ? colon + 1 : arg_value));
+  backend->name = dsk_strdup (arg_value);
+  n_backends++;
+  return DSK_TRUE;
+}
+
+typedef struct _Handler Handler;
+struct _Handler
+{
+  const char *pattern;
+  void (*handler) (DskHttpServerRequest *request);
+};
+static Handler handlers[] = {
+  { "/games(\\?.*)?", handle_get_games_list },
+  { "/join\\?.*", handle_join_existing_game },
+  { "/newgame\\?.*", handle_create_new_game },
+  { "/update\\?.*", handle_update_game },
+  { "/watch\\?.*", handle_watch_game },
+  { "/leave\\?.*", handle_leave_game },
+  { "/destroy\\?.*", handle_destroy_game },
+  { "/migrate\\?.*", handle_migrate_game },
+  { ".*", handle_other },
+};
+
+/* Each handler is registered with its entry as its data. */
+static void
+run_handler (DskHttpServerRequest *request, void *data)
+{
+  Handler *handler = data;
+  handler->handler (request);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned port = 0;
+  DskHttpServer *server;
+  unsigned i;
+  DskError *error = NULL;
+
+  dsk_cmdline_init ("snipez router", "Spread snipez games over several servers", NULL, 0);
+  dsk_cmdline_add_uint ("port", "Port Number",
+                        "PORT", DSK_CMDLINE_MANDATORY, &port);
+  dsk_cmdline_add_func ("backend", "Address of a snipez server",
+                        "[HOST:]PORT", DSK_CMDLINE_MANDATORY|DSK_CMDLINE_REPEATABLE,
+                        handle_backend, NULL);
+  dsk_cmdline_add_string ("admin-token", "The Backends' --admin-token, to Move Games",
+                          "TOKEN", 0, &admin_token);
+  dsk_cmdline_add_shortcut ('p', "port");
+  dsk_cmdline_add_shortcut ('b', "backend");
+  dsk_cmdline_process_args (&argc, &argv);
+
+  poll_timer_callback (NULL);
+
+  server = dsk_http_server_new ();
+  for (i = 0; i < DSK_N_ELEMENTS (handlers); i++)
+    {
+      dsk_http_server_match_save (server);
+      dsk_http_server_add_match (server, DSK_HTTP_SERVER_MATCH_PATH,
+                                 handlers[i].pattern);
+      dsk_http_server_register_cgi_handler (server, run_handler,
+                                            handlers + i, NULL);
+      dsk_http_server_match_restore (server);
+    }
+  if (!dsk_http_server_bind_tcp (server, NULL, port, &error))
+    dsk_die ("error binding to port %u: %s", port, error->message);
+
+  return dsk_main_run ();
+}
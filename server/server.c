@@ -12,18 +12,127 @@
      /newgame -- create a new game
      /join    -- join a game, receive init screen
      /update  -- offer key info, update screen
+     /watch   -- spectate part of a game
      /leave   -- leave a game
+     /destroy -- end a game, for administrators
+     /stats   -- how busy this server is, for the router (see router.c)
+     /export  -- freeze a game and return its state, for migration
+     /import  -- start a game from its state, for migration
+   /destroy, /export and /import need the --admin-token, as X-Admin-Token.
  */
 
+/* THREADS:
+     The simulation runs on its own thread, which owns the timer wheel
+     and ticks every game.  At the end of a frame tick it copies the
+     game's entities into a FrameSnapshot and hands it to the render
+     thread, which renders it while the next tick runs.  Everything
+     else -- HTTP, the lobby, parked requests, serialization and
+     compression -- runs in the dsk main loop, the network thread; the
+     other threads use nothing of dsk but its allocator, warnings and
+     JSON values.  Players' inputs cross in per-user mailboxes, and
+     rendered frames come back as JSON values through a
+     single-producer, single-consumer queue.
+
+     world_lock is held by the simulation while it ticks a game, and by
+     the network thread while it changes structure (games, users,
+     spectated regions) or takes a snapshot for a first frame.  Only
+     the network thread changes structure, so it may read it without
+     the lock.  Rendering reads only snapshots and what never changes
+     after a game is created: its maze and rules.
+
+     With --region-threads, big games are divided into regions, and
+     the simulation thread has helpers move their enemies region by
+     region; see run_regions().  The helpers run only while the
+     simulation thread waits for them, holding world_lock. */
+
 /* size of a single tile in pixels */
 #define TILE_SIZE       9
 
 /* size of the cell in the maze, in tiles */
 #define CELL_SIZE       10
 
-/* period for update timer */
+/* target period for update timer */
 static unsigned update_period_msecs = 50;
 
+/* threads, including the simulation thread, to run big games' regions */
+static unsigned region_thread_count = 1;
+
+/* players who ask for nothing for this long are removed; 0 for never */
+static unsigned idle_timeout_secs = 60;
+
+/* When the games together would use more than LOAD_TARGET of the
+   render thread at their target rates, every game sends frames less
+   often, up to every MAX_FRAME_INTERVAL ticks.  When they would use
+   more than LOAD_TARGET of either thread, every game's period is
+   stretched by the same factor, up to MAX_PERIOD_STRETCH, so that all
+   games slow down a bit rather than some stalling. */
+#define LOAD_TARGET             0.70
+#define MAX_PERIOD_STRETCH      4.0
+#define MAX_FRAME_INTERVAL      4
+#define REBALANCE_PERIOD_USECS  250000
+#define TICK_COST_SMOOTHING     0.125
+
+/* granularity of the game scheduler's timer wheel */
+#define WHEEL_RESOLUTION_USECS  5000
+
+/* an /update or /watch request parked waiting for a frame
+   gets an empty 204 response after this long */
+#define PENDING_TIMEOUT_USECS   2000000
+
+/* Frames from the simulation are sent FLUSH_BATCH per main-loop
+   turn, so that socket writes and new requests interleave with a big
+   fan-out; anything still unsent FLUSH_LATENCY_BUDGET_USECS after it
+   was rendered is sent at once. */
+#define FLUSH_BATCH                     16
+#define FLUSH_LATENCY_BUDGET_USECS      15000
+
+/* Frames at least this big are gzipped for clients that accept it,
+   at a level between these, lower as the server gets busier. */
+#define FRAME_COMPRESS_MIN_SIZE         256
+#define FRAME_COMPRESS_MIN_LEVEL        1
+#define FRAME_COMPRESS_MAX_LEVEL        6
+
+/* canvas sizes clients may ask for, in pixels */
+#define DEFAULT_CANVAS_WIDTH            700
+#define DEFAULT_CANVAS_HEIGHT           400
+#define MIN_CANVAS_SIZE                 100
+#define MAX_CANVAS_SIZE                 4096
+
+/* views of more cells than this get overview frames */
+#define OVERVIEW_MIN_CELLS              400
+
+/* bullets and enemies are left out of frames past this many elements */
+#define MAX_FRAME_ELEMENTS              3000
+
+/* In fog-of-war games, players only see into cells within FOG_RADIUS
+   cells (in x and y) of their own that some line of sight reaches. */
+#define FOG_RADIUS                      4
+#define FOG_WINDOW                      (2 * FOG_RADIUS + 1)
+#define FOG_WORDS                       ((FOG_WINDOW * FOG_WINDOW + 31) / 32)
+
+/* a spectated region nobody has asked for in this many frames is dropped */
+#define WATCH_IDLE_FRAMES               100
+
+/* Spectators' canvas sizes are rounded up to whole cells, so that
+   spectators of a region with similar windows share its frames;
+   a game has at most MAX_WATCHES_PER_GAME spectated regions. */
+#define WATCH_SIZE_STEP                 (CELL_SIZE * TILE_SIZE)
+#define MAX_WATCHES_PER_GAME            64
+
+/* frames are only rendered for users and spectated regions
+   that have been polled within this many frames */
+#define POLL_IDLE_FRAMES                8
+
+/* rendered frames in flight to the network thread; a power of two */
+#define FRAME_QUEUE_SIZE                16384
+
+/* how often the network thread times out parked requests
+   and drops idle spectated regions */
+#define HOUSEKEEPING_MILLIS             250
+
+/* The balance of the game, which games may change in their GameRules;
+   see --batch-sim for trying out others. */
+
 /* number of updates dying lasts for */
 #define DEAD_TIME       20
 
@@ -33,27 +142,114 @@ static unsigned update_period_msecs = 50;
 /* minimum turns in between bullet fires */
 #define BULLET_BLOCK_PERIOD 3
 
-/* enemies move random in 1/2 of cycles */
+/* enemies move in 1/2 of cycles */
 #define ENEMY_MOVE_FRACTION    0.5
 
+/* chance a generator tries to make an enemy in each cycle */
+#define GENERATOR_PROB         0.01
+
+/* enemies within this many tiles (by path length) of a user chase them;
+   further out, they wander randomly.  Must be less than
+   FLOW_FIELD_UNREACHED. */
+#define FLOW_FIELD_RADIUS      40
+#define FLOW_FIELD_UNREACHED   255
+
+/* enemies and generators in cells within ACTIVITY_MARGIN_CELLS of some
+   user's viewport run every update; those within
+   ACTIVITY_REDUCED_MARGIN_CELLS run every ACTIVITY_REDUCED_PERIOD updates;
+   the rest are parked. */
+#define ACTIVITY_MARGIN_CELLS           2
+#define ACTIVITY_REDUCED_MARGIN_CELLS   6
+#define ACTIVITY_REDUCED_PERIOD         4
+
 /* size of maze */
 #define DEFAULT_UNIVERSE_WIDTH  24
 #define DEFAULT_UNIVERSE_HEIGHT 24
 
+/* entity positions are 16-bit, and moves are computed in signed 16-bit */
+#define MAX_UNIVERSE_TILES      32767
+
+/* the biggest maze /newgame?size= may ask for, in cells,
+   and the fewest cells it may have on a side: enough that
+   create_game()'s 12 to 17 generators fill at most half its cells */
+#define MAX_UNIVERSE_CELLS      (512 * 512)
+#define MIN_UNIVERSE_SIDE       6
+
+/* Games of at least REGION_MIN_CELLS cells are divided into regions
+   of at least REGION_MIN_ROWS rows of cells, up to REGIONS_PER_THREAD
+   per region thread, so that busy and quiet regions even out. */
+#define REGION_MIN_CELLS        4096
+#define REGION_MIN_ROWS         4
+#define REGIONS_PER_THREAD      4
+
 #include "../../dsk/dsk.h"
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
 
 /* XXX TODO: use better random number generator */
+/* Each thread has a generator of its own, so that a game made and
+   ticked by one thread after random_seed() plays out the same way
+   whatever other threads are doing; see --batch-sim. */
+static __thread unsigned random_state = 1;
+static void random_seed (unsigned seed)
+{
+  random_state = seed;
+}
 static unsigned random_int_range (unsigned max)
 {
-  return rand() % max;
+  return rand_r (&random_state) % max;
 }
 static double random_double (void)
 {
-  return (double)rand () / RAND_MAX;
+  return (double)rand_r (&random_state) / RAND_MAX;
+}
+
+/* Interleaved xorshift generators, so that a batch of
+   random numbers can be produced with vector instructions. */
+#define RANDOM_LANES    8
+typedef struct _RandomLanes RandomLanes;
+struct _RandomLanes
+{
+  uint32_t state[RANDOM_LANES];
+};
+
+static void
+random_lanes_init (RandomLanes *lanes)
+{
+  unsigned l;
+  for (l = 0; l < RANDOM_LANES; l++)
+    lanes->state[l] = rand_r (&random_state) | 1;
+}
+
+static void
+random_lanes_fill (RandomLanes *lanes, unsigned n, uint32_t *out)
+{
+  uint32_t tmp[RANDOM_LANES];
+  unsigned i, l;
+  for (i = 0; i < n; i += RANDOM_LANES)
+    {
+      for (l = 0; l < RANDOM_LANES; l++)
+        {
+          uint32_t x = lanes->state[l];
+          x ^= x << 13;
+          x ^= x >> 17;
+          x ^= x << 5;
+          lanes->state[l] = tmp[l] = x;
+        }
+      memcpy (out + i, tmp,
+              sizeof (uint32_t) * (n - i < RANDOM_LANES ? n - i : RANDOM_LANES));
+    }
 }
 
 static unsigned
@@ -66,31 +262,204 @@ mod (int x, unsigned denom)
 }
 
 
+/* --- timer wheel ---
+   Two levels of WHEEL_SLOTS slots.  Level 0 holds the timers
+   expiring in the next WHEEL_SLOTS ticks, slot i those expiring at
+   the tick congruent to i; level 1 holds timers further out, one
+   slot per block of WHEEL_SLOTS ticks.  A block is cascaded down
+   into level 0 at the end of the tick before it starts, so that
+   timers due on its first tick run on time.  Knows nothing of the
+   main loop:
+   the owner calls timer_wheel_advance() at (or after) the time
+   returned by timer_wheel_next_expiry(). */
+#define WHEEL_SLOTS     64
+typedef struct _WheelTimer WheelTimer;
+typedef struct _TimerWheel TimerWheel;
+struct _WheelTimer
+{
+  WheelTimer *prev, *next;
+  WheelTimer **list;            /* NULL if not in the wheel */
+  uint64_t expire;              /* in wheel ticks */
+  void (*func) (void *data);
+  void *data;
+};
+struct _TimerWheel
+{
+  uint64_t now;                 /* last wheel tick processed */
+  unsigned n_timers;
+  unsigned n_in_slot[WHEEL_SLOTS];      /* level 0 only */
+  WheelTimer *slots[2][WHEEL_SLOTS];
+};
+
+static void
+timer_wheel_init (TimerWheel *wheel, uint64_t now_usecs)
+{
+  memset (wheel, 0, sizeof (TimerWheel));
+  wheel->now = now_usecs / WHEEL_RESOLUTION_USECS;
+}
+
+static void
+timer_wheel_link (TimerWheel *wheel, WheelTimer *timer)
+{
+  uint64_t delta;
+  WheelTimer **list;
+  if (timer->expire <= wheel->now)
+    timer->expire = wheel->now + 1;
+  delta = timer->expire - wheel->now;
+  if (delta <= WHEEL_SLOTS)
+    {
+      list = wheel->slots[0] + timer->expire % WHEEL_SLOTS;
+      wheel->n_in_slot[timer->expire % WHEEL_SLOTS]++;
+    }
+  else if (delta < WHEEL_SLOTS * WHEEL_SLOTS)
+    list = wheel->slots[1] + (timer->expire / WHEEL_SLOTS) % WHEEL_SLOTS;
+  else
+    /* too far out: park it in the last level-1 slot, to be
+       re-sorted when that slot cascades */
+    list = wheel->slots[1] + (wheel->now / WHEEL_SLOTS + WHEEL_SLOTS - 1) % WHEEL_SLOTS;
+  timer->list = list;
+  timer->prev = NULL;
+  timer->next = *list;
+  if (*list)
+    (*list)->prev = timer;
+  *list = timer;
+}
+
+/* Arrange for timer->func(timer->data) to be run once, at the
+   first wheel tick at or after expire_usecs. */
+static void
+timer_wheel_add (TimerWheel *wheel, WheelTimer *timer, uint64_t expire_usecs)
+{
+  dsk_assert (timer->list == NULL);
+  timer->expire = (expire_usecs + WHEEL_RESOLUTION_USECS - 1) / WHEEL_RESOLUTION_USECS;
+  timer_wheel_link (wheel, timer);
+  wheel->n_timers++;
+}
+
+/* Run every timer due by now_usecs.  Timers may re-add themselves. */
+static void
+timer_wheel_advance (TimerWheel *wheel, uint64_t now_usecs)
+{
+  uint64_t target = now_usecs / WHEEL_RESOLUTION_USECS;
+  while (wheel->now < target)
+    {
+      WheelTimer *list;
+      unsigned slot;
+      wheel->now++;
+
+      /* detach the whole slot first, so that timers
+         re-added for this same tick run next time round */
+      slot = wheel->now % WHEEL_SLOTS;
+      list = wheel->slots[0][slot];
+      wheel->slots[0][slot] = NULL;
+      wheel->n_in_slot[slot] = 0;
+      while (list)
+        {
+          WheelTimer *timer = list;
+          list = list->next;
+          timer->list = NULL;
+          wheel->n_timers--;
+          timer->func (timer->data);
+        }
+
+      if ((wheel->now + 1) % WHEEL_SLOTS == 0)
+        {
+          /* cascade the next block */
+          slot = ((wheel->now + 1) / WHEEL_SLOTS) % WHEEL_SLOTS;
+          list = wheel->slots[1][slot];
+          wheel->slots[1][slot] = NULL;
+          while (list)
+            {
+              WheelTimer *timer = list;
+              list = list->next;
+              timer_wheel_link (wheel, timer);
+            }
+        }
+    }
+}
+
+/* Returns the time in microseconds at which timer_wheel_advance()
+   next has work to do, or 0 if the wheel is empty. */
+static uint64_t
+timer_wheel_next_expiry (TimerWheel *wheel)
+{
+  uint64_t t;
+  if (wheel->n_timers == 0)
+    return 0;
+  for (t = wheel->now + 1; t % WHEEL_SLOTS != 0; t++)
+    if (wheel->slots[0][t % WHEEL_SLOTS] != NULL)
+      return t * WHEEL_RESOLUTION_USECS;
+  /* nothing before the next cascade */
+  return t * WHEEL_RESOLUTION_USECS;
+}
+
+/* Of the n wheel ticks starting at expire_usecs, return the start
+   of the one with the fewest level-0 timers, to spread load. */
+static uint64_t
+timer_wheel_least_loaded (TimerWheel *wheel, uint64_t expire_usecs, unsigned n)
+{
+  uint64_t t = (expire_usecs + WHEEL_RESOLUTION_USECS - 1) / WHEEL_RESOLUTION_USECS;
+  uint64_t best = t;
+  unsigned i;
+  if (n > WHEEL_SLOTS - 1)
+    n = WHEEL_SLOTS - 1;
+  for (i = 0; i < n; i++, t++)
+    if (t > wheel->now
+     && t - wheel->now < WHEEL_SLOTS
+     && wheel->n_in_slot[t % WHEEL_SLOTS] < wheel->n_in_slot[best % WHEEL_SLOTS])
+      best = t;
+  return best * WHEEL_RESOLUTION_USECS;
+}
+
 typedef struct _User User;
-typedef struct _Enemy Enemy;
-typedef struct _Bullet Bullet;
 typedef struct _Generator Generator;
 typedef struct _Cell Cell;
 typedef struct _Game Game;
+typedef struct _Watch Watch;
+
+/* Rules chosen when a game is created.  Each combination of the
+   first four gets its own compiled copy of the update loop; see
+   DEFINE_GAME_TICK.  'fog' only affects rendering.  The balance
+   is only changed by --batch-sim, so it is not migrated. */
+typedef struct _GameRules GameRules;
+struct _GameRules
+{
+  dsk_boolean wrap;
+  dsk_boolean diag_bullets_bounce;
+  dsk_boolean bullet_kills_player;
+  dsk_boolean bullet_kills_generator;
+  dsk_boolean fog;
 
-typedef struct _PendingUpdate PendingUpdate;
-
-static DskJsonValue * create_user_update (User                 *user);
-static void           respond_take_json  (DskHttpServerRequest *request,
-                                          DskJsonValue         *value);
+  /* the balance */
+  unsigned dead_time;
+  unsigned bullet_speed;
+  double enemy_move_fraction;
+  double generator_prob;                /* for new generators */
+};
+#define GAME_RULES_DEFAULT { DSK_TRUE, DSK_TRUE, DSK_TRUE, DSK_TRUE, DSK_FALSE, \
+                             DEAD_TIME, BULLET_SPEED, ENEMY_MOVE_FRACTION, GENERATOR_PROB }
 
 typedef enum
 {
-  OBJECT_TYPE_USER,
-  OBJECT_TYPE_BULLET,
-  OBJECT_TYPE_ENEMY
-} ObjectType;
-#define N_OBJECT_TYPES  3
-
+  CELL_PARKED,
+  CELL_REDUCED,
+  CELL_ACTIVE
+} CellActivity;
+
+static void           respond_user_update(DskHttpServerRequest *request,
+                                          User                 *user);
+static void           respond_no_content (DskHttpServerRequest *request);
+static void           lobby_changed      (Game                 *game);
+static void           take_frame_snapshot(Game                 *game);
+static void           destroy_retired_games (void);
+static void           remove_idle_users  (void);
+static void           free_departed_users(Game                 *game);
+
+/* Users are few, and kept in ordinary linked lists;
+   see EntityPool for enemies and bullets. */
 typedef struct _Object Object;
 struct _Object
 {
-  ObjectType type;
   Object *prev_in_game, *next_in_game;
   Object *prev_in_cell, *next_in_cell;
   Game *game;
@@ -102,9 +471,15 @@ struct _User
   Object base;
 
   char *name;
-  unsigned width, height;               /* canvas width, height */
 
-  unsigned last_seen_time;
+  /* Mailbox, written by the network thread and read by the simulation
+     at the start of each tick; see pack_user_input(). */
+  uint32_t input;
+  uint32_t canvas;                      /* width << 16 | height */
+  unsigned last_polled;                 /* Game::latest_frame at the last /update */
+
+  /* the simulation's copy of the mailbox */
+  unsigned width, height;               /* canvas width, height */
   int move_x, move_y;
 
   unsigned bullet_block;
@@ -112,23 +487,65 @@ struct _User
 
   unsigned dead_count;
 
-  /* if you connect and you already have gotten the latest
-     screen, we make you wait for the next update. */
-  unsigned last_update;
+  /* position last contributed to the game's flow field */
+  dsk_boolean in_flow_field;
+  unsigned flow_x, flow_y;
+
+  /* The rest belongs to the network thread.
+     if you connect and you already have gotten the latest
+     frame, we make you wait for the next one.
+     At most one request waits per user; a newer one replaces it. */
+  DskJsonValue *frame;                  /* newest unsent frame, or NULL */
+  unsigned frame_number;
+  unsigned last_frame;                  /* last frame sent */
+  unsigned last_seq;
+  DskHttpServerRequest *pending_request;
+  uint64_t pending_deadline;
+  User *prev_pending, *next_pending;
+  unsigned last_seen_time;              /* of the last request; see --idle-timeout */
+
+  /* Once out of the game, it waits in Game::departed_users until no
+     snapshot or queued frame can refer to it; see remove_user(). */
+  dsk_boolean departed;
+  dsk_boolean departed_queue_marked;
+  unsigned departed_queue_head;
 };
 
-struct _Enemy
+typedef enum
 {
-  Object base;
-};
-
-struct _Bullet
+  ENTITY_ENEMY,
+  ENTITY_BULLET
+} EntityKind;
+#define N_ENTITY_KINDS  2
+
+/* index used to terminate per-cell entity lists */
+#define ENTITY_NONE     ((uint32_t) -1)
+
+/* bullet velocities (max 1 -- see bullet speed), two bits per axis */
+#define PACK_VELOCITY(dx, dy)   ((uint8_t) (((dx) + 1) | (((dy) + 1) << 2)))
+#define VELOCITY_X(v)           ((int) ((v) & 3) - 1)
+#define VELOCITY_Y(v)           ((int) ((v) >> 2) - 1)
+
+/* Enemies and bullets live in dense structure-of-arrays pools, one per
+   kind per game, so the update loops stream through them.
+   Each cell threads a doubly-linked list of its entities through
+   prev_in_cell/next_in_cell.
+
+   A slot's generation is bumped whenever its entity dies or the slot is
+   refilled; it is odd while the slot is dead.  Killed entities leave
+   their cell immediately but keep their slot until
+   entity_pool_compact() swaps the last entity into each hole. */
+typedef struct _EntityPool EntityPool;
+struct _EntityPool
 {
-  Object base;
-  int move_x, move_y;           /* max 1 -- see bullet speed */
-  Bullet *next_in_cell, *prev_in_cell;
-  Bullet *next_in_game, *prev_in_game;
+  unsigned n_entities, n_alloced;
+  unsigned n_dead;
+  uint16_t *x, *y;
+  uint8_t *velocity;
+  uint16_t *generation;
+  uint32_t *prev_in_cell, *next_in_cell;
 };
+#define ENTITY_IS_ALIVE(pool, i)  (((pool)->generation[i] & 1) == 0)
 
 struct _Generator
 {
@@ -140,41 +557,260 @@ struct _Generator
 
 struct _Cell
 {
-  Object *objects[N_OBJECT_TYPES];
+  Object *users;
+  uint32_t entities[N_ENTITY_KINDS];    /* first in each pool, or ENTITY_NONE */
   Generator *generator;
 };
 
+/* A band of whole rows of cells, whose enemies are moved by one
+   region thread; see run_regions(). */
+typedef struct _Region Region;
+struct _Region
+{
+  unsigned first_row, n_rows;
+  unsigned color;                       /* neighbours' colors differ */
+  unsigned n_enemies, enemies_alloced;
+  uint32_t *enemies;                    /* in the region this update */
+};
+
+/* Frames are rendered from snapshots.  At the end of each frame tick
+   the simulation copies what rendering needs -- where everything is,
+   sorted by cell -- into one of the game's two snapshots and hands it
+   to the render thread, then gets on with the next tick.  Walls never
+   change, so they are read from the Game itself. */
+typedef enum
+{
+  SNAPSHOT_BULLET,
+  SNAPSHOT_USER,
+  SNAPSHOT_ENEMY,
+  SNAPSHOT_GENERATOR
+} SnapshotKind;
+
+typedef struct _SnapshotThing SnapshotThing;
+struct _SnapshotThing
+{
+  uint16_t x, y;
+  uint8_t kind;                         /* a SnapshotKind */
+  User *user;                           /* SNAPSHOT_USER only */
+};
+
+/* a view to be rendered, for a user or a spectated region */
+typedef struct _RenderTarget RenderTarget;
+struct _RenderTarget
+{
+  User *user;
+  Watch *watch;
+  int view_x, view_y;
+  unsigned width, height;
+};
+
+typedef struct _FrameSnapshot FrameSnapshot;
+struct _FrameSnapshot
+{
+  Game *game;
+  unsigned frame_number, latest_update;
+  unsigned period_usecs, frame_interval;
+
+  /* the things in cell i are things[cell_start[i] .. cell_start[i+1]-1],
+     in the order they are drawn.  A snapshot of one view, which has
+     view_cell_width set, numbers the view's cells instead, row by row
+     from min_cell_x,min_cell_y; see snapshot_take_view(). */
+  uint32_t *cell_start;
+  unsigned view_cell_width;             /* 0 for the whole universe */
+  unsigned n_things, things_alloced;
+  SnapshotThing *things;
+
+  unsigned n_targets, targets_alloced;
+  RenderTarget *targets;
+
+  int busy;                             /* with the render thread; atomic */
+  uint64_t render_usecs;                /* how long the render thread took */
+  FrameSnapshot *next_job;
+};
+
+/* A game's arena: blocks from which what is sized by its maze, and
+   lives as long as it does, is allocated; see arena_alloc(). */
+typedef struct _ArenaChunk ArenaChunk;
+struct _ArenaChunk
+{
+  ArenaChunk *next;
+  size_t size, used;                    /* not counting this header */
+};
+
 struct _Game
 {
   char *name;
   Game *next_game;
+  ArenaChunk *arena;
 
   unsigned universe_width, universe_height;     // in cells
   uint8_t *h_walls;             /* universe_height x universe_width */
   uint8_t *v_walls;             /* universe_height x universe_width */
 
-  Object *objects[N_OBJECT_TYPES];
+  /* one bit per tile, set if the tile is wall (including corner posts
+     and the wrap seams); bit (y * universe_width * CELL_SIZE + x) */
+  uint32_t *wall_bits;
+
+  /* fog only: FOG_WORDS per cell, bit (dy+FOG_RADIUS)*FOG_WINDOW+dx+FOG_RADIUS
+     set if the cell dx,dy away can be seen into; computed on first use,
+     as flagged in visibility_known.  See cell_visibility(). */
+  uint32_t *visibility;
+  uint8_t *visibility_known;
+
+  Object *users;
+  EntityPool pools[N_ENTITY_KINDS];
 
   Cell *cells;               /* universe_height x universe_width */
   Generator *generators;
-  dsk_boolean wrap;
-  dsk_boolean diag_bullets_bounce;
-  dsk_boolean bullet_kills_player;
-  dsk_boolean bullet_kills_generator;
+  GameRules rules;
+  void (*tick) (Game *game);    /* specialized for 'rules' */
 
   unsigned latest_update;
-  PendingUpdate *pending_updates;
-
-  DskDispatchTimer *timer;
+  unsigned latest_frame;
+  char *lobby_entry;                    /* serialized for /games; NULL if stale */
+  Watch *watches;                       /* spectated regions */
+  unsigned n_watches;
+
+  User *pending_users;                  /* waiting for the next frame */
+  User *departed_users;                 /* left, but not yet freed; see remove_user() */
+  Game *next_starting;                  /* in starting_games */
+
+  /* Distance in tiles to the nearest live user, shared by all enemies.
+     Indexed by tile (y * universe_width * CELL_SIZE + x);
+     FLOW_FIELD_UNREACHED for walls and tiles beyond FLOW_FIELD_RADIUS. */
+  uint8_t *flow_field;
+  uint8_t *flow_dirty;                  /* scratch; all zero between updates */
+  unsigned *flow_scratch;
+  unsigned flow_scratch_alloced;
+  dsk_boolean flow_stale;               /* a user left: recompute it all */
+
+  /* CellActivity for each cell, recomputed every update */
+  uint8_t *cell_activity;               /* universe_height x universe_width */
+
+  /* regions, if the game is big enough to divide; see run_regions() */
+  unsigned n_regions, n_region_colors;
+  Region *regions;
+  uint16_t *row_regions;                /* region of each row of cells */
+
+  /* scratch for moving a whole pool at once */
+  RandomLanes random;
+  unsigned n_move_scratch;
+  int16_t *proposed_x, *proposed_y;
+  uint32_t *random_words;
+  uint8_t *move_occupancy;              /* OccType of each enemy's proposal */
+
+  /* for each tile, a bit for each direction enemies are proposing to
+     enter it from; see claim_enemy_move().  All zero between updates. */
+  uint8_t *move_claims;
+
+  /* scheduling: times are CLOCK_MONOTONIC microseconds, and
+     costs are smoothed over recent ticks */
+  WheelTimer tick_timer;                /* in game_wheel */
+  unsigned target_period_usecs;
+  unsigned period_usecs;                /* target, stretched under load */
+  uint64_t next_tick_usecs;             /* deadline; advanced by period_usecs */
+  double sim_cost_usecs;                /* per tick */
+  double snapshot_cost_usecs;           /* per frame, on the simulation thread */
+  double frame_cost_usecs;              /* per frame, on the render thread */
+  unsigned frame_interval;              /* send frames every Nth tick */
+
+  FrameSnapshot snapshots[2];           /* filled alternately */
+  unsigned next_snapshot;
+
+  /* Migration: a frozen game is no longer ticked, and once the
+     simulation has seen that, it is stopped.  It is then in
+     retired_games until nothing refers to it; see retire_game(). */
+  dsk_boolean frozen, stopped;          /* under world_lock */
+  dsk_boolean retire_queue_marked;
+  unsigned retire_queue_head;           /* frame_queue_head, once stopped */
+  Game *next_retired;
 };
 static Game *all_games;
 
-struct _PendingUpdate
+/* common factor applied to all games' target periods */
+static double period_stretch = 1.0;
+static uint64_t next_rebalance_usecs;
+
+/* gzip level for frames, from the load measured by rebalance_games();
+   set by the simulation thread and read by the network thread */
+static int frame_compression_level = FRAME_COMPRESS_MAX_LEVEL;
+
+/* the last loads measured by rebalance_games(), in thousandths
+   of LOAD_TARGET, for /stats */
+static unsigned sim_load_permille, render_load_permille;
+
+/* Spectators (/watch) of one region of a game.  Spectators don't
+   appear in the world, and all spectators of a region share one
+   rendering, serialization and compression of each frame. */
+struct _Watch
 {
-  User *user;
-  DskHttpServerRequest *request;
-  PendingUpdate *next;
+  Game *game;
+  int view_x, view_y;                   /* tile at the center of the view */
+  unsigned width, height;               /* in pixels */
+
+  /* the latest frame, serialized, and perhaps gzipped */
+  dsk_boolean has_frame;
+  unsigned frame_number;                /* Game::latest_frame when rendered */
+  uint8_t *frame, *frame_gzipped;
+  unsigned frame_length, frame_gzipped_length;
+
+  unsigned last_wanted;                 /* Game::latest_frame when last requested */
+  unsigned frames_queued;               /* in frame_queue; atomic */
+  unsigned n_waiting;                   /* read by the simulation; atomic */
+  unsigned waiting_alloced;
+  DskHttpServerRequest **waiting;
+  uint64_t waiting_deadline;            /* when the first waiting gets a 204 */
+  Watch *next_in_game;
+};
+
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t visibility_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* All game ticks run from one wheel, turned by the simulation
+   thread, which sleeps on sim_wakeup in between.  Games due in the
+   same WHEEL_RESOLUTION_USECS slot are run in the same wakeup.
+   New games are handed over in starting_games. */
+static TimerWheel game_wheel;
+static pthread_t sim_thread;
+static pthread_cond_t sim_wakeup;
+static Game *starting_games;            /* under world_lock */
+
+/* frozen games, waiting to be freed; see retire_game() */
+static Game *retired_games;
+
+/* Snapshots waiting for the render thread, oldest first. */
+static pthread_t render_thread;
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_wakeup = PTHREAD_COND_INITIALIZER;
+static FrameSnapshot *render_jobs, **render_jobs_tail = &render_jobs;
+
+/* Rendered frames, from the render thread to the network thread.
+   Only the render thread writes frame_queue_head, and only the network
+   thread writes frame_queue_tail.  A byte on the wakeup pipe, sent
+   when frame_queue_signalled goes from 0 to 1, gets the main loop
+   to start flush_idle, which drains the queue. */
+typedef struct _FrameMessage FrameMessage;
+struct _FrameMessage
+{
+  User *user;                           /* exactly one of user and watch */
+  Watch *watch;
+  unsigned frame_number;
+  DskJsonValue *frame;
+  uint64_t rendered_usecs;
 };
+static FrameMessage frame_queue[FRAME_QUEUE_SIZE];
+static unsigned frame_queue_head, frame_queue_tail;
+static int frame_queue_signalled;
+static int frame_queue_wakeup_fds[2];
+static DskDispatchIdle *flush_idle;
+
+static uint64_t
+get_monotonic_usecs (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 static int
 int_div (int a, unsigned b)
@@ -189,12 +825,67 @@ int_div (int a, unsigned b)
     return a/b;
 }
 
-/* --- Creating a new game --- */
-static uint8_t *generate_ones (unsigned count)
+/* --- game arenas --- */
+#define ARENA_ALIGN             16
+#define ARENA_CHUNK_HEADER      ((sizeof (ArenaChunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+#define ARENA_MIN_CHUNK_SIZE    4096
+
+/* Start a new chunk with room for 'size' bytes. */
+static void
+arena_reserve (ArenaChunk **arena_inout, size_t size)
+{
+  ArenaChunk *chunk = dsk_malloc (ARENA_CHUNK_HEADER + size);
+  chunk->next = *arena_inout;
+  chunk->size = size;
+  chunk->used = 0;
+  *arena_inout = chunk;
+}
+
+/* Allocate from the newest chunk, or a new one if it is full.
+   Nothing is freed until arena_free(), so alloc_game() reserves
+   room for all of a game's maze-sized arrays up front. */
+static void *
+arena_alloc (ArenaChunk **arena_inout, size_t size)
+{
+  ArenaChunk *chunk;
+  void *rv;
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (*arena_inout == NULL || (*arena_inout)->size - (*arena_inout)->used < size)
+    arena_reserve (arena_inout, DSK_MAX (size, ARENA_MIN_CHUNK_SIZE));
+  chunk = *arena_inout;
+  rv = (char *) chunk + ARENA_CHUNK_HEADER + chunk->used;
+  chunk->used += size;
+  return rv;
+}
+
+static void *
+arena_alloc0 (ArenaChunk **arena_inout, size_t size)
 {
-  return memset (dsk_malloc (count), 1, count);
+  return memset (arena_alloc (arena_inout, size), 0, size);
 }
 
+static size_t
+arena_size (ArenaChunk *arena)
+{
+  size_t rv = 0;
+  for (; arena != NULL; arena = arena->next)
+    rv += ARENA_CHUNK_HEADER + arena->size;
+  return rv;
+}
+
+static void
+arena_free (ArenaChunk *arena)
+{
+  while (arena != NULL)
+    {
+      ArenaChunk *next = arena->next;
+      dsk_free (arena);
+      arena = next;
+    }
+}
+
+/* --- Creating a new game --- */
+
 /* height * width * 2 [v, h] */
 typedef struct _TmpWall TmpWall;
 struct _TmpWall
@@ -242,41 +933,151 @@ static void swap_ints (unsigned *a, unsigned *b)
 }
 
 static void game_update_timer_callback (Game *game);
+static void compute_wall_bits (Game *game);
+static void divide_into_regions (Game *game);
+static void (*select_game_tick (const GameRules *rules)) (Game *game);
 
-static Game *
-create_game (const char *name,
-             unsigned    width,
-             unsigned    height)
+/* How many regions divide_into_regions() will make, or 0 if the
+   game is too small to divide. */
+static unsigned
+count_regions (unsigned width, unsigned height)
+{
+  unsigned n;
+  if (region_thread_count < 2 || width * height < REGION_MIN_CELLS)
+    return 0;
+  n = DSK_MIN (height / REGION_MIN_ROWS, region_thread_count * REGIONS_PER_THREAD);
+  return n < 2 ? 0 : n;
+}
 
+/* A game with no players, no generators, and walls everywhere. */
+static Game *
+alloc_game (const char      *name,
+            unsigned        width,
+            unsigned        height,
+            const GameRules *rules)
 {
   Game *game = dsk_malloc (sizeof (Game));
-  unsigned usize;
+  unsigned usize = width * height;
+  unsigned n_tiles = usize * CELL_SIZE * CELL_SIZE;
+  unsigned n_regions = count_regions (width, height);
   unsigned i;
 
+  /* one chunk for the walls, cells, per-tile arrays,
+     fog tables and regions */
+  game->arena = NULL;
+  arena_reserve (&game->arena,
+                 usize * (2 + sizeof (Cell) + 1) + n_tiles * 3
+                 + sizeof (uint32_t) * ((n_tiles + 31) / 32)
+                 + (rules->fog ? usize * (sizeof (uint32_t) * FOG_WORDS + 1) : 0)
+                 + (n_regions ? sizeof (Region) * n_regions
+                                + sizeof (uint16_t) * height : 0)
+                 + ARENA_ALIGN * 12);
+
   game->name = dsk_strdup (name);
-  game->next_game = all_games;
-  all_games = game;
+  game->next_game = NULL;
   game->universe_width = width;
   game->universe_height = height;
-  usize = width * height;
-  game->h_walls = generate_ones (usize);
-  game->v_walls = generate_ones (usize);
-  for (i = 0; i < N_OBJECT_TYPES; i++)
-    game->objects[i] = NULL;
+  game->h_walls = memset (arena_alloc (&game->arena, usize), 1, usize);
+  game->v_walls = memset (arena_alloc (&game->arena, usize), 1, usize);
+  game->wall_bits = NULL;
+  dsk_assert (width * CELL_SIZE <= MAX_UNIVERSE_TILES
+           && height * CELL_SIZE <= MAX_UNIVERSE_TILES);
+  game->users = NULL;
+  for (i = 0; i < N_ENTITY_KINDS; i++)
+    memset (game->pools + i, 0, sizeof (EntityPool));
   game->generators = NULL;
-  game->cells = dsk_malloc0 (sizeof (Cell) * width * height);
+  game->cells = arena_alloc (&game->arena, sizeof (Cell) * usize);
+  for (i = 0; i < usize; i++)
+    {
+      unsigned k;
+      game->cells[i].users = NULL;
+      for (k = 0; k < N_ENTITY_KINDS; k++)
+        game->cells[i].entities[k] = ENTITY_NONE;
+      game->cells[i].generator = NULL;
+    }
   game->latest_update = 0;
-  game->wrap = DSK_TRUE;
-  game->diag_bullets_bounce = DSK_TRUE;
-  game->bullet_kills_player = DSK_TRUE;
-  game->bullet_kills_generator = DSK_TRUE;
-  game->pending_updates = NULL;
+  game->latest_frame = 0;
+  game->lobby_entry = NULL;
+  game->watches = NULL;
+  game->n_watches = 0;
+  game->rules = *rules;
+  game->tick = select_game_tick (rules);
+  if (rules->fog)
+    {
+      game->visibility = arena_alloc (&game->arena, sizeof (uint32_t) * FOG_WORDS * usize);
+      game->visibility_known = arena_alloc0 (&game->arena, usize);
+    }
+  else
+    {
+      game->visibility = NULL;
+      game->visibility_known = NULL;
+    }
+  game->pending_users = NULL;
+  game->departed_users = NULL;
+  game->flow_field = memset (arena_alloc (&game->arena, n_tiles),
+                             FLOW_FIELD_UNREACHED, n_tiles);
+  game->flow_dirty = arena_alloc0 (&game->arena, n_tiles);
+  game->flow_scratch = NULL;
+  game->flow_scratch_alloced = 0;
+  game->flow_stale = DSK_FALSE;
+  game->cell_activity = arena_alloc0 (&game->arena, usize);
+  divide_into_regions (game);
+  random_lanes_init (&game->random);
+  game->n_move_scratch = 0;
+  game->proposed_x = game->proposed_y = NULL;
+  game->random_words = NULL;
+  game->move_occupancy = NULL;
+  game->move_claims = arena_alloc0 (&game->arena, n_tiles);
+
+  game->target_period_usecs = update_period_msecs * 1000;
+  game->period_usecs = game->target_period_usecs;
+  game->sim_cost_usecs = 0;
+  game->snapshot_cost_usecs = 0;
+  game->frame_cost_usecs = 0;
+  memset (game->snapshots, 0, sizeof (game->snapshots));
+  game->next_snapshot = 0;
+  game->frame_interval = 1;
+  game->tick_timer.list = NULL;
+  game->tick_timer.func = (void (*)(void *)) game_update_timer_callback;
+  game->tick_timer.data = game;
+  game->frozen = game->stopped = DSK_FALSE;
+  game->next_retired = NULL;
+  return game;
+}
+
+static void
+create_generator (Game *game, unsigned cell_index, double prob)
+{
+  Cell *cell = game->cells + cell_index;
+  cell->generator = dsk_malloc (sizeof (Generator));
+  cell->generator->game = game;
+  cell->generator->x = (cell_index % game->universe_width) * CELL_SIZE + CELL_SIZE/2;
+  cell->generator->y = (cell_index / game->universe_width) * CELL_SIZE + CELL_SIZE/2;
+  cell->generator->generator_prob = prob;
+  cell->generator->next_in_game = game->generators;
+  cell->generator->prev_in_game = NULL;
+  if (game->generators)
+    game->generators->prev_in_game = cell->generator;
+  game->generators = cell->generator;
+}
+
+static Game *
+create_game (const char      *name,
+             unsigned        width,
+             unsigned        height,
+             const GameRules *rules)
+
+{
+  Game *game = alloc_game (name, width, height, rules);
+  unsigned usize = width * height;
+  unsigned i;
 
   /* Generate with Modified Kruskals Algorithm, see 
    *    http://en.wikipedia.org/wiki/Maze_generation_algorithm
    */
   TmpWall *tmp_walls = dsk_malloc (sizeof (TmpWall) * usize * 2);
   TmpSetInfo *sets = dsk_malloc (sizeof (TmpSetInfo) * usize);
+  unsigned *set_sizes = dsk_malloc (sizeof (unsigned) * usize);  /* by set number */
 
   /* connect the walls together in random order */
   unsigned *scramble;
@@ -293,7 +1094,7 @@ create_game (const char *name,
       unsigned h = e % 2;
       unsigned x = (e / 2) % width;
       unsigned y = e / (width * 2);
-      if (!game->wrap)
+      if (!game->rules.wrap)
         {
           if ((h && y == 0) || (!h && x == 0))
             continue;
@@ -309,6 +1110,7 @@ create_game (const char *name,
     {
       sets[i].set_number = i;
       sets[i].next_in_set = sets + i;
+      set_sizes[i] = 1;
     }
 
   while (wall_list != NULL)
@@ -342,13 +1144,17 @@ create_game (const char *name,
           game->v_walls[x + y * width] = 0;
         }
       dsk_assert (osi->set_number != si->set_number);
-      TmpSetInfo *kring = osi->set_number < si->set_number ? osi : si;              /* ring to keep */
-      TmpSetInfo *dring = osi->set_number < si->set_number ? si : osi;              /* ring to change */
+
+      /* renumber the smaller set, so that big mazes don't take forever */
+      dsk_boolean keep_o = set_sizes[osi->set_number] >= set_sizes[si->set_number];
+      TmpSetInfo *kring = keep_o ? osi : si;              /* ring to keep */
+      TmpSetInfo *dring = keep_o ? si : osi;              /* ring to change */
       TmpSetInfo *dring_start = dring;
 
       /* combine sets (removing any walls that no longer separate different sets
          from the list of walls to remove) */
       unsigned set = kring->set_number;
+      set_sizes[set] += set_sizes[dring->set_number];
       do
         {
           unsigned x = (dring - sets) % width;
@@ -371,7 +1177,7 @@ create_game (const char *name,
           wall_idx = -1;
           if (x > 0 && (dring-1)->set_number == set)
             wall_idx = 2 * (x + y * width);
-          else if (x == 0 && game->wrap && (dring+width-1)->set_number == set)
+          else if (x == 0 && game->rules.wrap && (dring+width-1)->set_number == set)
             wall_idx = 2 * (x + y * width);
           if (wall_idx >= 0)
             remove_tmp_wall (tmp_walls, wall_idx, &wall_list);
@@ -380,7 +1186,7 @@ create_game (const char *name,
           wall_idx = -1;
           if (x < width - 1 && (dring+1)->set_number == set)
             wall_idx = 2 * ((x+1) + y * width);
-          else if (x == width - 1 && game->wrap && (dring-width+1)->set_number == set)
+          else if (x == width - 1 && game->rules.wrap && (dring-width+1)->set_number == set)
             wall_idx = 2 * (0 + y * width);
           if (wall_idx >= 0)
             remove_tmp_wall (tmp_walls, wall_idx, &wall_list);
@@ -389,7 +1195,7 @@ create_game (const char *name,
           wall_idx = -1;
           if (y > 0 && (dring-width)->set_number == dring->set_number)
             wall_idx = 2 * (x + y * width) + 1;
-          else if (y == 0 && game->wrap && (dring+width*(height-1))->set_number == set)
+          else if (y == 0 && game->rules.wrap && (dring+width*(height-1))->set_number == set)
             wall_idx = 2 * (x + y * width) + 1;
           if (wall_idx >= 0)
             remove_tmp_wall (tmp_walls, wall_idx, &wall_list);
@@ -398,7 +1204,7 @@ create_game (const char *name,
           wall_idx = -1;
           if (y < height - 1 && (dring+width)->set_number == set)
             wall_idx = 2 * (x + (y+1) * width) + 1;
-          else if (y == height - 1 && game->wrap && (dring-(height-1)*width)->set_number == set)
+          else if (y == height - 1 && game->rules.wrap && (dring-(height-1)*width)->set_number == set)
             wall_idx = 2 * (x + 0 * width) + 1;
           if (wall_idx >= 0)
             remove_tmp_wall (tmp_walls, wall_idx, &wall_list);
@@ -416,11 +1222,18 @@ create_game (const char *name,
 
   dsk_free (tmp_walls);
   dsk_free (sets);
+  dsk_free (set_sizes);
   dsk_free (scramble);
 
-  /* generate generators */
-  unsigned n_generators = 12 + rand () % 6;
-  dsk_warning ("%u generators", n_generators);
+  compute_wall_bits (game);
+
+  /* generate generators, as many per cell in big mazes as in the default
+     one; each takes an empty cell, so leave plenty of those */
+  unsigned n_generators = 12 + random_int_range (6);
+  if (usize > DEFAULT_UNIVERSE_WIDTH * DEFAULT_UNIVERSE_HEIGHT)
+    n_generators = n_generators * usize / (DEFAULT_UNIVERSE_WIDTH * DEFAULT_UNIVERSE_HEIGHT);
+  if (n_generators > usize / 2)
+    n_generators = usize / 2;
   i = 0;
   while (i < n_generators)
     {
@@ -428,28 +1241,26 @@ create_game (const char *name,
       Cell *cell = game->cells + idx;
       if (cell->generator == NULL)
         {
-          cell->generator = dsk_malloc (sizeof (Generator));
-          cell->generator->game = game;
-          cell->generator->x = (idx % width) * CELL_SIZE + CELL_SIZE/2;
-          cell->generator->y = (idx / width) * CELL_SIZE + CELL_SIZE/2;
-          dsk_warning ("created generator at %u,%u",cell->generator->x ,cell->generator->y);
-          cell->generator->generator_prob = 0.01;
-          cell->generator->next_in_game = game->generators;
-          cell->generator->prev_in_game = NULL;
-          if (game->generators)
-            game->generators->prev_in_game = cell->generator;
-          game->generators = cell->generator;
-
+          create_generator (game, idx, game->rules.generator_prob);
           i++;
         }
     }
-
-  game->timer = dsk_main_add_timer_millis (update_period_msecs,
-                                    (DskTimerFunc) game_update_timer_callback,
-                                    game);
   return game;
 }
 
+/* Add a game made by create_game() to all_games, and hand it to
+   the simulation thread.  Called with world_lock held. */
+static void
+start_game (Game *game)
+{
+  game->next_game = all_games;
+  all_games = game;
+  lobby_changed (NULL);
+  game->next_starting = starting_games;
+  starting_games = game;
+  pthread_cond_signal (&sim_wakeup);
+}
+
 /* --- getting the occupancy of a x,y position --- */
 typedef enum
 {
@@ -461,97 +1272,274 @@ typedef enum
   OCC_GENERATOR
 } OccType;
 
-/* *ptr_out will be set in the following cases:
-    case        type
-    -----       ----
-    BULLET      Bullet
-    USER        User
-    ENEMY       Enemy
-    GENERATOR   Generator
+/* occupant_out will be set in the following cases:
+    case        member
+    -----       ------
+    BULLET      index
+    USER        user
+    ENEMY       index
+    GENERATOR   generator
  */
-static Object *cell_find_object (Cell *cell,
-                                 ObjectType type,
-                                 unsigned x, unsigned y)
+typedef union
+{
+  User *user;
+  Generator *generator;
+  uint32_t index;                       /* in the bullet or enemy pool */
+} Occupant;
+
+static User *cell_find_user (Cell *cell,
+                             unsigned x, unsigned y)
 {
   Object *object;
-  for (object = cell->objects[type]; object; object = object->next_in_cell)
+  for (object = cell->users; object; object = object->next_in_cell)
     if (object->x == x && object->y == y)
-      return object;
+      return (User *) object;
   return NULL;
 }
-static OccType
-get_occupancy (Game *game, unsigned x, unsigned y, void **ptr_out)
+static uint32_t cell_find_entity (Game *game,
+                                  Cell *cell,
+                                  EntityKind kind,
+                                  unsigned x, unsigned y)
+{
+  EntityPool *pool = game->pools + kind;
+  uint32_t i;
+  for (i = cell->entities[kind]; i != ENTITY_NONE; i = pool->next_in_cell[i])
+    if (pool->x[i] == x && pool->y[i] == y)
+      return i;
+  return ENTITY_NONE;
+}
+/* Derive whether a tile is wall from the maze's cell walls.
+   Only used to build wall_bits;  see tile_is_wall(). */
+static dsk_boolean
+compute_tile_is_wall (Game *game, unsigned x, unsigned y)
 {
-  Cell *cell;
-  Object *object;
   unsigned cx, cy;
   if (x >= CELL_SIZE * game->universe_width
    || y >= CELL_SIZE * game->universe_height)
-    return OCC_WALL;
+    return DSK_TRUE;
   cx = x / CELL_SIZE;
   cy = y / CELL_SIZE;
   if (y % CELL_SIZE == 0)
     {
       if (game->h_walls[cy * game->universe_width + cx])
-        return OCC_WALL;
+        return DSK_TRUE;
       if (x % CELL_SIZE == 0)
         {
           if (x > 0)
             {
               if (game->h_walls[cy * game->universe_width + cx - 1])
-                return OCC_WALL;
+                return DSK_TRUE;
             }
-          else if (game->wrap)
+          else if (game->rules.wrap)
             {
               if (game->h_walls[cy * game->universe_width + game->universe_width - 1])
-                return OCC_WALL;
+                return DSK_TRUE;
             }
         }
     }
   if (x % CELL_SIZE == 0)
     {
       if (game->v_walls[cy * game->universe_width + cx])
-        return OCC_WALL;
+        return DSK_TRUE;
       if (y % CELL_SIZE == 0)
         {
           if (y > 0)
             {
               if (game->v_walls[(cy-1) * game->universe_width + cx])
-                return OCC_WALL;
+                return DSK_TRUE;
             }
-          else if (game->wrap)
+          else if (game->rules.wrap)
             {
               if (game->v_walls[(game->universe_height-1) * game->universe_width + cx])
-                return OCC_WALL;
+                return DSK_TRUE;
             }
         }
     }
+  return DSK_FALSE;
+}
+
+static void
+compute_wall_bits (Game *game)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned th = game->universe_height * CELL_SIZE;
+  unsigned x, y;
+  game->wall_bits = arena_alloc0 (&game->arena, sizeof (uint32_t) * ((tw * th + 31) / 32));
+  for (y = 0; y < th; y++)
+    for (x = 0; x < tw; x++)
+      if (compute_tile_is_wall (game, x, y))
+        {
+          unsigned idx = y * tw + x;
+          game->wall_bits[idx / 32] |= 1u << (idx % 32);
+        }
+}
+
+static inline dsk_boolean
+tile_index_is_wall (Game *game, unsigned tile_index)
+{
+  return (game->wall_bits[tile_index / 32] >> (tile_index % 32)) & 1;
+}
+
+static inline dsk_boolean
+tile_is_wall (Game *game, unsigned x, unsigned y)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  if (x >= tw || y >= game->universe_height * CELL_SIZE)
+    return DSK_TRUE;
+  return tile_index_is_wall (game, y * tw + x);
+}
+
+/* --- line of sight --- */
+/* Is tile x,y wall, where x,y may be off the edge of the universe? */
+static inline dsk_boolean
+tile_is_wall_unwrapped (Game *game, int x, int y)
+{
+  int tw = game->universe_width * CELL_SIZE;
+  int th = game->universe_height * CELL_SIZE;
+  if (game->rules.wrap)
+    return tile_is_wall (game, mod (x, tw), mod (y, th));
+  if (x < 0 || y < 0)
+    return DSK_TRUE;
+  return tile_is_wall (game, x, y);
+}
+
+/* Walk the tiles from x0,y0 to x1,y1, Bresenham-style.
+   A diagonal step is only blocked if both tiles beside it are wall. */
+static dsk_boolean
+tiles_see_each_other (Game *game, int x0, int y0, int x1, int y1)
+{
+  int dx = x1 > x0 ? x1 - x0 : x0 - x1;
+  int dy = y1 > y0 ? y1 - y0 : y0 - y1;
+  int sx = x1 > x0 ? 1 : -1;
+  int sy = y1 > y0 ? 1 : -1;
+  int err = dx - dy;
+  int x = x0, y = y0;
+  while (x != x1 || y != y1)
+    {
+      int e2 = 2 * err;
+      dsk_boolean step_x = e2 > -dy;
+      dsk_boolean step_y = e2 < dx;
+      if (step_x && step_y
+       && tile_is_wall_unwrapped (game, x + sx, y)
+       && tile_is_wall_unwrapped (game, x, y + sy))
+        return DSK_FALSE;
+      if (step_x)
+        {
+          err -= dy;
+          x += sx;
+        }
+      if (step_y)
+        {
+          err += dx;
+          y += sy;
+        }
+      if ((x != x1 || y != y1) && tile_is_wall_unwrapped (game, x, y))
+        return DSK_FALSE;
+    }
+  return DSK_TRUE;
+}
+
+/* Points of a cell's floor that lines of sight are tried between:
+   the four inner corners and the middle. */
+static const uint8_t sight_points[][2] =
+{
+  { 1, 1 },
+  { CELL_SIZE - 1, 1 },
+  { 1, CELL_SIZE - 1 },
+  { CELL_SIZE - 1, CELL_SIZE - 1 },
+  { CELL_SIZE / 2, CELL_SIZE / 2 },
+};
+
+static dsk_boolean
+cells_see_each_other (Game *game, unsigned cx, unsigned cy, int dx, int dy)
+{
+  unsigned i, j;
+  if (dx == 0 && dy == 0)
+    return DSK_TRUE;
+  for (i = 0; i < DSK_N_ELEMENTS (sight_points); i++)
+    for (j = 0; j < DSK_N_ELEMENTS (sight_points); j++)
+      if (tiles_see_each_other (game,
+                                cx * CELL_SIZE + sight_points[i][0],
+                                cy * CELL_SIZE + sight_points[i][1],
+                                (cx + dx) * CELL_SIZE + sight_points[j][0],
+                                (cy + dy) * CELL_SIZE + sight_points[j][1]))
+        return DSK_TRUE;
+  return DSK_FALSE;
+}
+
+/* The FOG_WORDS visibility bits of cell cx,cy (fog games only).
+   The maze never changes, so they are worked out once per cell.
+   Both the render and network threads render, hence visibility_lock. */
+static const uint32_t *
+cell_visibility (Game *game, unsigned cx, unsigned cy)
+{
+  unsigned idx = cy * game->universe_width + cx;
+  uint32_t *vis = game->visibility + FOG_WORDS * idx;
+  if (!__atomic_load_n (&game->visibility_known[idx], __ATOMIC_ACQUIRE))
+    {
+      int dx, dy;
+      pthread_mutex_lock (&visibility_lock);
+      if (!game->visibility_known[idx])
+        {
+          memset (vis, 0, sizeof (uint32_t) * FOG_WORDS);
+          for (dy = -FOG_RADIUS; dy <= FOG_RADIUS; dy++)
+            for (dx = -FOG_RADIUS; dx <= FOG_RADIUS; dx++)
+              if (cells_see_each_other (game, cx, cy, dx, dy))
+                {
+                  unsigned bit = (dy + FOG_RADIUS) * FOG_WINDOW + dx + FOG_RADIUS;
+                  vis[bit / 32] |= 1u << (bit % 32);
+                }
+          __atomic_store_n (&game->visibility_known[idx], 1, __ATOMIC_RELEASE);
+        }
+      pthread_mutex_unlock (&visibility_lock);
+    }
+  return vis;
+}
 
+static inline dsk_boolean
+visibility_includes (const uint32_t *vis, int dx, int dy)
+{
+  unsigned bit;
+  if (dx < -FOG_RADIUS || dx > FOG_RADIUS
+   || dy < -FOG_RADIUS || dy > FOG_RADIUS)
+    return DSK_FALSE;
+  bit = (dy + FOG_RADIUS) * FOG_WINDOW + dx + FOG_RADIUS;
+  return (vis[bit / 32] >> (bit % 32)) & 1;
+}
+
+static OccType
+get_occupancy (Game *game, unsigned x, unsigned y, Occupant *occupant_out)
+{
+  Cell *cell;
+  User *user;
+  uint32_t index;
+  if (tile_is_wall (game, x, y))
+    return OCC_WALL;
 
-  cell = game->cells + cx + cy * game->universe_width;
-  object = cell_find_object (cell, OBJECT_TYPE_USER, x, y);
-  if (object)
+  cell = game->cells + x / CELL_SIZE + y / CELL_SIZE * game->universe_width;
+  user = cell_find_user (cell, x, y);
+  if (user)
     {
-      *ptr_out = object;
+      occupant_out->user = user;
       return OCC_USER;
     }
   if (cell->generator
       && (cell->generator->x == x || cell->generator->x + 1 == x)
       && (cell->generator->y == y || cell->generator->y + 1 == y))
     {
-      *ptr_out = cell->generator;
+      occupant_out->generator = cell->generator;
       return OCC_GENERATOR;
     }
-  object = cell_find_object (cell, OBJECT_TYPE_BULLET, x, y);
-  if (object)
+  index = cell_find_entity (game, cell, ENTITY_BULLET, x, y);
+  if (index != ENTITY_NONE)
     {
-      *ptr_out = object;
+      occupant_out->index = index;
       return OCC_BULLET;
     }
-  object = cell_find_object (cell, OBJECT_TYPE_ENEMY, x, y);
-  if (object)
+  index = cell_find_entity (game, cell, ENTITY_ENEMY, x, y);
+  if (index != ENTITY_NONE)
     {
-      *ptr_out = object;
+      occupant_out->index = index;
       return OCC_ENEMY;
     }
   return OCC_EMPTY;
@@ -567,7 +1555,7 @@ remove_object_from_cell_list (Object *object)
 
 #if 0
   // Assert: the object is in the list */
-    {Object*tmp;for(tmp=cell->objects[object->type];tmp;tmp=tmp->next_in_cell)if (tmp==object)break;dsk_assert (tmp != NULL);}
+    {Object*tmp;for(tmp=cell->users;tmp;tmp=tmp->next_in_cell)if (tmp==object)break;dsk_assert (tmp != NULL);}
 #endif
 
 
@@ -575,8 +1563,8 @@ remove_object_from_cell_list (Object *object)
     object->prev_in_cell->next_in_cell = object->next_in_cell;
   else
     {
-      dsk_assert (cell->objects[object->type] == object);
-      cell->objects[object->type] = object->next_in_cell;
+      dsk_assert (cell->users == object);
+      cell->users = object->next_in_cell;
     }
   if (object->next_in_cell != NULL)
     object->next_in_cell->prev_in_cell = object->prev_in_cell;
@@ -589,12 +1577,12 @@ add_object_to_cell_list (Object *object)
                + (object->y/CELL_SIZE) * object->game->universe_width;
   Cell *cell = object->game->cells + idx;
 
-  object->next_in_cell = cell->objects[object->type];
+  object->next_in_cell = cell->users;
 
   if (object->next_in_cell)
     object->next_in_cell->prev_in_cell = object;
   object->prev_in_cell = NULL;
-  cell->objects[object->type] = object;
+  cell->users = object;
 }
 
 static void
@@ -606,34 +1594,213 @@ move_object (Object *object, unsigned x, unsigned y)
   add_object_to_cell_list (object);
 }
 
+static void
+add_object_to_game_list (Object *object)
+{
+  Game *game = object->game;
+  object->next_in_game = game->users;
+  if (object->next_in_game)
+    object->next_in_game->prev_in_game = object;
+  object->prev_in_game = NULL;
+  game->users = object;
+}
+
 static void
 remove_object_from_game_list (Object *object)
 {
   if (object->prev_in_game != NULL)
     object->prev_in_game->next_in_game = object->next_in_game;
   else
-    object->game->objects[object->type] = object->next_in_game;
+    object->game->users = object->next_in_game;
   if (object->next_in_game != NULL)
     object->next_in_game->prev_in_game = object->prev_in_game;
 }
 
+/* --- enemy and bullet pools --- */
+static Cell *
+get_cell (Game *game, unsigned x, unsigned y)
+{
+  return game->cells + x / CELL_SIZE + y / CELL_SIZE * game->universe_width;
+}
+
 static void
-add_object_to_game_list (Object *object)
+link_entity_into_cell (Game *game, EntityKind kind, uint32_t i)
 {
-  Game *game = object->game;
-  object->next_in_game = game->objects[object->type];
-  if (object->next_in_game)
-    object->next_in_game->prev_in_game = object;
-  object->prev_in_game = NULL;
-  game->objects[object->type] = object;
+  EntityPool *pool = game->pools + kind;
+  Cell *cell = get_cell (game, pool->x[i], pool->y[i]);
+  uint32_t first = cell->entities[kind];
+  pool->prev_in_cell[i] = ENTITY_NONE;
+  pool->next_in_cell[i] = first;
+  if (first != ENTITY_NONE)
+    pool->prev_in_cell[first] = i;
+  cell->entities[kind] = i;
 }
 
 static void
-teleport_object (Object *object)
+unlink_entity_from_cell (Game *game, EntityKind kind, uint32_t i)
 {
-  Game *game = object->game;
-  void *dummy;
-  do
+  EntityPool *pool = game->pools + kind;
+  uint32_t prev = pool->prev_in_cell[i];
+  uint32_t next = pool->next_in_cell[i];
+  if (prev != ENTITY_NONE)
+    pool->next_in_cell[prev] = next;
+  else
+    {
+      Cell *cell = get_cell (game, pool->x[i], pool->y[i]);
+      dsk_assert (cell->entities[kind] == i);
+      cell->entities[kind] = next;
+    }
+  if (next != ENTITY_NONE)
+    pool->prev_in_cell[next] = prev;
+}
+
+static uint32_t
+add_entity (Game *game, EntityKind kind,
+            unsigned x, unsigned y, uint8_t velocity)
+{
+  EntityPool *pool = game->pools + kind;
+  uint32_t i;
+  if (pool->n_entities == pool->n_alloced)
+    {
+      unsigned old_alloced = pool->n_alloced;
+      pool->n_alloced = old_alloced ? old_alloced * 2 : 64;
+      pool->x = dsk_realloc (pool->x, sizeof (uint16_t) * pool->n_alloced);
+      pool->y = dsk_realloc (pool->y, sizeof (uint16_t) * pool->n_alloced);
+      pool->velocity = dsk_realloc (pool->velocity, pool->n_alloced);
+      pool->generation = dsk_realloc (pool->generation, sizeof (uint16_t) * pool->n_alloced);
+      pool->prev_in_cell = dsk_realloc (pool->prev_in_cell, sizeof (uint32_t) * pool->n_alloced);
+      pool->next_in_cell = dsk_realloc (pool->next_in_cell, sizeof (uint32_t) * pool->n_alloced);
+
+      /* unused slots are dead */
+      for (i = old_alloced; i < pool->n_alloced; i++)
+        pool->generation[i] = 1;
+    }
+  i = pool->n_entities++;
+  pool->x[i] = x;
+  pool->y[i] = y;
+  pool->velocity[i] = velocity;
+  pool->generation[i] += 1;
+  link_entity_into_cell (game, kind, i);
+  return i;
+}
+
+static void
+kill_entity (Game *game, EntityKind kind, uint32_t i)
+{
+  EntityPool *pool = game->pools + kind;
+  dsk_assert (ENTITY_IS_ALIVE (pool, i));
+  unlink_entity_from_cell (game, kind, i);
+  pool->generation[i] += 1;
+
+  /* regions may be killing things at the same time */
+  __atomic_add_fetch (&pool->n_dead, 1, __ATOMIC_RELAXED);
+}
+
+static void
+move_entity (Game *game, EntityKind kind, uint32_t i, unsigned x, unsigned y)
+{
+  EntityPool *pool = game->pools + kind;
+  unlink_entity_from_cell (game, kind, i);
+  pool->x[i] = x;
+  pool->y[i] = y;
+  link_entity_into_cell (game, kind, i);
+}
+
+/* Fill the holes left by kill_entity() by moving the last
+   live entity into them. */
+static void
+entity_pool_compact (Game *game, EntityKind kind)
+{
+  EntityPool *pool = game->pools + kind;
+  uint32_t i = 0;
+  if (pool->n_dead == 0)
+    return;
+  while (i < pool->n_entities)
+    {
+      uint32_t last, prev, next;
+      if (ENTITY_IS_ALIVE (pool, i))
+        {
+          i++;
+          continue;
+        }
+      last = --pool->n_entities;
+      if (last == i || !ENTITY_IS_ALIVE (pool, last))
+        continue;
+
+      /* move 'last' into the hole at 'i' */
+      prev = pool->prev_in_cell[last];
+      next = pool->next_in_cell[last];
+      pool->x[i] = pool->x[last];
+      pool->y[i] = pool->y[last];
+      pool->velocity[i] = pool->velocity[last];
+      pool->prev_in_cell[i] = prev;
+      pool->next_in_cell[i] = next;
+      if (prev != ENTITY_NONE)
+        pool->next_in_cell[prev] = i;
+      else
+        get_cell (game, pool->x[i], pool->y[i])->entities[kind] = i;
+      if (next != ENTITY_NONE)
+        pool->prev_in_cell[next] = i;
+      pool->generation[i] += 1;
+      pool->generation[last] += 1;
+      i++;
+    }
+  pool->n_dead = 0;
+}
+
+static void
+ensure_move_scratch (Game *game, unsigned n)
+{
+  if (game->n_move_scratch >= n)
+    return;
+  game->n_move_scratch = n * 2;
+  game->proposed_x = dsk_realloc (game->proposed_x, sizeof (int16_t) * n * 2);
+  game->proposed_y = dsk_realloc (game->proposed_y, sizeof (int16_t) * n * 2);
+  game->random_words = dsk_realloc (game->random_words, sizeof (uint32_t) * n * 2);
+  game->move_occupancy = dsk_realloc (game->move_occupancy, n * 2);
+}
+
+/* Wrap a position that has moved at most one tile
+   around the universe, without division. */
+static inline int
+wrap_coordinate (int v, int size)
+{
+  if (v < 0)
+    return v + size;
+  if (v >= size)
+    return v - size;
+  return v;
+}
+
+/* Wrap the first n proposed positions around the universe.
+   No move is more than one tile, so this is a conditional
+   add or subtract, which vectorizes. */
+static void
+wrap_proposals (Game *game, unsigned n)
+{
+  int16_t tw = game->universe_width * CELL_SIZE;
+  int16_t th = game->universe_height * CELL_SIZE;
+  int16_t *restrict px = game->proposed_x;
+  int16_t *restrict py = game->proposed_y;
+  unsigned i;
+  for (i = 0; i < n; i++)
+    {
+      px[i] += tw & -(px[i] < 0);
+      px[i] -= tw & -(px[i] >= tw);
+    }
+  for (i = 0; i < n; i++)
+    {
+      py[i] += th & -(py[i] < 0);
+      py[i] -= th & -(py[i] >= th);
+    }
+}
+
+static void
+teleport_object (Object *object)
+{
+  Game *game = object->game;
+  Occupant dummy;
+  do
     {
       object->x = random_int_range (game->universe_width * CELL_SIZE);
       object->y = random_int_range (game->universe_height * CELL_SIZE);
@@ -641,13 +1808,743 @@ teleport_object (Object *object)
   while (get_occupancy (game, object->x, object->y, &dummy) != OCC_EMPTY);
 }
 
+/* --- enemy flow field --- */
+/* The flow field is a multi-source BFS over the maze's tiles from every
+   live user.  Enemies step to a neighbouring tile one closer to a user.
+
+   Only the neighbourhood of users that moved (or died, or respawned) is
+   recomputed:  a box of FLOW_FIELD_RADIUS around the old and new positions
+   contains every tile whose distance could have changed, and the tiles
+   just outside the box still have correct distances, so they seed the BFS
+   inside the box along with any users in it. */
+
+/* Returns the index of the tile adjacent to tile_index in direction
+   'dir' (0..3), or -1 if that is off the edge of a non-wrapping game. */
+static inline int
+tile_neighbour (Game *game, dsk_boolean wrap, unsigned tile_index, unsigned dir)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned th = game->universe_height * CELL_SIZE;
+  unsigned x = tile_index % tw;
+  unsigned y = tile_index / tw;
+  switch (dir)
+    {
+    case 0:
+      if (x == 0)
+        return wrap ? (int) (tile_index + tw - 1) : -1;
+      return tile_index - 1;
+    case 1:
+      if (x == tw - 1)
+        return wrap ? (int) (tile_index - x) : -1;
+      return tile_index + 1;
+    case 2:
+      if (y == 0)
+        return wrap ? (int) (tile_index + (th - 1) * tw) : -1;
+      return tile_index - tw;
+    default:
+      if (y == th - 1)
+        return wrap ? (int) x : -1;
+      return tile_index + tw;
+    }
+}
+
+static unsigned
+flow_field_mark_box (Game *game, unsigned x, unsigned y,
+                     unsigned *dirty, unsigned n_dirty)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned th = game->universe_height * CELL_SIZE;
+  int dx, dy;
+  for (dy = -FLOW_FIELD_RADIUS; dy <= FLOW_FIELD_RADIUS; dy++)
+    {
+      int ty = (int) y + dy;
+      if (ty < 0 || ty >= (int) th)
+        {
+          if (!game->rules.wrap)
+            continue;
+          ty = mod (ty, th);
+        }
+      for (dx = -FLOW_FIELD_RADIUS; dx <= FLOW_FIELD_RADIUS; dx++)
+        {
+          int tx = (int) x + dx;
+          unsigned idx;
+          if (tx < 0 || tx >= (int) tw)
+            {
+              if (!game->rules.wrap)
+                continue;
+              tx = mod (tx, tw);
+            }
+          idx = ty * tw + tx;
+          if (!game->flow_dirty[idx])
+            {
+              game->flow_dirty[idx] = 1;
+              dirty[n_dirty++] = idx;
+            }
+        }
+    }
+  return n_dirty;
+}
+
 static void
-game_update_timer_callback (Game *game)
+flow_field_update (Game *game)
+{
+  unsigned n_tiles = game->universe_width * game->universe_height
+                   * CELL_SIZE * CELL_SIZE;
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned box_size = (2 * FLOW_FIELD_RADIUS + 1) * (2 * FLOW_FIELD_RADIUS + 1);
+  uint8_t *field = game->flow_field;
+  unsigned *dirty, *seeds, *queue;
+  unsigned n_dirty = 0, n_seeds, n_changed = 0;
+  unsigned seed_counts[FLOW_FIELD_RADIUS + 2];
+  unsigned head, tail, seed_at;
+  unsigned i, d;
+  Object *object;
+
+  /* the dirty list, the seeds, and a queue in which a tile
+     can appear at most twice */
+  if (game->flow_scratch_alloced < n_tiles * 4)
+    {
+      game->flow_scratch_alloced = n_tiles * 4;
+      game->flow_scratch = dsk_realloc (game->flow_scratch,
+                                        sizeof (unsigned) * n_tiles * 4);
+    }
+  dirty = game->flow_scratch;
+  seeds = dirty + n_tiles;
+  queue = seeds + n_tiles;
+
+  /* mark the neighbourhoods of users whose contribution changed */
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      User *user = (User *) object;
+      dsk_boolean alive = user->dead_count == 0;
+      if (alive == user->in_flow_field
+       && (!alive || (user->flow_x == object->x && user->flow_y == object->y)))
+        continue;
+      if (++n_changed * box_size >= n_tiles)
+        break;
+      if (user->in_flow_field)
+        n_dirty = flow_field_mark_box (game, user->flow_x, user->flow_y, dirty, n_dirty);
+      if (alive)
+        n_dirty = flow_field_mark_box (game, object->x, object->y, dirty, n_dirty);
+    }
+  if (n_changed == 0 && !game->flow_stale)
+    return;
+  if (n_changed * box_size >= n_tiles || game->flow_stale)
+    {
+      /* too many movers: recompute everything */
+      for (i = 0; i < n_tiles; i++)
+        if (!game->flow_dirty[i])
+          {
+            game->flow_dirty[i] = 1;
+            dirty[n_dirty++] = i;
+          }
+      game->flow_stale = DSK_FALSE;
+    }
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      User *user = (User *) object;
+      user->in_flow_field = user->dead_count == 0;
+      user->flow_x = object->x;
+      user->flow_y = object->y;
+    }
+
+  /* seeds: users inside the dirty region, and dirty tiles
+     next to a clean tile with a known distance */
+  for (i = 0; i < n_dirty; i++)
+    field[dirty[i]] = FLOW_FIELD_UNREACHED;
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      unsigned idx = object->y * tw + object->x;
+      if (((User *) object)->dead_count == 0 && game->flow_dirty[idx])
+        field[idx] = 0;
+    }
+  for (i = 0; i < n_dirty; i++)
+    {
+      unsigned idx = dirty[i];
+      unsigned dir;
+      if (field[idx] == 0 || tile_index_is_wall (game, idx))
+        continue;
+      for (dir = 0; dir < 4; dir++)
+        {
+          int nidx = tile_neighbour (game, game->rules.wrap, idx, dir);
+          if (nidx >= 0
+           && !game->flow_dirty[nidx]
+           && field[nidx] < FLOW_FIELD_RADIUS
+           && field[nidx] + 1 < field[idx])
+            field[idx] = field[nidx] + 1;
+        }
+    }
+
+  /* counting-sort the seeds by distance */
+  memset (seed_counts, 0, sizeof (seed_counts));
+  for (i = 0; i < n_dirty; i++)
+    if (field[dirty[i]] <= FLOW_FIELD_RADIUS)
+      seed_counts[field[dirty[i]] + 1]++;
+  for (d = 1; d <= FLOW_FIELD_RADIUS + 1; d++)
+    seed_counts[d] += seed_counts[d - 1];
+  n_seeds = seed_counts[FLOW_FIELD_RADIUS + 1];
+  for (i = 0; i < n_dirty; i++)
+    if (field[dirty[i]] <= FLOW_FIELD_RADIUS)
+      seeds[seed_counts[field[dirty[i]]]++] = dirty[i];
+
+  /* BFS restricted to the dirty region, one distance at a time */
+  head = tail = seed_at = 0;
+  for (d = 0; d <= FLOW_FIELD_RADIUS && (head < tail || seed_at < n_seeds); d++)
+    {
+      unsigned level_end;
+      while (seed_at < n_seeds && field[seeds[seed_at]] <= d)
+        {
+          if (field[seeds[seed_at]] == d)
+            queue[tail++] = seeds[seed_at];
+          seed_at++;
+        }
+      level_end = tail;
+      while (head < level_end)
+        {
+          unsigned idx = queue[head++];
+          unsigned dir;
+          if (field[idx] != d || d == FLOW_FIELD_RADIUS)
+            continue;
+          for (dir = 0; dir < 4; dir++)
+            {
+              int nidx = tile_neighbour (game, game->rules.wrap, idx, dir);
+              if (nidx >= 0
+               && game->flow_dirty[nidx]
+               && field[nidx] > d + 1
+               && !tile_index_is_wall (game, nidx))
+                {
+                  field[nidx] = d + 1;
+                  queue[tail++] = nidx;
+                }
+            }
+        }
+    }
+
+  for (i = 0; i < n_dirty; i++)
+    game->flow_dirty[dirty[i]] = 0;
+}
+
+/* Pick a tile adjacent to x,y that is one step closer to a user,
+   using the low byte of 'random' to break ties.
+   Returns FALSE if no user is within FLOW_FIELD_RADIUS. */
+static inline dsk_boolean
+flow_field_descend (Game *game, dsk_boolean wrap, unsigned x, unsigned y,
+                    uint32_t random, int *x_out, int *y_out)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned idx = y * tw + x;
+  unsigned d = game->flow_field[idx];
+  unsigned candidates[4];
+  unsigned n_candidates = 0;
+  unsigned dir;
+  if (d == 0 || d == FLOW_FIELD_UNREACHED)
+    return DSK_FALSE;
+  for (dir = 0; dir < 4; dir++)
+    {
+      int nidx = tile_neighbour (game, wrap, idx, dir);
+      if (nidx >= 0 && (unsigned) game->flow_field[nidx] + 1 == d)
+        candidates[n_candidates++] = nidx;
+    }
+  if (n_candidates == 0)
+    return DSK_FALSE;
+  idx = candidates[(random & 0xff) * n_candidates >> 8];
+  *x_out = idx % tw;
+  *y_out = idx / tw;
+  return DSK_TRUE;
+}
+
+/* --- simulation level-of-detail --- */
+/* The cells covered by a canvas of width x height pixels centered
+   on tile view_x,view_y, un-wrapped, so min_cell_x and min_cell_y
+   may be negative. */
+static void
+get_viewport_cells (int       view_x,
+                    int       view_y,
+                    unsigned  width,
+                    unsigned  height,
+                    int      *min_cell_x_out,
+                    int      *min_cell_y_out,
+                    unsigned *cell_width_out,
+                    unsigned *cell_height_out)
+{
+  /* width/height in various units, rounded up */
+  unsigned tile_width = (width + TILE_SIZE - 1) / TILE_SIZE;
+  unsigned tile_height = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+  /* left/upper corner, rounded down */
+  int min_tile_x = view_x - (tile_width+1) / 2;
+  int min_tile_y = view_y - (tile_height+1) / 2;
+
+  *cell_width_out = (tile_width + CELL_SIZE * 2 - 2) / CELL_SIZE;
+  *cell_height_out = (tile_height + CELL_SIZE * 2 - 2) / CELL_SIZE;
+  *min_cell_x_out = int_div (min_tile_x, CELL_SIZE);
+  *min_cell_y_out = int_div (min_tile_y, CELL_SIZE);
+}
+
+static void
+raise_cell_activity (Game *game,
+                     int min_cell_x, int min_cell_y,
+                     unsigned cell_width, unsigned cell_height,
+                     CellActivity activity)
+{
+  int ucx, ucy;
+  if (game->rules.wrap)
+    {
+      if (cell_width > game->universe_width)
+        {
+          min_cell_x = 0;
+          cell_width = game->universe_width;
+        }
+      if (cell_height > game->universe_height)
+        {
+          min_cell_y = 0;
+          cell_height = game->universe_height;
+        }
+    }
+  for (ucy = min_cell_y; ucy < min_cell_y + (int) cell_height; ucy++)
+    {
+      unsigned cy;
+      if (ucy < 0 || ucy >= (int) game->universe_height)
+        {
+          if (!game->rules.wrap)
+            continue;
+          cy = mod (ucy, game->universe_height);
+        }
+      else
+        cy = ucy;
+      for (ucx = min_cell_x; ucx < min_cell_x + (int) cell_width; ucx++)
+        {
+          unsigned cx;
+          uint8_t *at;
+          if (ucx < 0 || ucx >= (int) game->universe_width)
+            {
+              if (!game->rules.wrap)
+                continue;
+              cx = mod (ucx, game->universe_width);
+            }
+          else
+            cx = ucx;
+          at = game->cell_activity + cy * game->universe_width + cx;
+          if (*at < activity)
+            *at = activity;
+        }
+    }
+}
+
+static void
+raise_viewport_activity (Game *game,
+                         int view_x, int view_y,
+                         unsigned width, unsigned height)
+{
+  int min_cell_x, min_cell_y;
+  unsigned cell_width, cell_height;
+  get_viewport_cells (view_x, view_y, width, height,
+                      &min_cell_x, &min_cell_y,
+                      &cell_width, &cell_height);
+  raise_cell_activity (game,
+                       min_cell_x - ACTIVITY_REDUCED_MARGIN_CELLS,
+                       min_cell_y - ACTIVITY_REDUCED_MARGIN_CELLS,
+                       cell_width + ACTIVITY_REDUCED_MARGIN_CELLS * 2,
+                       cell_height + ACTIVITY_REDUCED_MARGIN_CELLS * 2,
+                       CELL_REDUCED);
+  raise_cell_activity (game,
+                       min_cell_x - ACTIVITY_MARGIN_CELLS,
+                       min_cell_y - ACTIVITY_MARGIN_CELLS,
+                       cell_width + ACTIVITY_MARGIN_CELLS * 2,
+                       cell_height + ACTIVITY_MARGIN_CELLS * 2,
+                       CELL_ACTIVE);
+}
+
+/* Everything someone is looking at (plus a margin) runs at full
+   rate; a wider margin runs at a reduced rate. */
+static void
+update_cell_activity (Game *game)
+{
+  Object *object;
+  Watch *watch;
+  memset (game->cell_activity, CELL_PARKED,
+          game->universe_width * game->universe_height);
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      User *user = (User *) object;
+      raise_viewport_activity (game, object->x, object->y,
+                               user->width, user->height);
+    }
+  for (watch = game->watches; watch; watch = watch->next_in_game)
+    raise_viewport_activity (game, watch->view_x, watch->view_y,
+                             watch->width, watch->height);
+}
+
+/* Whether things in the cell containing x,y should run this update.
+   Reduced-rate cells are staggered so they don't all run together. */
+static dsk_boolean
+is_simulated (Game *game, unsigned x, unsigned y)
+{
+  unsigned idx = x / CELL_SIZE + y / CELL_SIZE * game->universe_width;
+  switch (game->cell_activity[idx])
+    {
+    case CELL_ACTIVE:
+      return DSK_TRUE;
+    case CELL_REDUCED:
+      return (game->latest_update + idx) % ACTIVITY_REDUCED_PERIOD == 0;
+    default:
+      return DSK_FALSE;
+    }
+}
+
+/* --- regions ---
+   A big game is divided into bands of whole rows of cells, and its
+   enemies are moved region by region, in parallel, by the region
+   threads.  Enemies belong to the region whose cells they are in at
+   the start of the update, so one that wanders over a border is
+   handed to the next region simply by being there next time.
+
+   Enemy moves don't depend on the order they are made in, so a game
+   ticks the same whether it is divided or not, and however the
+   regions are shared out.  Every enemy first claims the tile it wants
+   to enter, judging what is there as of the start of the move; then
+   the moves are made, with enemies that want the same tile settled by
+   the direction they come from.  --check-regions replays a game both
+   ways and compares them.
+
+   Moving an enemy reads and writes at most one row of cells beyond
+   its region, its border strip.  Neighbouring regions have different
+   colors, and the regions of one color are run together; since
+   every region is at least two rows tall, the border strips of
+   regions running together never meet, and regions can use their
+   neighbours' cells in place instead of keeping ghost copies. */
+typedef void (*RegionFunc) (Game *game, Region *region);
+
+/* The region threads besides the simulation thread.  Each run is a
+   round: the simulation thread deals the round's regions out into
+   a queue per thread, bumps region_round and works along with the
+   helpers, then waits for region_running to reach zero.  A thread
+   that finishes its own queue takes regions from the others'. */
+typedef struct _RegionQueue RegionQueue;
+struct _RegionQueue
+{
+  unsigned next, end;                   /* in region_list; next is atomic */
+  char pad[64 - 2 * sizeof (unsigned)]; /* a cache line each */
+};
+static unsigned n_region_helpers;
+static RegionQueue *region_queues;      /* n_region_helpers + 1 */
+static unsigned *region_list;           /* the round's regions */
+static unsigned region_list_alloced;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t region_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t region_finished = PTHREAD_COND_INITIALIZER;
+static unsigned region_round;
+static unsigned region_running;
+static Game *region_game;
+static RegionFunc region_func;
+
+static void
+divide_into_regions (Game *game)
+{
+  unsigned n, i, row;
+  game->n_regions = 0;
+  game->n_region_colors = 0;
+  game->regions = NULL;
+  game->row_regions = NULL;
+  n = count_regions (game->universe_width, game->universe_height);
+  if (n == 0)
+    return;
+
+  game->n_regions = n;
+  game->regions = arena_alloc0 (&game->arena, sizeof (Region) * n);
+  game->row_regions = arena_alloc (&game->arena, sizeof (uint16_t) * game->universe_height);
+  row = 0;
+  for (i = 0; i < n; i++)
+    {
+      Region *region = game->regions + i;
+      region->first_row = row;
+      region->n_rows = (game->universe_height * (i + 1)) / n - row;
+      for (; row < region->first_row + region->n_rows; row++)
+        game->row_regions[row] = i;
+
+      /* the last and first regions are neighbours if the maze wraps */
+      region->color = i % 2;
+      if (i == n - 1 && n % 2 == 1 && game->rules.wrap)
+        region->color = 2;
+      game->n_region_colors = DSK_MAX (game->n_region_colors, region->color + 1);
+    }
+}
+
+/* Thread number 'worker' (0 being the simulation thread) runs
+   the regions in its own queue, then steals from the others. */
+static void
+run_worker_regions (unsigned worker)
+{
+  unsigned n_workers = n_region_helpers + 1;
+  unsigned w;
+  for (w = 0; w < n_workers; w++)
+    {
+      RegionQueue *queue = region_queues + (worker + w) % n_workers;
+      unsigned k;
+      while ((k = __atomic_fetch_add (&queue->next, 1, __ATOMIC_RELAXED)) < queue->end)
+        region_func (region_game, region_game->regions + region_list[k]);
+    }
+}
+
+static void *
+region_thread_main (void *data)
+{
+  unsigned worker = (uintptr_t) data;
+  unsigned round = 0;
+  pthread_mutex_lock (&region_lock);
+  for (;;)
+    {
+      while (region_round == round)
+        pthread_cond_wait (&region_start, &region_lock);
+      round = region_round;
+      pthread_mutex_unlock (&region_lock);
+      run_worker_regions (worker);
+      pthread_mutex_lock (&region_lock);
+      if (--region_running == 0)
+        pthread_cond_signal (&region_finished);
+    }
+  return NULL;
+}
+
+/* Run func on each of the game's regions of the given color
+   (-1 for all of them), and wait until they are done. */
+static void
+run_regions (Game *game, RegionFunc func, int color)
+{
+  unsigned n_workers = n_region_helpers + 1;
+  unsigned i, n = 0, w;
+  if (region_list_alloced < game->n_regions)
+    {
+      region_list_alloced = game->n_regions;
+      region_list = dsk_realloc (region_list, sizeof (unsigned) * region_list_alloced);
+    }
+  for (i = 0; i < game->n_regions; i++)
+    if (color < 0 || game->regions[i].color == (unsigned) color)
+      region_list[n++] = i;
+
+  pthread_mutex_lock (&region_lock);
+  for (w = 0; w < n_workers; w++)
+    {
+      region_queues[w].next = n * w / n_workers;
+      region_queues[w].end = n * (w + 1) / n_workers;
+    }
+  region_game = game;
+  region_func = func;
+  region_running = n_region_helpers;
+  region_round++;
+  pthread_cond_broadcast (&region_start);
+  pthread_mutex_unlock (&region_lock);
+
+  run_worker_regions (0);
+
+  pthread_mutex_lock (&region_lock);
+  while (region_running > 0)
+    pthread_cond_wait (&region_finished, &region_lock);
+  pthread_mutex_unlock (&region_lock);
+}
+
+static void
+start_region_threads (void)
+{
+  unsigned i;
+  n_region_helpers = region_thread_count - 1;
+  region_queues = dsk_malloc0 (sizeof (RegionQueue) * (n_region_helpers + 1));
+  for (i = 1; i <= n_region_helpers; i++)
+    {
+      pthread_t thread;
+      if (pthread_create (&thread, NULL, region_thread_main, (void *) (uintptr_t) i) != 0)
+        dsk_die ("error starting region thread");
+      pthread_detach (thread);
+    }
+}
+
+/* The bit for a move from x,y to the adjacent new_x,new_y. */
+static inline unsigned
+move_direction_bit (Game *game, int x, int y, int new_x, int new_y)
+{
+  int dx = new_x - x, dy = new_y - y;
+  unsigned d;
+  if (dx > 1)
+    dx -= game->universe_width * CELL_SIZE;
+  else if (dx < -1)
+    dx += game->universe_width * CELL_SIZE;
+  if (dy > 1)
+    dy -= game->universe_height * CELL_SIZE;
+  else if (dy < -1)
+    dy += game->universe_height * CELL_SIZE;
+  d = (dy + 1) * 3 + dx + 1;            /* 4 is staying put */
+  return 1 << (d > 4 ? d - 1 : d);
+}
+
+/* Note what enemy i's proposed move runs into, before anything
+   moves, and if it is an empty tile, claim it. */
+static inline void
+claim_enemy_move (Game *game, uint32_t i)
+{
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  int new_x = game->proposed_x[i];
+  int new_y = game->proposed_y[i];
+  Occupant occupant;
+  OccType occ;
+  if (new_x == enemies->x[i] && new_y == enemies->y[i])
+    occ = OCC_WALL;                     /* staying put: no move to make */
+  else
+    occ = get_occupancy (game, new_x, new_y, &occupant);
+  game->move_occupancy[i] = occ;
+  if (occ == OCC_EMPTY)
+    __atomic_fetch_or (game->move_claims + new_y * game->universe_width * CELL_SIZE + new_x,
+                       move_direction_bit (game, enemies->x[i], enemies->y[i], new_x, new_y),
+                       __ATOMIC_RELAXED);
+}
+
+/* Make enemy i's move, as claimed.  Of the enemies claiming a tile,
+   the one coming from the lowest direction gets it.  Enemies that
+   run into a user or a bullet that another enemy has already dealt
+   with this update have the same effect as the first. */
+static inline void
+apply_enemy_move (Game *game, uint32_t i)
+{
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  int new_x = game->proposed_x[i];
+  int new_y = game->proposed_y[i];
+  Cell *cell = get_cell (game, new_x, new_y);
+  unsigned claims, bit;
+  User *user;
+  uint32_t bullet;
+  switch (game->move_occupancy[i])
+    {
+    case OCC_EMPTY:
+      claims = game->move_claims[new_y * game->universe_width * CELL_SIZE + new_x];
+      bit = move_direction_bit (game, enemies->x[i], enemies->y[i], new_x, new_y);
+      if ((claims & -claims) == bit)
+        move_entity (game, ENTITY_ENEMY, i, new_x, new_y);
+      break;
+
+    case OCC_USER:
+      /* enemy kills user */
+      user = cell_find_user (cell, new_x, new_y);
+      if (user != NULL)
+        {
+          remove_object_from_cell_list (&user->base);
+          user->dead_count = game->rules.dead_time;
+        }
+      break;
+    case OCC_BULLET:
+      /* destroy bullet and enemy */
+      bullet = cell_find_entity (game, cell, ENTITY_BULLET, new_x, new_y);
+      if (bullet != ENTITY_NONE)
+        kill_entity (game, ENTITY_BULLET, bullet);
+      kill_entity (game, ENTITY_ENEMY, i);
+      break;
+
+    default:
+      /* walls, generators and enemies block the move */
+      break;
+    }
+}
+
+/* Leave move_claims all zero again. */
+static void
+clear_enemy_claims (Game *game, unsigned n)
+{
+  unsigned tw = game->universe_width * CELL_SIZE;
+  unsigned i;
+  for (i = 0; i < n; i++)
+    if (game->move_occupancy[i] == OCC_EMPTY)
+      game->move_claims[game->proposed_y[i] * tw + game->proposed_x[i]] = 0;
+}
+
+/* Like the chasing in game_tick_generic(), for one region's
+   enemies, which then claim where they are going. */
+static void
+propose_region_enemy_moves (Game *game, Region *region)
+{
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  uint32_t move_threshold = game->rules.enemy_move_fraction * 65536;
+  dsk_boolean wrap = game->rules.wrap;
+  unsigned k;
+  for (k = 0; k < region->n_enemies; k++)
+    {
+      uint32_t i = region->enemies[k];
+      int x = enemies->x[i], y = enemies->y[i];
+      int chase_x, chase_y;
+      if ((game->random_words[i] >> 16) >= move_threshold)
+        continue;
+      if (!is_simulated (game, x, y))
+        {
+          chase_x = x;
+          chase_y = y;
+        }
+      else if (!flow_field_descend (game, wrap, x, y, game->random_words[i],
+                                    &chase_x, &chase_y))
+        {
+          chase_x = game->proposed_x[i];
+          chase_y = game->proposed_y[i];
+          if (wrap)
+            {
+              chase_x = wrap_coordinate (chase_x, game->universe_width * CELL_SIZE);
+              chase_y = wrap_coordinate (chase_y, game->universe_height * CELL_SIZE);
+            }
+        }
+      game->proposed_x[i] = chase_x;
+      game->proposed_y[i] = chase_y;
+    }
+  for (k = 0; k < region->n_enemies; k++)
+    claim_enemy_move (game, region->enemies[k]);
+}
+
+static void
+apply_region_enemy_moves (Game *game, Region *region)
+{
+  unsigned k;
+  for (k = 0; k < region->n_enemies; k++)
+    apply_enemy_move (game, region->enemies[k]);
+}
+
+/* Sort the enemies, which have their random-walk proposals,
+   into their regions, then have the regions chase and move them.
+   The moves are claimed all at once, but made a color at a time. */
+static void
+move_enemies_by_region (Game *game)
+{
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  unsigned i, color;
+  for (i = 0; i < game->n_regions; i++)
+    game->regions[i].n_enemies = 0;
+  for (i = 0; i < enemies->n_entities; i++)
+    {
+      Region *region = game->regions + game->row_regions[enemies->y[i] / CELL_SIZE];
+      if (region->n_enemies == region->enemies_alloced)
+        {
+          region->enemies_alloced = region->enemies_alloced ? region->enemies_alloced * 2 : 64;
+          region->enemies = dsk_realloc (region->enemies,
+                                         sizeof (uint32_t) * region->enemies_alloced);
+        }
+      region->enemies[region->n_enemies++] = i;
+    }
+  run_regions (game, propose_region_enemy_moves, -1);
+  for (color = 0; color < game->n_region_colors; color++)
+    run_regions (game, apply_region_enemy_moves, color);
+  clear_enemy_claims (game, enemies->n_entities);
+}
+
+/* --- the update loop --- */
+/* The rules are constant parameters so that each variant
+   instantiated by DEFINE_GAME_TICK has them folded away. */
+static inline __attribute__((always_inline)) void
+game_tick_generic (Game *game,
+                   const dsk_boolean wrap,
+                   const dsk_boolean diag_bullets_bounce,
+                   const dsk_boolean bullet_kills_player,
+                   const dsk_boolean bullet_kills_generator)
 {
   /* run players */
   Object *object;
+  EntityPool *bullets = game->pools + ENTITY_BULLET;
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  unsigned i, n;
 
-  for (object = game->objects[OBJECT_TYPE_USER]; object != NULL; )
+  for (object = game->users; object != NULL; )
     {
       User *user = (User *) object;
       dsk_boolean destroy_user = DSK_FALSE;
@@ -666,13 +2563,13 @@ game_update_timer_callback (Game *game)
         {
           int new_x = object->x + user->move_x;
           int new_y = object->y + user->move_y;
-          void *obj;
-          if (game->wrap)
+          Occupant occupant;
+          if (wrap)
             {
-              new_x = mod (new_x, game->universe_width * CELL_SIZE);
-              new_y = mod (new_y, game->universe_height * CELL_SIZE);
+              new_x = wrap_coordinate (new_x, game->universe_width * CELL_SIZE);
+              new_y = wrap_coordinate (new_y, game->universe_height * CELL_SIZE);
             }
-          switch (get_occupancy (game, new_x, new_y, &obj))
+          switch (get_occupancy (game, new_x, new_y, &occupant))
             {
             case OCC_EMPTY:
               move_object (object, new_x, new_y);
@@ -686,8 +2583,7 @@ game_update_timer_callback (Game *game)
               break;
             case OCC_BULLET:
               destroy_user = DSK_TRUE;
-              remove_object_from_cell_list (obj);
-              remove_object_from_game_list (obj);
+              kill_entity (game, ENTITY_BULLET, occupant.index);
               break;
             case OCC_GENERATOR:
               destroy_user = DSK_TRUE;
@@ -698,25 +2594,15 @@ game_update_timer_callback (Game *game)
         user->bullet_block--;
       else if (user->bullet_x || user->bullet_y)
         {
-          /* create bullet */
-          Bullet *bullet = dsk_malloc (sizeof (Bullet));
-          bullet->base.type = OBJECT_TYPE_BULLET;
-          bullet->base.game = game;
-
           /* create bullet on top of the user, we'll move it in the next loop */
-          bullet->base.x = user->base.x;
-          bullet->base.y = user->base.y;
-          add_object_to_cell_list (&bullet->base);
-          add_object_to_game_list (&bullet->base);
-          bullet->move_x = user->bullet_x;
-          bullet->move_y = user->bullet_y;
-
+          add_entity (game, ENTITY_BULLET, user->base.x, user->base.y,
+                      PACK_VELOCITY (user->bullet_x, user->bullet_y));
           user->bullet_block = BULLET_BLOCK_PERIOD;
         }
       if (destroy_user)
         {
           remove_object_from_cell_list (object);
-          user->dead_count = DEAD_TIME;
+          user->dead_count = game->rules.dead_time;
         }
 
       object = object->next_in_game;
@@ -725,70 +2611,92 @@ game_update_timer_callback (Game *game)
   /* update bullets, kill stuff */
   {
     unsigned bi;
-    for (bi = 0; bi < BULLET_SPEED; bi++)
+    for (bi = 0; bi < game->rules.bullet_speed; bi++)
       {
-        for (object = game->objects[OBJECT_TYPE_BULLET]; object != NULL; )
+        /* advance every bullet at once; collisions are resolved below */
+        n = bullets->n_entities;
+        ensure_move_scratch (game, n);
+        {
+          int16_t *restrict px = game->proposed_x;
+          int16_t *restrict py = game->proposed_y;
+          const uint16_t *restrict bx = bullets->x;
+          const uint16_t *restrict by = bullets->y;
+          const uint8_t *restrict velocity = bullets->velocity;
+          for (i = 0; i < n; i++)
+            {
+              px[i] = bx[i] + VELOCITY_X (velocity[i]);
+              py[i] = by[i] + VELOCITY_Y (velocity[i]);
+            }
+        }
+        if (wrap)
+          wrap_proposals (game, n);
+
+        for (i = 0; i < n; i++)
           {
-            Bullet *bullet = (Bullet *) object;
             int new_x, new_y;
             dsk_boolean destroy_bullet;
+            Occupant occupant;
+            if (!ENTITY_IS_ALIVE (bullets, i))
+              continue;
+            new_x = game->proposed_x[i];
+            new_y = game->proposed_y[i];
   retry:
-            new_x = object->x + bullet->move_x;
-            new_y = object->y + bullet->move_y;
-            if (game->wrap)
-              {
-                new_x = mod (new_x, game->universe_width * CELL_SIZE);
-                new_y = mod (new_y, game->universe_height * CELL_SIZE);
-              }
             destroy_bullet = DSK_TRUE;
-            void *obj;
-            switch (get_occupancy (game, new_x, new_y, &obj))
+            switch (get_occupancy (game, new_x, new_y, &occupant))
               {
               case OCC_EMPTY:
-                move_object (object, new_x, new_y);
+                move_entity (game, ENTITY_BULLET, i, new_x, new_y);
                 destroy_bullet = DSK_FALSE;
                 break;
               case OCC_WALL:
-                if (bullet->move_x && bullet->move_y && game->diag_bullets_bounce)
-                  {
-                    void *dummy;
-                    dsk_boolean xflip = get_occupancy (game, new_x, object->y, &dummy) == OCC_WALL;
-                    dsk_boolean yflip = get_occupancy (game, object->x, new_y, &dummy) == OCC_WALL;
-                    if (!xflip && !yflip)
-                      xflip = yflip = DSK_TRUE;
-                    if (xflip)
-                      bullet->move_x = -bullet->move_x;
-                    if (yflip)
-                      bullet->move_y = -bullet->move_y;
-                    goto retry;
-                  }
+                {
+                  int move_x = VELOCITY_X (bullets->velocity[i]);
+                  int move_y = VELOCITY_Y (bullets->velocity[i]);
+                  if (move_x && move_y && diag_bullets_bounce)
+                    {
+                      Occupant dummy;
+                      dsk_boolean xflip = get_occupancy (game, new_x, bullets->y[i], &dummy) == OCC_WALL;
+                      dsk_boolean yflip = get_occupancy (game, bullets->x[i], new_y, &dummy) == OCC_WALL;
+                      if (!xflip && !yflip)
+                        xflip = yflip = DSK_TRUE;
+                      if (xflip)
+                        move_x = -move_x;
+                      if (yflip)
+                        move_y = -move_y;
+                      bullets->velocity[i] = PACK_VELOCITY (move_x, move_y);
+                      new_x = bullets->x[i] + move_x;
+                      new_y = bullets->y[i] + move_y;
+                      if (wrap)
+                        {
+                          new_x = wrap_coordinate (new_x, game->universe_width * CELL_SIZE);
+                          new_y = wrap_coordinate (new_y, game->universe_height * CELL_SIZE);
+                        }
+                      goto retry;
+                    }
+                }
                 break;
 
               case OCC_USER:
-                if (game->bullet_kills_player)
+                if (bullet_kills_player)
                   {
                     /* user dies */
-                    User *user = obj;
-                    remove_object_from_cell_list (obj);
-                    user->dead_count = DEAD_TIME;
+                    User *user = occupant.user;
+                    remove_object_from_cell_list (&user->base);
+                    user->dead_count = game->rules.dead_time;
                   }
                 break;
               case OCC_ENEMY:
                 /* destroy enemy */
-                remove_object_from_cell_list (obj);
-                remove_object_from_game_list (obj);
-                dsk_free (obj);
+                kill_entity (game, ENTITY_ENEMY, occupant.index);
                 break;
               case OCC_BULLET:
                 /* destroy other bullet */
-                remove_object_from_cell_list (obj);
-                remove_object_from_game_list (obj);
-                dsk_free (obj);
+                kill_entity (game, ENTITY_BULLET, occupant.index);
                 break;
               case OCC_GENERATOR:
-                if (game->bullet_kills_generator)
+                if (bullet_kills_generator)
                   {
-                    Generator *gen = obj;
+                    Generator *gen = occupant.generator;
                     Cell *cell = game->cells + (gen->x/CELL_SIZE)
                                + (gen->y/CELL_SIZE) * game->universe_width;
                     dsk_assert (cell->generator == gen);
@@ -808,81 +2716,79 @@ game_update_timer_callback (Game *game)
                 break;
               }
             if (destroy_bullet)
-              {
-                Object *next = object->next_in_game;
-                remove_object_from_cell_list (object);
-                remove_object_from_game_list (object);
-                dsk_free (bullet);
-                object = next;
-              }
-            else
-              object = object->next_in_game;
+              kill_entity (game, ENTITY_BULLET, i);
           }
       }
+    entity_pool_compact (game, ENTITY_BULLET);
+    entity_pool_compact (game, ENTITY_ENEMY);
   }
 
   /* update enemies */
-  for (object = game->objects[OBJECT_TYPE_ENEMY]; object != NULL; )
-    {
-      //Enemy *enemy = (Enemy *) object;
-      int new_x, new_y;
-      new_x = object->x;
-      new_y = object->y;
-      if (random_double () < ENEMY_MOVE_FRACTION)
-        {
-          new_x += random_int_range (3) - 1;
-          new_y += random_int_range (3) - 1;
-        }
-      if (game->wrap)
-        {
-          new_x = mod (new_x, game->universe_width * CELL_SIZE);
-          new_y = mod (new_y, game->universe_height * CELL_SIZE);
-        }
-      dsk_boolean destroy_enemy = DSK_FALSE;
-      void *obj;
-      switch (get_occupancy (game, new_x, new_y, &obj))
-        {
-        case OCC_EMPTY:
-          move_object (object, new_x, new_y);
-          break;
-        case OCC_WALL:
-          break;
-
-        case OCC_USER:
-          /* enemy kills user */
-          remove_object_from_game_list (obj);
-          remove_object_from_cell_list (obj);
-          ((User*)obj)->dead_count = DEAD_TIME;
-          break;
-        case OCC_ENEMY:
-          /* move suppressed */
-          break;
-        case OCC_BULLET:
-          /* destroy bullet */
-          remove_object_from_cell_list (obj);
-          remove_object_from_game_list (obj);
-          dsk_free (obj);
-          destroy_enemy = DSK_TRUE;
-          break;
-        case OCC_GENERATOR:
-          break;
-        }
-      if (destroy_enemy)
-        {
-          Object *next = object->next_in_game;
-          remove_object_from_cell_list (object);
-          remove_object_from_game_list (object);
-          dsk_free (object);
-          object = next;
+  update_cell_activity (game);
+  flow_field_update (game);
+  {
+    uint32_t move_threshold = game->rules.enemy_move_fraction * 65536;
+
+    /* random-walk proposals for every enemy at once */
+    n = enemies->n_entities;
+    ensure_move_scratch (game, n);
+    random_lanes_fill (&game->random, n, game->random_words);
+    {
+      int16_t *restrict px = game->proposed_x;
+      int16_t *restrict py = game->proposed_y;
+      const uint16_t *restrict ex = enemies->x;
+      const uint16_t *restrict ey = enemies->y;
+      const uint32_t *restrict random_words = game->random_words;
+      for (i = 0; i < n; i++)
+        {
+          uint32_t r = random_words[i];
+          int moves = (r >> 16) < move_threshold;
+          px[i] = ex[i] + moves * ((int) ((r & 0xff) * 3 >> 8) - 1);
+          py[i] = ey[i] + moves * ((int) (((r >> 8) & 0xff) * 3 >> 8) - 1);
         }
-      else
-        object = object->next_in_game;
     }
 
+    if (game->n_regions > 0)
+      move_enemies_by_region (game);
+    else
+      {
+    /* parked enemies stay put; moving enemies near a user chase instead */
+    for (i = 0; i < n; i++)
+      {
+        int chase_x, chase_y;
+        if ((game->random_words[i] >> 16) >= move_threshold)
+          continue;
+        if (!is_simulated (game, enemies->x[i], enemies->y[i]))
+          {
+            game->proposed_x[i] = enemies->x[i];
+            game->proposed_y[i] = enemies->y[i];
+          }
+        else if (flow_field_descend (game, wrap, enemies->x[i], enemies->y[i],
+                                     game->random_words[i], &chase_x, &chase_y))
+          {
+            game->proposed_x[i] = chase_x;
+            game->proposed_y[i] = chase_y;
+          }
+      }
+    if (wrap)
+      wrap_proposals (game, n);
+
+    for (i = 0; i < n; i++)
+      claim_enemy_move (game, i);
+    for (i = 0; i < n; i++)
+      apply_enemy_move (game, i);
+    clear_enemy_claims (game, n);
+      }
+    entity_pool_compact (game, ENTITY_BULLET);
+    entity_pool_compact (game, ENTITY_ENEMY);
+  }
+
   /* run generators */
   Generator *gen;
   for (gen = game->generators; gen; gen = gen->next_in_game)
     {
+      if (!is_simulated (game, gen->x, gen->y))
+        continue;
       if (random_double () < gen->generator_prob)
         {
           /* try generating enemy */
@@ -895,40 +2801,294 @@ game_update_timer_callback (Game *game)
           int dy = positions[p][1];
           unsigned x = gen->x + dx;
           unsigned y = gen->y + dy;
-          void *dummy;
+          Occupant dummy;
           if (get_occupancy (game, x, y, &dummy) == OCC_EMPTY)
-            {
-              /* create enemy */
-              Enemy *enemy = dsk_malloc (sizeof (Enemy));
-              enemy->base.type = OBJECT_TYPE_ENEMY;
-              enemy->base.x = x;
-              enemy->base.y = y;
-              enemy->base.game = game;
-              add_object_to_cell_list (&enemy->base);
-              add_object_to_game_list (&enemy->base);
-            }
+            add_entity (game, ENTITY_ENEMY, x, y, PACK_VELOCITY (0, 0));
+        }
+    }
+}
+
+#define DEFINE_GAME_TICK(w, b, p, g)                                    \
+  static void game_tick_##w##b##p##g (Game *game)                       \
+  {                                                                     \
+    game_tick_generic (game, w, b, p, g);                               \
+  }
+#define DEFINE_GAME_TICKS_2(w, b)                                       \
+  DEFINE_GAME_TICK(w, b, 0, 0)                                          \
+  DEFINE_GAME_TICK(w, b, 0, 1)                                          \
+  DEFINE_GAME_TICK(w, b, 1, 0)                                          \
+  DEFINE_GAME_TICK(w, b, 1, 1)
+DEFINE_GAME_TICKS_2(0, 0)
+DEFINE_GAME_TICKS_2(0, 1)
+DEFINE_GAME_TICKS_2(1, 0)
+DEFINE_GAME_TICKS_2(1, 1)
+#undef DEFINE_GAME_TICKS_2
+#undef DEFINE_GAME_TICK
+
+static void (*select_game_tick (const GameRules *rules)) (Game *game)
+{
+  /* indexed by wrap, diag_bullets_bounce,
+     bullet_kills_player, bullet_kills_generator */
+  static void (*variants[16]) (Game *game) = {
+    game_tick_0000, game_tick_0001, game_tick_0010, game_tick_0011,
+    game_tick_0100, game_tick_0101, game_tick_0110, game_tick_0111,
+    game_tick_1000, game_tick_1001, game_tick_1010, game_tick_1011,
+    game_tick_1100, game_tick_1101, game_tick_1110, game_tick_1111
+  };
+  return variants[(rules->wrap ? 8 : 0)
+                | (rules->diag_bullets_bounce ? 4 : 0)
+                | (rules->bullet_kills_player ? 2 : 0)
+                | (rules->bullet_kills_generator ? 1 : 0)];
+}
+
+/* --- requests waiting for the next frame --- */
+static void
+add_pending_update (User *user, DskHttpServerRequest *request, uint64_t now)
+{
+  Game *game = user->base.game;
+  dsk_assert (user->pending_request == NULL);
+  user->pending_request = request;
+  user->pending_deadline = now + PENDING_TIMEOUT_USECS;
+  user->prev_pending = NULL;
+  user->next_pending = game->pending_users;
+  if (game->pending_users)
+    game->pending_users->prev_pending = user;
+  game->pending_users = user;
+}
+
+static void
+remove_pending_update (User *user)
+{
+  if (user->prev_pending)
+    user->prev_pending->next_pending = user->next_pending;
+  else
+    user->base.game->pending_users = user->next_pending;
+  if (user->next_pending)
+    user->next_pending->prev_pending = user->prev_pending;
+  user->pending_request = NULL;
+}
+
+/* --- the frame queue, render side --- */
+static dsk_boolean
+frame_queue_push (const FrameMessage *message)
+{
+  unsigned head = frame_queue_head;
+  if (head - __atomic_load_n (&frame_queue_tail, __ATOMIC_ACQUIRE) == FRAME_QUEUE_SIZE)
+    return DSK_FALSE;
+  frame_queue[head % FRAME_QUEUE_SIZE] = *message;
+  __atomic_store_n (&frame_queue_head, head + 1, __ATOMIC_SEQ_CST);
+  return DSK_TRUE;
+}
+
+/* Make sure the network thread will look at the queue. */
+static void
+frame_queue_wake (void)
+{
+  if (__atomic_exchange_n (&frame_queue_signalled, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+      char byte = 0;
+      if (write (frame_queue_wakeup_fds[1], &byte, 1) < 0 && errno != EAGAIN)
+        dsk_warning ("error waking main loop: %s", strerror (errno));
+    }
+}
+
+/* Recompute every game's frame_interval and period_usecs
+   from their measured costs.  The simulation and render threads
+   each have a core: rendering too slowly is fixed by rendering
+   fewer frames, simulating too slowly by stretching the period. */
+static void
+rebalance_games (void)
+{
+  double full_render_load = 0, render_overload;
+  double sim_load = 0, render_load = 0, load;
+  int level;
+  Game *game;
+  for (game = all_games; game; game = game->next_game)
+    full_render_load += game->frame_cost_usecs / game->target_period_usecs;
+  render_overload = full_render_load / LOAD_TARGET;
+
+  for (game = all_games; game; game = game->next_game)
+    {
+      unsigned interval = 1;
+      if (render_overload > 1.0)
+        {
+          interval = (unsigned) render_overload;
+          if (interval < render_overload)
+            interval++;
+          if (interval > MAX_FRAME_INTERVAL)
+            interval = MAX_FRAME_INTERVAL;
         }
+      game->frame_interval = interval;
+      sim_load += (game->sim_cost_usecs + game->snapshot_cost_usecs / interval)
+                / game->target_period_usecs;
+      render_load += game->frame_cost_usecs / interval
+                   / game->target_period_usecs;
     }
+  load = DSK_MAX (sim_load, render_load);
+  __atomic_store_n (&sim_load_permille,
+                    (unsigned) (sim_load * 1000 / LOAD_TARGET), __ATOMIC_RELAXED);
+  __atomic_store_n (&render_load_permille,
+                    (unsigned) (render_load * 1000 / LOAD_TARGET), __ATOMIC_RELAXED);
+
+  period_stretch = load / LOAD_TARGET;
+  if (period_stretch < 1.0)
+    period_stretch = 1.0;
+  else if (period_stretch > MAX_PERIOD_STRETCH)
+    period_stretch = MAX_PERIOD_STRETCH;
+
+  /* spend CPU headroom on compression; none left means the fastest level */
+  level = FRAME_COMPRESS_MAX_LEVEL
+        - (int) ((FRAME_COMPRESS_MAX_LEVEL - FRAME_COMPRESS_MIN_LEVEL) * load / LOAD_TARGET);
+  if (level < FRAME_COMPRESS_MIN_LEVEL)
+    level = FRAME_COMPRESS_MIN_LEVEL;
+  __atomic_store_n (&frame_compression_level, level, __ATOMIC_RELAXED);
+  for (game = all_games; game; game = game->next_game)
+    game->period_usecs = game->target_period_usecs * period_stretch;
+}
 
-  /* finish any requests that were waiting for a new frame */
-  while (game->pending_updates != NULL)
+/* --- the simulation thread --- */
+/* Inputs are each -1, 0 or 1, stored plus one in two bits. */
+static inline uint32_t
+pack_user_input (int move_x, int move_y, int bullet_x, int bullet_y)
+{
+  return (uint32_t) (move_x + 1)
+       | (uint32_t) (move_y + 1) << 2
+       | (uint32_t) (bullet_x + 1) << 4
+       | (uint32_t) (bullet_y + 1) << 6;
+}
+static inline void
+unpack_user_input (uint32_t input,
+                   int *move_x, int *move_y,
+                   int *bullet_x, int *bullet_y)
+{
+  *move_x = (int) (input & 3) - 1;
+  *move_y = (int) ((input >> 2) & 3) - 1;
+  *bullet_x = (int) ((input >> 4) & 3) - 1;
+  *bullet_y = (int) ((input >> 6) & 3) - 1;
+}
+
+/* Take each user's latest input from their mailbox. */
+static void
+read_user_inputs (Game *game)
+{
+  Object *object;
+  for (object = game->users; object; object = object->next_in_game)
     {
-      DskJsonValue *state_json;
-      PendingUpdate *pu = game->pending_updates;
-      game->pending_updates = pu->next;
+      User *user = (User *) object;
+      uint32_t canvas = __atomic_load_n (&user->canvas, __ATOMIC_RELAXED);
+      unpack_user_input (__atomic_load_n (&user->input, __ATOMIC_RELAXED),
+                         &user->move_x, &user->move_y,
+                         &user->bullet_x, &user->bullet_y);
+      user->width = canvas >> 16;
+      user->height = canvas & 0xffff;
+    }
+}
+
+/* Advance the game's deadline by one period and put it on the wheel.
+   Deadlines are absolute, so time spent ticking does not
+   accumulate as drift; but if we have fallen more than a period
+   behind, skip ahead rather than running a burst of catch-up ticks. */
+static void
+schedule_next_tick (Game *game, uint64_t now)
+{
+  game->next_tick_usecs += game->period_usecs;
+  if (game->next_tick_usecs + game->period_usecs < now)
+    game->next_tick_usecs = now;
+  timer_wheel_add (&game_wheel, &game->tick_timer, game->next_tick_usecs);
+}
+
+static void
+game_update_timer_callback (Game *game)
+{
+  uint64_t start, ticked, end;
 
-      state_json = create_user_update (pu->user);
-      respond_take_json (pu->request, state_json);
-      dsk_free (pu);
+  pthread_mutex_lock (&world_lock);
+  if (game->frozen)
+    {
+      /* being migrated: leave the wheel for good */
+      game->stopped = DSK_TRUE;
+      pthread_mutex_unlock (&world_lock);
+      return;
+    }
+  read_user_inputs (game);
+  start = get_monotonic_usecs ();
+  game->tick (game);
+  ticked = get_monotonic_usecs ();
+  game->sim_cost_usecs += TICK_COST_SMOOTHING
+                        * ((double) (ticked - start) - game->sim_cost_usecs);
+
+  if (game->latest_update % game->frame_interval == 0)
+    {
+      __atomic_store_n (&game->latest_frame, game->latest_frame + 1,
+                        __ATOMIC_RELAXED);
+      take_frame_snapshot (game);
+      end = get_monotonic_usecs ();
+      game->snapshot_cost_usecs += TICK_COST_SMOOTHING
+                   * ((double) (end - ticked) - game->snapshot_cost_usecs);
     }
+  else
+    end = ticked;
 
   game->latest_update += 1;
-  game->timer = dsk_main_add_timer_millis (update_period_msecs,
-                                    (DskTimerFunc) game_update_timer_callback,
-                                    game);
+  if (end >= next_rebalance_usecs)
+    {
+      rebalance_games ();
+      next_rebalance_usecs = end + REBALANCE_PERIOD_USECS;
+    }
+  pthread_mutex_unlock (&world_lock);
+  schedule_next_tick (game, end);
+}
+
+/* Put newly started games on the wheel, each in the least busy
+   slot of its first period, so that games are spread evenly. */
+static void
+schedule_starting_games (uint64_t now)
+{
+  while (starting_games != NULL)
+    {
+      Game *game = starting_games;
+      starting_games = game->next_starting;
+      game->period_usecs = game->target_period_usecs * period_stretch;
+      game->next_tick_usecs = timer_wheel_least_loaded (&game_wheel, now,
+                       game->period_usecs / WHEEL_RESOLUTION_USECS)
+                            - game->period_usecs;
+      schedule_next_tick (game, now);
+    }
+}
+
+static void *
+sim_thread_main (void *data)
+{
+  DSK_UNUSED (data);
+  pthread_mutex_lock (&world_lock);
+  for (;;)
+    {
+      uint64_t now = get_monotonic_usecs ();
+      uint64_t expiry;
+      schedule_starting_games (now);
+      expiry = timer_wheel_next_expiry (&game_wheel);
+      if (expiry == 0)
+        pthread_cond_wait (&sim_wakeup, &world_lock);
+      else if (expiry > now)
+        {
+          struct timespec ts;
+          ts.tv_sec = expiry / 1000000;
+          ts.tv_nsec = expiry % 1000000 * 1000;
+          pthread_cond_timedwait (&sim_wakeup, &world_lock, &ts);
+        }
+      else
+        {
+          /* each game takes the lock for its own tick */
+          pthread_mutex_unlock (&world_lock);
+          timer_wheel_advance (&game_wheel, now);
+          pthread_mutex_lock (&world_lock);
+        }
+    }
+  return NULL;
 }
 
 /* --- Creating a user in a game --- */
+/* Called with world_lock held. */
 static User *
 create_user (Game *game, const char *name, unsigned width, unsigned height)
 {
@@ -936,7 +3096,6 @@ create_user (Game *game, const char *name, unsigned width, unsigned height)
   Cell *cell;
 
   user->name = dsk_strdup (name);
-  user->base.type = OBJECT_TYPE_USER;
   user->base.game = game;
 
   /* pick random unoccupied position */
@@ -954,12 +3113,23 @@ create_user (Game *game, const char *name, unsigned width, unsigned height)
 
   user->width = width;
   user->height = height;
+  user->canvas = width << 16 | height;
 
   user->dead_count = 0;
+  user->in_flow_field = DSK_FALSE;
+  user->flow_x = user->flow_y = 0;
 
   user->last_seen_time = dsk_dispatch_default ()->last_dispatch_secs;
   user->move_x = user->move_y = 0;
-  user->last_update = (unsigned)(-1);
+  user->input = pack_user_input (0, 0, 0, 0);
+  user->last_polled = game->latest_frame;
+  user->frame = NULL;
+  user->last_frame = (unsigned)(-1);
+  user->last_seq = 0;
+  user->pending_request = NULL;
+  user->departed = DSK_FALSE;
+
+  lobby_changed (game);
   return user;
 }
 
@@ -1097,22 +3267,209 @@ add_generator (unsigned *n_inout,
            dsk_json_value_new_object (DSK_N_ELEMENTS (members), members));
 }
 
-static DskJsonValue *
-create_user_update (User *user)
+/* Not drawn: tells the client how fast the game is running,
+   which frame this is, where the view is centered, and the size
+   of canvas it was drawn for. */
+static void
+add_info (unsigned *n_inout,
+          DskJsonValue ***arr_inout,
+          unsigned *alloced_inout,
+          const FrameSnapshot *snapshot,
+          int       view_x,
+          int       view_y,
+          unsigned  width,
+          unsigned  height)
 {
-  Game *game = user->base.game;
+  DskJsonMember members[9];
+  members[0].name = "period";
+  members[0].value = dsk_json_value_new_number (snapshot->period_usecs / 1000.0);
+  members[1].name = "frame_interval";
+  members[1].value = dsk_json_value_new_number (snapshot->frame_interval);
+  members[2].name = "update";
+  members[2].value = dsk_json_value_new_number (snapshot->latest_update);
+  members[3].name = "frame";
+  members[3].value = dsk_json_value_new_number (snapshot->frame_number);
+  members[4].name = "x";
+  members[4].value = dsk_json_value_new_number (view_x);
+  members[5].name = "y";
+  members[5].value = dsk_json_value_new_number (view_y);
+  members[6].name = "w";
+  members[6].value = dsk_json_value_new_number (width);
+  members[7].name = "h";
+  members[7].value = dsk_json_value_new_number (height);
+  members[8].name = "type";
+  members[8].value = dsk_json_value_new_string (4, "info");
+  append_element_json (n_inout, arr_inout, alloced_inout,
+           dsk_json_value_new_object (DSK_N_ELEMENTS (members), members));
+}
 
-  /* width/height in various units, rounded up */
-  unsigned tile_width = (user->width + TILE_SIZE - 1) / TILE_SIZE;
-  unsigned tile_height = (user->height + TILE_SIZE - 1) / TILE_SIZE;
-  unsigned cell_width = (tile_width + CELL_SIZE * 2 - 2) / CELL_SIZE;
-  unsigned cell_height = (tile_height + CELL_SIZE * 2 - 2) / CELL_SIZE;
+/* Map the un-wrapped cell ucx,ucy of a view to a cell of the universe.
+   Returns FALSE if it is beyond the left or top edge of a non-wrapping
+   universe; beyond the right or bottom edge, cx,cy may be out of
+   range, and only walls are drawn there. */
+static dsk_boolean
+map_view_cell (Game *game, int ucx, int ucy, unsigned *cx_out, unsigned *cy_out)
+{
+  unsigned cx, cy;
+  if (ucx < 0)
+    {
+      if (!game->rules.wrap)
+        return DSK_FALSE;
+      cx = ucx + game->universe_width;
+    }
+  else if ((unsigned) ucx >= game->universe_width)
+    {
+      cx = ucx;
+      if (game->rules.wrap)
+        cx -= game->universe_width;
+    }
+  else
+    cx = ucx;
+  if (ucy < 0)
+    {
+      if (!game->rules.wrap)
+        return DSK_FALSE;
+      cy = ucy + game->universe_height;
+    }
+  else if ((unsigned) ucy >= game->universe_height)
+    {
+      cy = ucy;
+      if (game->rules.wrap)
+        cy -= game->universe_height;
+    }
+  else
+    cy = ucy;
+  *cx_out = cx;
+  *cy_out = cy;
+  return DSK_TRUE;
+}
 
-  /* left/upper corner, rounded down */
-  int min_tile_x = user->base.x - (tile_width+1) / 2;
-  int min_tile_y = user->base.y - (tile_height+1) / 2;
-  int min_cell_x = int_div (min_tile_x, CELL_SIZE);
-  int min_cell_y = int_div (min_tile_y, CELL_SIZE);
+/* The tile after a cell's corner post is wall exactly when the
+   cell has that wall.  Past the far edge of a non-wrapping
+   universe, everything is wall. */
+static inline dsk_boolean
+view_has_vertical_wall (Game *game, unsigned cx, unsigned cy)
+{
+  return cy < game->universe_height && cx <= game->universe_width
+      && tile_is_wall (game, cx * CELL_SIZE, cy * CELL_SIZE + 1);
+}
+static inline dsk_boolean
+view_has_horizontal_wall (Game *game, unsigned cx, unsigned cy)
+{
+  return cy <= game->universe_height && cx < game->universe_width
+      && tile_is_wall (game, cx * CELL_SIZE + 1, cy * CELL_SIZE);
+}
+
+/* Overview frames: walls merged into runs, and enemies
+   drawn as one shaded square per cell. */
+static void
+add_overview_walls (unsigned *n_inout,
+                    DskJsonValue ***arr_inout,
+                    unsigned *alloced_inout,
+                    Game     *game,
+                    int       min_cell_x,
+                    int       min_cell_y,
+                    unsigned  cell_width,
+                    unsigned  cell_height,
+                    int       px0,
+                    int       py0)
+{
+  unsigned x, y, cx, cy;
+  int run_start;
+  for (x = 0; x < cell_width; x++)
+    {
+      run_start = -1;
+      for (y = 0; y <= cell_height; y++)
+        {
+          dsk_boolean wall = y < cell_height
+                          && map_view_cell (game, x + min_cell_x, y + min_cell_y, &cx, &cy)
+                          && view_has_vertical_wall (game, cx, cy);
+          if (wall && run_start < 0)
+            run_start = y;
+          else if (!wall && run_start >= 0)
+            {
+              add_wall (n_inout, arr_inout, alloced_inout,
+                        px0 + x * CELL_SIZE * TILE_SIZE,
+                        py0 + run_start * CELL_SIZE * TILE_SIZE,
+                        TILE_SIZE,
+                        TILE_SIZE * ((y - run_start) * CELL_SIZE + 1));
+              run_start = -1;
+            }
+        }
+    }
+  for (y = 0; y < cell_height; y++)
+    {
+      run_start = -1;
+      for (x = 0; x <= cell_width; x++)
+        {
+          dsk_boolean wall = x < cell_width
+                          && map_view_cell (game, x + min_cell_x, y + min_cell_y, &cx, &cy)
+                          && view_has_horizontal_wall (game, cx, cy);
+          if (wall && run_start < 0)
+            run_start = x;
+          else if (!wall && run_start >= 0)
+            {
+              add_wall (n_inout, arr_inout, alloced_inout,
+                        px0 + run_start * CELL_SIZE * TILE_SIZE,
+                        py0 + y * CELL_SIZE * TILE_SIZE,
+                        TILE_SIZE * ((x - run_start) * CELL_SIZE + 1),
+                        TILE_SIZE);
+              run_start = -1;
+            }
+        }
+    }
+}
+static void
+add_enemy_density (unsigned *n_inout,
+                   DskJsonValue ***arr_inout,
+                   unsigned *alloced_inout,
+                   int       px,
+                   int       py,
+                   unsigned  n_enemies)
+{
+  DskJsonMember members[6];
+  char color[32];
+  double alpha = 0.25 + n_enemies * 0.075;
+  if (alpha > 1.0)
+    alpha = 1.0;
+  snprintf (color, sizeof (color), "rgba(255,51,51,%.2f)", alpha);
+  members[0].name = "x";
+  members[0].value = dsk_json_value_new_number (px + TILE_SIZE);
+  members[1].name = "y";
+  members[1].value = dsk_json_value_new_number (py + TILE_SIZE);
+  members[2].name = "width";
+  members[2].value = dsk_json_value_new_number (TILE_SIZE * (CELL_SIZE - 1));
+  members[3].name = "height";
+  members[3].value = dsk_json_value_new_number (TILE_SIZE * (CELL_SIZE - 1));
+  members[4].name = "color";
+  members[4].value = dsk_json_value_new_string (strlen (color), color);
+  members[5].name = "type";
+  members[5].value = dsk_json_value_new_string (9, "rectangle");
+  append_element_json (n_inout, arr_inout, alloced_inout,
+           dsk_json_value_new_object (DSK_N_ELEMENTS (members), members));
+}
+
+/* Render the width x height pixel view of a snapshot centered on tile
+   view_x,view_y.  'self', if not NULL, is drawn highlighted; in fog
+   games, only the walls of cells 'self' cannot see into are drawn.
+   Views of more than OVERVIEW_MIN_CELLS cells get an overview; either
+   way, bullets and enemies stop being drawn after MAX_FRAME_ELEMENTS
+   elements. */
+static DskJsonValue *
+render_view (const FrameSnapshot *snapshot,
+             int      view_x,
+             int      view_y,
+             unsigned width,
+             unsigned height,
+             User    *self)
+{
+  Game *game = snapshot->game;
+  unsigned cell_width, cell_height;
+  int min_cell_x, min_cell_y;
+  int px0, py0;                         /* position of the first cell */
+  dsk_boolean overview;
+  const uint32_t *vis = NULL;           /* fog: what 'self' can see */
+  int self_cell_x = 0, self_cell_y = 0;
 
   unsigned alloced = 16;
   DskJsonValue **elements = dsk_malloc (sizeof (DskJsonValue *) * alloced);
@@ -1120,201 +3477,2066 @@ create_user_update (User *user)
 
   unsigned x, y;
 
+  get_viewport_cells (view_x, view_y, width, height,
+                      &min_cell_x, &min_cell_y,
+                      &cell_width, &cell_height);
+  px0 = (min_cell_x * CELL_SIZE - view_x) * TILE_SIZE + width / 2 - TILE_SIZE / 2;
+  py0 = (min_cell_y * CELL_SIZE - view_y) * TILE_SIZE + height / 2 - TILE_SIZE / 2;
+  overview = cell_width * cell_height > OVERVIEW_MIN_CELLS;
+  if (game->rules.fog && self != NULL)
+    {
+      /* the view is centered on 'self' */
+      vis = cell_visibility (game, view_x / CELL_SIZE, view_y / CELL_SIZE);
+      self_cell_x = int_div (view_x, CELL_SIZE);
+      self_cell_y = int_div (view_y, CELL_SIZE);
+    }
+  if (overview)
+    add_overview_walls (&n_elements, &elements, &alloced, game,
+                        min_cell_x, min_cell_y, cell_width, cell_height,
+                        px0, py0);
+
   for (x = 0; x < cell_width; x++)
     for (y = 0; y < cell_height; y++)
       {
-        int ucx = x + min_cell_x;               /* un-wrapped x, y */
-        int ucy = y + min_cell_y;
-        int px = (ucx * CELL_SIZE - user->base.x) * TILE_SIZE + user->width / 2 - TILE_SIZE / 2;
-        int py = (ucy * CELL_SIZE - user->base.y) * TILE_SIZE + user->height / 2 - TILE_SIZE / 2;
-        unsigned cx, cy;
-        Cell *cell;
+        int px = px0 + x * CELL_SIZE * TILE_SIZE;
+        int py = py0 + y * CELL_SIZE * TILE_SIZE;
+        unsigned cx, cy, cell_index;
+        const SnapshotThing *thing, *end;
+        unsigned n_enemies = 0;
 
         /* deal with wrapping (or not) */
-        if (ucx < 0)
-          {
-            if (!game->wrap)
-              continue;
-            cx = ucx + game->universe_width;
-          }
-        else if ((unsigned) ucx >= game->universe_width)
-          {
-            cx = ucx;
-            if (game->wrap)
-              cx -= game->universe_width;
-          }
-        else
-          cx = ucx;
-        if (ucy < 0)
-          {
-            if (!game->wrap)
-              continue;
-            cy = ucy + game->universe_height;
-          }
-        else if ((unsigned) ucy >= game->universe_height)
-          {
-            cy = ucy;
-            if (game->wrap)
-              cy -= game->universe_height;
-          }
-        else
-          cy = ucy;
+        if (!map_view_cell (game, x + min_cell_x, y + min_cell_y, &cx, &cy))
+          continue;
 
         /* render walls */
-        if (cy < game->universe_height && cx <= game->universe_width
-            && game->v_walls[cx + cy * game->universe_width])
-          {
-            /* render vertical wall */
-            add_wall (&n_elements, &elements, &alloced,
-                      px, py, TILE_SIZE, TILE_SIZE * (CELL_SIZE+1));
-          }
-        if (cy <= game->universe_height && cx < game->universe_width
-            && game->h_walls[cx + cy * game->universe_width])
+        if (!overview)
           {
-            /* render horizontal wall */
-            add_wall (&n_elements, &elements, &alloced,
-                      px, py, TILE_SIZE * (CELL_SIZE+1), TILE_SIZE);
+            if (view_has_vertical_wall (game, cx, cy))
+              add_wall (&n_elements, &elements, &alloced,
+                        px, py, TILE_SIZE, TILE_SIZE * (CELL_SIZE+1));
+            if (view_has_horizontal_wall (game, cx, cy))
+              add_wall (&n_elements, &elements, &alloced,
+                        px, py, TILE_SIZE * (CELL_SIZE+1), TILE_SIZE);
           }
         if (cx >= game->universe_width || cy >= game->universe_height)
           continue;
+        if (vis != NULL
+         && !visibility_includes (vis, x + min_cell_x - self_cell_x,
+                                  y + min_cell_y - self_cell_y))
+          continue;
 
-        cell = game->cells + (game->universe_width * cy + cx);
-
-        /* render bullets */
-        Object *object;
-        for (object = cell->objects[OBJECT_TYPE_BULLET]; object; object = object->next_in_cell)
-          {
-            int bx = px + (object->x - cx * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            int by = py + (object->y - cy * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            add_bullet (&n_elements, &elements, &alloced,
-                        bx, by);
-          }
-
-        /* render dudes */
-        for (object = cell->objects[OBJECT_TYPE_USER]; object; object = object->next_in_cell)
-          {
-            int bx = px + (object->x - cx * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            int by = py + (object->y - cy * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            add_user (&n_elements, &elements, &alloced,
-                      bx, by, user == (User*) object);
-          }
-
-        /* render bad guys */
-        for (object = cell->objects[OBJECT_TYPE_ENEMY]; object; object = object->next_in_cell)
-          {
-            int bx = px + (object->x - cx * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            int by = py + (object->y - cy * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
-            add_enemy (&n_elements, &elements, &alloced, bx, by);
-          }
-
-        /* render generators */
-        if (cell->generator)
+        /* render bullets, dudes, bad guys and generators, in that order */
+        if (snapshot->view_cell_width != 0)
+          cell_index = cell_width * y + x;
+        else
+          cell_index = game->universe_width * cy + cx;
+        thing = snapshot->things + snapshot->cell_start[cell_index];
+        end = snapshot->things + snapshot->cell_start[cell_index + 1];
+        for (; thing < end; thing++)
           {
-            int bx = px + (cell->generator->x - cx * CELL_SIZE) * TILE_SIZE + TILE_SIZE;
-            int by = py + (cell->generator->y - cy * CELL_SIZE) * TILE_SIZE + TILE_SIZE;
-            add_generator (&n_elements, &elements, &alloced, bx, by, user->base.game->latest_update);
+            int bx = px + (thing->x - cx * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
+            int by = py + (thing->y - cy * CELL_SIZE) * TILE_SIZE + TILE_SIZE / 2;
+            switch (thing->kind)
+              {
+              case SNAPSHOT_BULLET:
+                if (!overview && n_elements < MAX_FRAME_ELEMENTS)
+                  add_bullet (&n_elements, &elements, &alloced, bx, by);
+                break;
+              case SNAPSHOT_USER:
+                add_user (&n_elements, &elements, &alloced,
+                          bx, by, self == thing->user);
+                break;
+              case SNAPSHOT_ENEMY:
+                if (overview)
+                  n_enemies++;
+                else if (n_elements < MAX_FRAME_ELEMENTS)
+                  add_enemy (&n_elements, &elements, &alloced, bx, by);
+                break;
+              case SNAPSHOT_GENERATOR:
+                /* a whole tile in from the cell's corner */
+                add_generator (&n_elements, &elements, &alloced,
+                               bx - TILE_SIZE / 2 + TILE_SIZE,
+                               by - TILE_SIZE / 2 + TILE_SIZE,
+                               snapshot->latest_update);
+                break;
+              }
           }
+        if (n_enemies > 0 && n_elements < MAX_FRAME_ELEMENTS)
+          add_enemy_density (&n_elements, &elements, &alloced,
+                             px, py, n_enemies);
       }
+  add_info (&n_elements, &elements, &alloced, snapshot, view_x, view_y,
+            width, height);
+
   DskJsonValue *rv;
   rv = dsk_json_value_new_array (n_elements, elements);
   dsk_free (elements);
-
-  user->last_update = game->latest_update;
   return rv;
 }
 
-/* --- bookkeeping functions --- */
-static Game *
-find_game (const char *name)
+/* --- snapshots --- */
+static void
+snapshot_add_thing (FrameSnapshot *snapshot,
+                    unsigned x, unsigned y, SnapshotKind kind, User *user)
 {
-  Game *game;
-  for (game = all_games; game; game = game->next_game)
-    if (strcmp (game->name, name) == 0)
-      return game;
-  return NULL;
+  SnapshotThing *thing;
+  if (snapshot->n_things == snapshot->things_alloced)
+    {
+      snapshot->things_alloced = snapshot->things_alloced ? snapshot->things_alloced * 2 : 256;
+      snapshot->things = dsk_realloc (snapshot->things,
+                                      sizeof (SnapshotThing) * snapshot->things_alloced);
+    }
+  thing = snapshot->things + snapshot->n_things++;
+  thing->x = x;
+  thing->y = y;
+  thing->kind = kind;
+  thing->user = user;
 }
-static User *
-find_user (const char *name)
+
+static void
+snapshot_add_target (FrameSnapshot *snapshot, User *user, Watch *watch,
+                     int view_x, int view_y, unsigned width, unsigned height)
 {
-  Game *game;
-  for (game = all_games; game; game = game->next_game)
+  RenderTarget *target;
+  if (snapshot->n_targets == snapshot->targets_alloced)
+    {
+      snapshot->targets_alloced = snapshot->targets_alloced ? snapshot->targets_alloced * 2 : 8;
+      snapshot->targets = dsk_realloc (snapshot->targets,
+                                       sizeof (RenderTarget) * snapshot->targets_alloced);
+    }
+  target = snapshot->targets + snapshot->n_targets++;
+  target->user = user;
+  target->watch = watch;
+  target->view_x = view_x;
+  target->view_y = view_y;
+  target->width = width;
+  target->height = height;
+}
+
+static void
+snapshot_begin (FrameSnapshot *snapshot, Game *game)
+{
+  snapshot->game = game;
+  snapshot->frame_number = game->latest_frame;
+  snapshot->latest_update = game->latest_update;
+  snapshot->period_usecs = game->period_usecs;
+  snapshot->frame_interval = game->frame_interval;
+  snapshot->n_things = 0;
+}
+
+static void
+snapshot_add_cell (FrameSnapshot *snapshot, Game *game, Cell *cell)
+{
+  EntityPool *bullets = game->pools + ENTITY_BULLET;
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  Object *object;
+  uint32_t ei;
+  for (ei = cell->entities[ENTITY_BULLET]; ei != ENTITY_NONE; ei = bullets->next_in_cell[ei])
+    snapshot_add_thing (snapshot, bullets->x[ei], bullets->y[ei], SNAPSHOT_BULLET, NULL);
+  for (object = cell->users; object; object = object->next_in_cell)
+    snapshot_add_thing (snapshot, object->x, object->y, SNAPSHOT_USER, (User *) object);
+  for (ei = cell->entities[ENTITY_ENEMY]; ei != ENTITY_NONE; ei = enemies->next_in_cell[ei])
+    snapshot_add_thing (snapshot, enemies->x[ei], enemies->y[ei], SNAPSHOT_ENEMY, NULL);
+  if (cell->generator)
+    snapshot_add_thing (snapshot, cell->generator->x, cell->generator->y,
+                        SNAPSHOT_GENERATOR, NULL);
+}
+
+/* Copy the world into 'snapshot'.  Called with world_lock held. */
+static void
+snapshot_take (FrameSnapshot *snapshot, Game *game)
+{
+  unsigned usize = game->universe_width * game->universe_height;
+  unsigned i;
+  snapshot_begin (snapshot, game);
+  if (snapshot->cell_start == NULL)
+    snapshot->cell_start = dsk_malloc (sizeof (uint32_t) * (usize + 1));
+  for (i = 0; i < usize; i++)
+    {
+      snapshot->cell_start[i] = snapshot->n_things;
+      snapshot_add_cell (snapshot, game, game->cells + i);
+    }
+  snapshot->cell_start[usize] = snapshot->n_things;
+}
+
+/* Copy just the cells of one view into a fresh 'snapshot', for
+   render_view() of that view alone: a first frame costs what the
+   view covers, not the whole maze.  Called with world_lock held. */
+static void
+snapshot_take_view (FrameSnapshot *snapshot, Game *game,
+                    int view_x, int view_y, unsigned width, unsigned height)
+{
+  int min_cell_x, min_cell_y;
+  unsigned cell_width, cell_height;
+  unsigned x, y;
+  snapshot_begin (snapshot, game);
+  get_viewport_cells (view_x, view_y, width, height,
+                      &min_cell_x, &min_cell_y,
+                      &cell_width, &cell_height);
+  snapshot->view_cell_width = cell_width;
+  snapshot->cell_start = dsk_malloc (sizeof (uint32_t) * (cell_width * cell_height + 1));
+  for (y = 0; y < cell_height; y++)
+    for (x = 0; x < cell_width; x++)
+      {
+        unsigned cx, cy;
+        snapshot->cell_start[cell_width * y + x] = snapshot->n_things;
+        if (map_view_cell (game, x + min_cell_x, y + min_cell_y, &cx, &cy)
+         && cx < game->universe_width && cy < game->universe_height)
+          snapshot_add_cell (snapshot, game,
+                             game->cells + game->universe_width * cy + cx);
+      }
+  snapshot->cell_start[cell_width * cell_height] = snapshot->n_things;
+}
+
+static void
+snapshot_clear (FrameSnapshot *snapshot)
+{
+  dsk_free (snapshot->cell_start);
+  dsk_free (snapshot->things);
+  dsk_free (snapshot->targets);
+}
+
+/* At the end of a frame tick: fill the free snapshot with the world
+   and the users and spectated regions polled lately, and pass it to
+   the render thread.  If both snapshots are still being rendered,
+   the renderer is behind, and this frame is skipped. */
+static void
+take_frame_snapshot (Game *game)
+{
+  FrameSnapshot *snapshot = game->snapshots + game->next_snapshot;
+  Object *object;
+  Watch *watch;
+  if (__atomic_load_n (&snapshot->busy, __ATOMIC_ACQUIRE))
+    return;
+  if (snapshot->render_usecs != 0)
+    {
+      game->frame_cost_usecs += TICK_COST_SMOOTHING
+                 * ((double) snapshot->render_usecs - game->frame_cost_usecs);
+      snapshot->render_usecs = 0;
+    }
+
+  snapshot->n_targets = 0;
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      User *user = (User *) object;
+      if (game->latest_frame - __atomic_load_n (&user->last_polled, __ATOMIC_RELAXED)
+          <= POLL_IDLE_FRAMES)
+        snapshot_add_target (snapshot, user, NULL, object->x, object->y,
+                             user->width, user->height);
+    }
+  for (watch = game->watches; watch; watch = watch->next_in_game)
+    if (game->latest_frame - watch->last_wanted <= POLL_IDLE_FRAMES
+     || __atomic_load_n (&watch->n_waiting, __ATOMIC_RELAXED) > 0)
+      {
+        /* keeps the region alive until its frame is delivered */
+        __atomic_add_fetch (&watch->frames_queued, 1, __ATOMIC_RELAXED);
+        snapshot_add_target (snapshot, NULL, watch, watch->view_x, watch->view_y,
+                             watch->width, watch->height);
+      }
+  if (snapshot->n_targets == 0)
+    return;
+
+  snapshot_take (snapshot, game);
+  snapshot->busy = 1;
+  game->next_snapshot ^= 1;
+
+  pthread_mutex_lock (&render_lock);
+  snapshot->next_job = NULL;
+  *render_jobs_tail = snapshot;
+  render_jobs_tail = &snapshot->next_job;
+  pthread_cond_signal (&render_wakeup);
+  pthread_mutex_unlock (&render_lock);
+}
+
+/* --- the render thread --- */
+/* Render every target of a snapshot, and queue the
+   frames for the network thread.  A frame that does not fit
+   in the queue is dropped; the next one will do. */
+static void
+render_snapshot (FrameSnapshot *snapshot)
+{
+  uint64_t start = get_monotonic_usecs ();
+  FrameMessage message;
+  dsk_boolean queued = DSK_FALSE;
+  unsigned i;
+  message.frame_number = snapshot->frame_number;
+  for (i = 0; i < snapshot->n_targets; i++)
+    {
+      RenderTarget *target = snapshot->targets + i;
+      message.user = target->user;
+      message.watch = target->watch;
+      message.frame = render_view (snapshot, target->view_x, target->view_y,
+                                   target->width, target->height, target->user);
+      message.rendered_usecs = get_monotonic_usecs ();
+      if (frame_queue_push (&message))
+        queued = DSK_TRUE;
+      else
+        {
+          if (target->watch != NULL)
+            __atomic_sub_fetch (&target->watch->frames_queued, 1, __ATOMIC_RELEASE);
+          dsk_json_value_free (message.frame);
+        }
+    }
+  if (queued)
+    frame_queue_wake ();
+  snapshot->render_usecs = get_monotonic_usecs () - start;
+}
+
+static void *
+render_thread_main (void *data)
+{
+  DSK_UNUSED (data);
+  for (;;)
+    {
+      FrameSnapshot *snapshot;
+      pthread_mutex_lock (&render_lock);
+      while (render_jobs == NULL)
+        pthread_cond_wait (&render_wakeup, &render_lock);
+      snapshot = render_jobs;
+      render_jobs = snapshot->next_job;
+      if (render_jobs == NULL)
+        render_jobs_tail = &render_jobs;
+      pthread_mutex_unlock (&render_lock);
+
+      render_snapshot (snapshot);
+      __atomic_store_n (&snapshot->busy, 0, __ATOMIC_RELEASE);
+    }
+  return NULL;
+}
+
+/* --- bookkeeping functions --- */
+static Game *
+find_game (const char *name)
+{
+  Game *game;
+  for (game = all_games; game; game = game->next_game)
+    if (strcmp (game->name, name) == 0)
+      return game;
+  return NULL;
+}
+static User *
+find_user (const char *name)
+{
+  Game *game;
+  for (game = all_games; game; game = game->next_game)
+    {
+      Object *object;
+      for (object = game->users; object != NULL; object = object->next_in_game)
+        if (strcmp (((User*)object)->name, name) == 0)
+          return (User*) object;
+    }
+  return NULL;
+}
+
+/* --- static assets ---
+   Loaded into memory at startup (and again on SIGHUP), each with a
+   gzipped copy and a strong ETag, so that serving them touches
+   neither the disk nor the compressor. */
+typedef struct _StaticAsset StaticAsset;
+struct _StaticAsset
+{
+  const char *filename;         /* relative to html_dir */
+  const char *content_type;
+  uint8_t *data;
+  unsigned length;
+  uint8_t *gzipped;             /* NULL if compression did not help */
+  unsigned gzipped_length;
+  char etag[20];                /* quoted 64-bit hash of data */
+};
+static StaticAsset main_page_asset = { "snipez.html", "text/html; charset=UTF-8", NULL, 0, NULL, 0, "" };
+static StaticAsset *static_assets[] = { &main_page_asset };
+static const char *html_dir = "../html";
+
+static const char *
+request_header (DskHttpServerRequest *request, const char *key)
+{
+  DskHttpRequest *req = request->request;
+  unsigned i;
+  for (i = 0; i < req->n_unparsed_headers; i++)
+    if (strcasecmp (req->unparsed_headers[i].key, key) == 0)
+      return req->unparsed_headers[i].value;
+  return NULL;
+}
+
+/* Does a comma-separated header value (eg Accept-Encoding) list 'token'?
+   Ignores parameters like ";q=0.5", except that q=0 means no. */
+static dsk_boolean
+header_lists_token (const char *value, const char *token)
+{
+  unsigned len = strlen (token);
+  while (value != NULL && *value != 0)
+    {
+      const char *end;
+      while (*value == ' ' || *value == ',')
+        value++;
+      end = value + strcspn (value, ",");
+      if (strncasecmp (value, token, len) == 0
+       && (value[len] == 0 || value[len] == ',' || value[len] == ';' || value[len] == ' '))
+        {
+          const char *q = strstr (value, "q=");
+          return !(q != NULL && q < end && strtod (q + 2, NULL) == 0);
+        }
+      value = end;
+    }
+  return DSK_FALSE;
+}
+
+/* Does If-None-Match allow a 304 for this entity tag? */
+static dsk_boolean
+etag_matches (DskHttpServerRequest *request, const char *etag)
+{
+  const char *if_none_match = request_header (request, "If-None-Match");
+  return if_none_match != NULL
+      && (strstr (if_none_match, etag) != NULL
+       || strcmp (if_none_match, "*") == 0);
+}
+
+static uint64_t
+fnv1a_64 (unsigned length, const uint8_t *data)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  unsigned i;
+  for (i = 0; i < length; i++)
+    {
+      hash ^= data[i];
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+static uint8_t *
+gzip_compress (unsigned length, const uint8_t *data, unsigned *length_out)
+{
+  z_stream z;
+  uLong max = compressBound (length) + 32;      /* plus gzip header */
+  uint8_t *out = dsk_malloc (max);
+  memset (&z, 0, sizeof (z));
+  if (deflateInit2 (&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                    Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      dsk_free (out);
+      return NULL;
+    }
+  z.next_in = (Bytef *) data;
+  z.avail_in = length;
+  z.next_out = out;
+  z.avail_out = max;
+  if (deflate (&z, Z_FINISH) != Z_STREAM_END)
+    {
+      deflateEnd (&z);
+      dsk_free (out);
+      return NULL;
+    }
+  *length_out = z.total_out;
+  deflateEnd (&z);
+  return out;
+}
+
+/* Returns FALSE, leaving the old contents in place, on error. */
+static dsk_boolean
+load_static_asset (StaticAsset *asset)
+{
+  char *path = dsk_malloc (strlen (html_dir) + strlen (asset->filename) + 2);
+  FILE *fp;
+  long size;
+  uint8_t *data;
+  sprintf (path, "%s/%s", html_dir, asset->filename);
+  fp = fopen (path, "rb");
+  if (fp == NULL)
+    {
+      dsk_warning ("error opening %s", path);
+      dsk_free (path);
+      return DSK_FALSE;
+    }
+  if (fseek (fp, 0, SEEK_END) < 0
+   || (size = ftell (fp)) < 0
+   || fseek (fp, 0, SEEK_SET) < 0)
+    {
+      dsk_warning ("error getting size of %s", path);
+      fclose (fp);
+      dsk_free (path);
+      return DSK_FALSE;
+    }
+  data = dsk_malloc (size);
+  if (fread (data, 1, size, fp) != (size_t) size)
+    {
+      dsk_warning ("error reading %s", path);
+      dsk_free (data);
+      fclose (fp);
+      dsk_free (path);
+      return DSK_FALSE;
+    }
+  fclose (fp);
+  dsk_free (path);
+
+  dsk_free (asset->data);
+  dsk_free (asset->gzipped);
+  asset->data = data;
+  asset->length = size;
+  asset->gzipped = gzip_compress (size, data, &asset->gzipped_length);
+  if (asset->gzipped != NULL && asset->gzipped_length >= asset->length)
+    {
+      dsk_free (asset->gzipped);
+      asset->gzipped = NULL;
+    }
+  snprintf (asset->etag, sizeof (asset->etag), "\"%016llx\"",
+            (unsigned long long) fnv1a_64 (size, data));
+  return DSK_TRUE;
+}
+
+static dsk_boolean
+load_static_assets (void)
+{
+  dsk_boolean ok = DSK_TRUE;
+  unsigned i;
+  for (i = 0; i < DSK_N_ELEMENTS (static_assets); i++)
+    if (!load_static_asset (static_assets[i]))
+      ok = DSK_FALSE;
+  return ok;
+}
+
+static dsk_boolean
+handle_sighup (void *data)
+{
+  DSK_UNUSED (data);
+  if (load_static_assets ())
+    dsk_warning ("reloaded static assets from %s", html_dir);
+  return DSK_TRUE;
+}
+
+static void
+respond_static_asset (DskHttpServerRequest *request, StaticAsset *asset)
+{
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc headers[3];
+
+  if (asset->data == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_NOT_FOUND,
+                                             "asset not loaded");
+      return;
+    }
+
+  headers[0].key = "ETag";
+  headers[0].value = asset->etag;
+  headers[1].key = "Cache-Control";
+  headers[1].value = "public, no-cache";        /* always revalidate */
+  headers[2].key = "Vary";
+  headers[2].value = "Accept-Encoding";
+  header_options.n_unparsed_headers = DSK_N_ELEMENTS (headers);
+  header_options.unparsed_headers = headers;
+  options.header_options = &header_options;
+  options.content_type = asset->content_type;
+
+  if (etag_matches (request, asset->etag))
+    {
+      header_options.status_code = DSK_HTTP_STATUS_NOT_MODIFIED;
+      options.content_length = 0;
+      options.content_body = (const uint8_t *) "";
+    }
+  else if (asset->gzipped != NULL
+        && header_lists_token (request_header (request, "Accept-Encoding"), "gzip"))
+    {
+      header_options.content_encoding = "gzip";
+      options.content_length = asset->gzipped_length;
+      options.content_body = asset->gzipped;
+    }
+  else
+    {
+      options.content_length = asset->length;
+      options.content_body = asset->data;
+    }
+  dsk_http_server_request_respond (request, &options);
+}
+
+/* --- CGI handlers --- */
+static void
+handle_main_page (DskHttpServerRequest *request)
+{
+  respond_static_asset (request, &main_page_asset);
+}
+
+/* for long-poll requests that have been superseded or timed out */
+static void
+respond_no_content (DskHttpServerRequest *request)
+{
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  header_options.status_code = DSK_HTTP_STATUS_NO_CONTENT;
+  options.header_options = &header_options;
+  options.content_length = 0;
+  options.content_body = (const uint8_t *) "";
+  dsk_http_server_request_respond (request, &options);
+}
+
+/* Gzip 'in' into 'out' with the given deflate stream, creating it
+   if needed.  Each response is a separate gzip member: HTTP gives us no
+   connection-long stream for one frame to be compressed against
+   the last, but resetting the stream avoids reallocating it. */
+static dsk_boolean
+gzip_frame (z_stream **stream_inout, int *level_inout,
+            DskBuffer *in, DskBuffer *out)
+{
+  static uint8_t *scratch_in, *scratch_out;
+  static unsigned scratch_in_alloced, scratch_out_alloced;
+  z_stream *z = *stream_inout;
+  unsigned in_size = in->size, out_max;
+  int level = __atomic_load_n (&frame_compression_level, __ATOMIC_RELAXED);
+
+  if (z == NULL)
+    {
+      z = dsk_malloc0 (sizeof (z_stream));
+      if (deflateInit2 (z, level, Z_DEFLATED, 15 + 16, 8,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+          dsk_free (z);
+          return DSK_FALSE;
+        }
+      *stream_inout = z;
+      *level_inout = level;
+    }
+  else
+    {
+      deflateReset (z);
+      if (*level_inout != level)
+        {
+          deflateParams (z, level, Z_DEFAULT_STRATEGY);
+          *level_inout = level;
+        }
+    }
+
+  out_max = deflateBound (z, in_size);
+  if (scratch_in_alloced < in_size)
+    {
+      scratch_in_alloced = in_size * 2;
+      scratch_in = dsk_realloc (scratch_in, scratch_in_alloced);
+    }
+  if (scratch_out_alloced < out_max)
+    {
+      scratch_out_alloced = out_max * 2;
+      scratch_out = dsk_realloc (scratch_out, scratch_out_alloced);
+    }
+  dsk_buffer_read (in, in_size, scratch_in);
+  z->next_in = scratch_in;
+  z->avail_in = in_size;
+  z->next_out = scratch_out;
+  z->avail_out = out_max;
+  if (deflate (z, Z_FINISH) != Z_STREAM_END)
+    {
+      dsk_buffer_append (in, in_size, scratch_in);      /* put it back */
+      return DSK_FALSE;
+    }
+  dsk_buffer_append (out, out_max - z->avail_out, scratch_out);
+  return DSK_TRUE;
+}
+
+/* The network thread gzips every frame, for /update and /watch
+   alike, with this one stream, reset for each; NULL until needed. */
+static z_stream *frame_deflate;
+static int frame_deflate_level;
+
+/* Send user->frame, gzipping it if the client allows. */
+static void
+respond_user_update (DskHttpServerRequest *request, User *user)
+{
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  DskBuffer gzipped = DSK_BUFFER_STATIC_INIT;
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc vary = { "Vary", "Accept-Encoding" };
+
+  dsk_assert (user->frame != NULL);
+  dsk_json_value_to_buffer (user->frame, -1, &buffer);
+  dsk_json_value_free (user->frame);
+  user->frame = NULL;
+  user->last_frame = user->frame_number;
+  header_options.n_unparsed_headers = 1;
+  header_options.unparsed_headers = &vary;
+  options.header_options = &header_options;
+  options.content_type = "application/json";
+  options.source_buffer = &buffer;
+  if (buffer.size >= FRAME_COMPRESS_MIN_SIZE
+   && header_lists_token (request_header (request, "Accept-Encoding"), "gzip"))
+    {
+      if (gzip_frame (&frame_deflate, &frame_deflate_level, &buffer, &gzipped))
+        {
+          header_options.content_encoding = "gzip";
+          options.source_buffer = &gzipped;
+        }
+      else
+        dsk_warning ("error compressing frame for %s", user->name);
+    }
+  dsk_http_server_request_respond (request, &options);
+  dsk_buffer_clear (&buffer);
+  dsk_buffer_clear (&gzipped);
+}
+
+/* --- canvas sizes --- */
+/* w= and h= give the client's canvas size in pixels;
+   they are clamped to [MIN_CANVAS_SIZE, MAX_CANVAS_SIZE]
+   and either one may be omitted. */
+static void
+parse_canvas_size (DskHttpServerRequest *request,
+                   unsigned *width_inout,
+                   unsigned *height_inout)
+{
+  DskCgiVariable *w_var = dsk_http_server_request_lookup_cgi (request, "w");
+  DskCgiVariable *h_var = dsk_http_server_request_lookup_cgi (request, "h");
+  if (w_var != NULL)
+    {
+      long w = strtol (w_var->value, NULL, 10);
+      *width_inout = w < MIN_CANVAS_SIZE ? MIN_CANVAS_SIZE
+                   : w > MAX_CANVAS_SIZE ? MAX_CANVAS_SIZE
+                   : (unsigned) w;
+    }
+  if (h_var != NULL)
+    {
+      long h = strtol (h_var->value, NULL, 10);
+      *height_inout = h < MIN_CANVAS_SIZE ? MIN_CANVAS_SIZE
+                    : h > MAX_CANVAS_SIZE ? MAX_CANVAS_SIZE
+                    : (unsigned) h;
+    }
+}
+
+/* Whether a game may have a maze this size, in cells. */
+static dsk_boolean
+universe_size_ok (unsigned width, unsigned height)
+{
+  return width >= MIN_UNIVERSE_SIDE && height >= MIN_UNIVERSE_SIDE
+      && width <= MAX_UNIVERSE_TILES / CELL_SIZE
+      && height <= MAX_UNIVERSE_TILES / CELL_SIZE
+      && width * height <= MAX_UNIVERSE_CELLS;
+}
+
+/* The maze size for /newgame, in cells.  Big mazes are for events,
+   and are divided among the region threads. */
+static dsk_boolean
+parse_universe_size (DskCgiVariable *var,
+                     unsigned *width_inout,
+                     unsigned *height_inout)
+{
+  unsigned width, height;
+  if (var == NULL)
+    return DSK_TRUE;
+  if (sscanf (var->value, "%ux%u", &width, &height) != 2
+   || !universe_size_ok (width, height))
+    return DSK_FALSE;
+  *width_inout = width;
+  *height_inout = height;
+  return DSK_TRUE;
+}
+
+/* --- spectators --- */
+static unsigned
+round_watch_size (unsigned size)
+{
+  size = (size + WATCH_SIZE_STEP - 1) / WATCH_SIZE_STEP * WATCH_SIZE_STEP;
+  return DSK_MIN (size, MAX_CANVAS_SIZE);
+}
+
+/* The region a spectator with a width x height canvas shares,
+   or NULL if the game has as many as it may. */
+static Watch *
+find_or_create_watch (Game *game, int view_x, int view_y,
+                      unsigned width, unsigned height)
+{
+  Watch *watch;
+  width = round_watch_size (width);
+  height = round_watch_size (height);
+  for (watch = game->watches; watch; watch = watch->next_in_game)
+    if (watch->view_x == view_x && watch->view_y == view_y
+     && watch->width == width && watch->height == height)
+      return watch;
+  if (game->n_watches == MAX_WATCHES_PER_GAME)
+    return NULL;
+  game->n_watches++;
+  watch = dsk_malloc0 (sizeof (Watch));
+  watch->game = game;
+  watch->view_x = view_x;
+  watch->view_y = view_y;
+  watch->width = width;
+  watch->height = height;
+  watch->next_in_game = game->watches;
+  game->watches = watch;
+  return watch;
+}
+
+static void
+free_watch (Watch *watch)
+{
+  dsk_assert (watch->n_waiting == 0);
+  dsk_free (watch->frame);
+  dsk_free (watch->frame_gzipped);
+  dsk_free (watch->waiting);
+  dsk_free (watch);
+}
+
+/* Serialize and compress a newly rendered frame for the
+   region's spectators, unless it is older than the one we have. */
+static void
+watch_set_frame (Watch *watch, unsigned frame_number, DskJsonValue *value)
+{
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  DskBuffer gzipped = DSK_BUFFER_STATIC_INIT;
+  if (watch->has_frame && (int) (frame_number - watch->frame_number) <= 0)
+    {
+      dsk_json_value_free (value);
+      return;
+    }
+
+  dsk_json_value_to_buffer (value, -1, &buffer);
+  dsk_json_value_free (value);
+  dsk_free (watch->frame);
+  dsk_free (watch->frame_gzipped);
+  watch->frame_gzipped = NULL;
+  watch->frame_length = buffer.size;
+  watch->frame = (uint8_t *) dsk_buffer_empty_to_string (&buffer);
+  if (watch->frame_length >= FRAME_COMPRESS_MIN_SIZE)
+    {
+      /* gzip_frame drains its input */
+      dsk_buffer_append (&buffer, watch->frame_length, watch->frame);
+      if (gzip_frame (&frame_deflate, &frame_deflate_level, &buffer, &gzipped))
+        {
+          watch->frame_gzipped_length = gzipped.size;
+          watch->frame_gzipped = (uint8_t *) dsk_buffer_empty_to_string (&gzipped);
+        }
+      dsk_buffer_clear (&buffer);
+    }
+  watch->has_frame = DSK_TRUE;
+  watch->frame_number = frame_number;
+}
+
+/* dsk copies the body into each connection's output buffer,
+   so the shared frame need only live until the next one. */
+static void
+respond_watch_frame (DskHttpServerRequest *request, Watch *watch)
+{
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc vary = { "Vary", "Accept-Encoding" };
+  header_options.n_unparsed_headers = 1;
+  header_options.unparsed_headers = &vary;
+  options.header_options = &header_options;
+  options.content_type = "application/json";
+  if (watch->frame_gzipped != NULL
+   && header_lists_token (request_header (request, "Accept-Encoding"), "gzip"))
+    {
+      header_options.content_encoding = "gzip";
+      options.content_length = watch->frame_gzipped_length;
+      options.content_body = watch->frame_gzipped;
+    }
+  else
+    {
+      options.content_length = watch->frame_length;
+      options.content_body = watch->frame;
+    }
+  dsk_http_server_request_respond (request, &options);
+}
+
+/* /watch?game=NAME[&x=X&y=Y][&w=W&h=H][&frame=N]: long-poll like
+   /update, but for a W x H view centered near tile X,Y (default: the
+   middle of the universe).  Views are snapped to cell centers so that
+   nearby spectators with the same canvas size share frames.  'frame'
+   is the "frame" of the last info element received; the request waits
+   until there is a newer one. */
+static void
+handle_watch_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var = dsk_http_server_request_lookup_cgi (request, "game");
+  DskCgiVariable *x_var = dsk_http_server_request_lookup_cgi (request, "x");
+  DskCgiVariable *y_var = dsk_http_server_request_lookup_cgi (request, "y");
+  DskCgiVariable *frame_var = dsk_http_server_request_lookup_cgi (request, "frame");
+  char buf[512];
+  Game *game;
+  Watch *watch;
+  FrameSnapshot snapshot;
+  dsk_boolean first;
+  int x, y;
+  unsigned width = DEFAULT_CANVAS_WIDTH, height = DEFAULT_CANVAS_HEIGHT;
+  if (game_var == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "missing game=");
+      return;
+    }
+  game = find_game (game_var->value);
+  if (game == NULL)
+    {
+      snprintf (buf, sizeof (buf), "game %s not found", game_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  if (game->rules.fog)
+    {
+      /* spectators would see through the fog */
+      snprintf (buf, sizeof (buf), "game %s cannot be watched", game_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  x = x_var ? atoi (x_var->value) : (int) (game->universe_width * CELL_SIZE / 2);
+  y = y_var ? atoi (y_var->value) : (int) (game->universe_height * CELL_SIZE / 2);
+  x = mod (int_div (x, CELL_SIZE), game->universe_width) * CELL_SIZE + CELL_SIZE / 2;
+  y = mod (int_div (y, CELL_SIZE), game->universe_height) * CELL_SIZE + CELL_SIZE / 2;
+  parse_canvas_size (request, &width, &height);
+
+  /* a new region gets its first frame now;
+     after that, frames come from the render thread */
+  memset (&snapshot, 0, sizeof (snapshot));
+  pthread_mutex_lock (&world_lock);
+  watch = find_or_create_watch (game, x, y, width, height);
+  if (watch == NULL)
+    {
+      pthread_mutex_unlock (&world_lock);
+      snprintf (buf, sizeof (buf), "game %s has too many spectated regions", game->name);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_SERVICE_UNAVAILABLE, buf);
+      return;
+    }
+  watch->last_wanted = game->latest_frame;
+  first = !watch->has_frame;
+  if (first)
+    snapshot_take_view (&snapshot, game, watch->view_x, watch->view_y,
+                        watch->width, watch->height);
+  pthread_mutex_unlock (&world_lock);
+  if (first)
+    {
+      watch_set_frame (watch, snapshot.frame_number,
+                       render_view (&snapshot, watch->view_x, watch->view_y,
+                                    watch->width, watch->height, NULL));
+      snapshot_clear (&snapshot);
+    }
+
+  if (frame_var != NULL
+   && (unsigned) strtoul (frame_var->value, NULL, 10) == watch->frame_number)
+    {
+      /* wait for next frame; waiting requests keep it being rendered */
+      if (watch->n_waiting == watch->waiting_alloced)
+        {
+          watch->waiting_alloced = watch->waiting_alloced ? watch->waiting_alloced * 2 : 16;
+          watch->waiting = dsk_realloc (watch->waiting,
+                                        sizeof (DskHttpServerRequest *) * watch->waiting_alloced);
+        }
+      if (watch->n_waiting == 0)
+        watch->waiting_deadline = get_monotonic_usecs () + PENDING_TIMEOUT_USECS;
+      watch->waiting[watch->n_waiting] = request;
+      __atomic_store_n (&watch->n_waiting, watch->n_waiting + 1, __ATOMIC_RELAXED);
+    }
+  else
+    respond_watch_frame (request, watch);
+}
+
+/* --- the frame queue, network side --- */
+static void
+deliver_frame (FrameMessage *message)
+{
+  if (message->user != NULL && message->user->departed)
+    dsk_json_value_free (message->frame);
+  else if (message->user != NULL)
+    {
+      User *user = message->user;
+      if (user->frame != NULL)
+        dsk_json_value_free (user->frame);
+      user->frame = message->frame;
+      user->frame_number = message->frame_number;
+      if (user->pending_request != NULL)
+        {
+          DskHttpServerRequest *request = user->pending_request;
+          remove_pending_update (user);
+          respond_user_update (request, user);
+        }
+    }
+  else
+    {
+      Watch *watch = message->watch;
+      unsigned i;
+      watch_set_frame (watch, message->frame_number, message->frame);
+      for (i = 0; i < watch->n_waiting; i++)
+        respond_watch_frame (watch->waiting[i], watch);
+      __atomic_store_n (&watch->n_waiting, 0, __ATOMIC_RELAXED);
+
+      /* after this, the region may be freed */
+      __atomic_sub_fetch (&watch->frames_queued, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+flush_idle_callback (void *data)
+{
+  uint64_t now = get_monotonic_usecs ();
+  unsigned tail = frame_queue_tail;
+  unsigned head = __atomic_load_n (&frame_queue_head, __ATOMIC_SEQ_CST);
+  unsigned n = 0;
+  DSK_UNUSED (data);
+  while (tail != head)
+    {
+      FrameMessage *message = frame_queue + tail % FRAME_QUEUE_SIZE;
+      if (n >= FLUSH_BATCH
+       && now < message->rendered_usecs + FLUSH_LATENCY_BUDGET_USECS)
+        break;
+      deliver_frame (message);
+      tail++;
+      n++;
+      __atomic_store_n (&frame_queue_tail, tail, __ATOMIC_RELEASE);
+    }
+  if (tail == head)
+    {
+      /* anything queued after 'head' was read comes with a wakeup */
+      dsk_dispatch_remove_idle (flush_idle);
+      flush_idle = NULL;
+    }
+}
+
+static void
+handle_frame_queue_wakeup (DskFileDescriptor fd, unsigned events, void *data)
+{
+  char buf[64];
+  DSK_UNUSED (events); DSK_UNUSED (data);
+  while (read (fd, buf, sizeof (buf)) > 0)
+    ;
+  __atomic_store_n (&frame_queue_signalled, 0, __ATOMIC_SEQ_CST);
+  if (flush_idle == NULL)
+    flush_idle = dsk_main_add_idle (flush_idle_callback, NULL);
+}
+
+/* Answer requests that have waited too long with 204s, drop
+   spectated regions and players nobody has heard from in a while,
+   and free what has been let go of. */
+static void
+housekeeping_timer_callback (void *data)
+{
+  uint64_t now = get_monotonic_usecs ();
+  Game *game;
+  DSK_UNUSED (data);
+  for (game = all_games; game; game = game->next_game)
+    {
+      User *user, *next;
+      Watch *watch;
+      for (user = game->pending_users; user; user = next)
+        {
+          next = user->next_pending;
+          if (user->pending_deadline <= now)
+            {
+              DskHttpServerRequest *request = user->pending_request;
+              remove_pending_update (user);
+              respond_no_content (request);
+            }
+        }
+      for (watch = game->watches; watch; watch = watch->next_in_game)
+        if (watch->n_waiting > 0 && watch->waiting_deadline <= now)
+          {
+            unsigned i;
+            for (i = 0; i < watch->n_waiting; i++)
+              respond_no_content (watch->waiting[i]);
+            __atomic_store_n (&watch->n_waiting, 0, __ATOMIC_RELAXED);
+          }
+    }
+
+  pthread_mutex_lock (&world_lock);
+  for (game = all_games; game; game = game->next_game)
+    {
+      Watch **pwatch = &game->watches;
+      while (*pwatch != NULL)
+        {
+          Watch *watch = *pwatch;
+          if (watch->n_waiting == 0
+           && __atomic_load_n (&watch->frames_queued, __ATOMIC_ACQUIRE) == 0
+           && game->latest_frame - watch->last_wanted > WATCH_IDLE_FRAMES)
+            {
+              *pwatch = watch->next_in_game;
+              game->n_watches--;
+              free_watch (watch);
+              continue;
+            }
+          pwatch = &watch->next_in_game;
+        }
+    }
+  pthread_mutex_unlock (&world_lock);
+
+  remove_idle_users ();
+  for (game = all_games; game; game = game->next_game)
+    free_departed_users (game);
+  destroy_retired_games ();
+
+  dsk_main_add_timer_millis (HOUSEKEEPING_MILLIS, housekeeping_timer_callback, NULL);
+}
+
+/* --- the lobby ---
+   The /games document is kept serialized, as is each game's entry
+   in it; lobby_changed() must be called whenever a game or its
+   player list changes. */
+static unsigned lobby_version;
+static unsigned long lobby_epoch;       /* keeps ETags unique across restarts */
+static char *lobby_document;            /* the unfiltered list, or NULL */
+static unsigned lobby_document_length;
+
+static void
+lobby_changed (Game *game)
+{
+  if (game != NULL)
+    {
+      dsk_free (game->lobby_entry);
+      game->lobby_entry = NULL;
+    }
+  dsk_free (lobby_document);
+  lobby_document = NULL;
+  lobby_version++;
+}
+
+static const char *
+get_lobby_entry (Game *game)
+{
+  if (game->lobby_entry == NULL)
+    {
+      Object *object;
+      unsigned n_players = 0;
+      DskJsonValue **pat;
+      DskJsonMember members[2] = {
+        { "name", dsk_json_value_new_string (strlen (game->name), game->name) },
+        { "players", NULL },
+      };
+      DskJsonValue **players;
+      DskJsonValue *entry;
+      DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+      for (object = game->users; object != NULL; object = object->next_in_game)
+        n_players++;
+      players = dsk_malloc (sizeof (DskJsonValue *) * n_players);
+      pat = players;
+      for (object = game->users; object != NULL; object = object->next_in_game)
+        {
+          User *player = (User *)object;
+          *pat++ = dsk_json_value_new_string (strlen (player->name), player->name);
+        }
+      members[1].value = dsk_json_value_new_array (n_players, players);
+      dsk_free (players);
+      entry = dsk_json_value_new_object (DSK_N_ELEMENTS (members), members);
+      dsk_json_value_to_buffer (entry, -1, &buffer);
+      dsk_json_value_free (entry);
+      game->lobby_entry = dsk_buffer_empty_to_string (&buffer);
+    }
+  return game->lobby_entry;
+}
+
+/* Optional parameters: match= (substring of the game name),
+   offset= and limit= (applied after matching). */
+static void
+handle_get_games_list (DskHttpServerRequest *request)
+{
+  DskCgiVariable *match_var = dsk_http_server_request_lookup_cgi (request, "match");
+  DskCgiVariable *offset_var = dsk_http_server_request_lookup_cgi (request, "offset");
+  DskCgiVariable *limit_var = dsk_http_server_request_lookup_cgi (request, "limit");
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc headers[2];
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  dsk_boolean filtered = match_var != NULL || offset_var != NULL || limit_var != NULL;
+  char etag[48];
+
+  /* the ETag only needs to be unique per URL, so it
+     does not have to depend on the parameters */
+  if (lobby_epoch == 0)
+    lobby_epoch = time (NULL);
+  snprintf (etag, sizeof (etag), "\"lobby-%lx-%x\"", lobby_epoch, lobby_version);
+  headers[0].key = "ETag";
+  headers[0].value = etag;
+  headers[1].key = "Cache-Control";
+  headers[1].value = "no-cache";
+  header_options.n_unparsed_headers = DSK_N_ELEMENTS (headers);
+  header_options.unparsed_headers = headers;
+  options.header_options = &header_options;
+  options.content_type = "application/json";
+
+  if (etag_matches (request, etag))
+    {
+      header_options.status_code = DSK_HTTP_STATUS_NOT_MODIFIED;
+      options.content_length = 0;
+      options.content_body = (const uint8_t *) "";
+      dsk_http_server_request_respond (request, &options);
+      return;
+    }
+
+  if (filtered || lobby_document == NULL)
+    {
+      unsigned offset = offset_var ? strtoul (offset_var->value, NULL, 10) : 0;
+      unsigned limit = limit_var ? strtoul (limit_var->value, NULL, 10) : (unsigned) -1;
+      unsigned n_matched = 0, n_listed = 0;
+      Game *game;
+      dsk_buffer_append_byte (&buffer, '[');
+      for (game = all_games; game != NULL && n_listed < limit; game = game->next_game)
+        {
+          const char *entry;
+          if (match_var != NULL && strstr (game->name, match_var->value) == NULL)
+            continue;
+          if (n_matched++ < offset)
+            continue;
+          entry = get_lobby_entry (game);
+          if (n_listed++ > 0)
+            dsk_buffer_append_byte (&buffer, ',');
+          dsk_buffer_append_string (&buffer, entry);
+        }
+      dsk_buffer_append_byte (&buffer, ']');
+      if (!filtered)
+        {
+          lobby_document_length = buffer.size;
+          lobby_document = dsk_buffer_empty_to_string (&buffer);
+        }
+    }
+  if (filtered)
+    options.source_buffer = &buffer;
+  else
+    {
+      options.content_length = lobby_document_length;
+      options.content_body = (const uint8_t *) lobby_document;
+    }
+  dsk_http_server_request_respond (request, &options);
+  dsk_buffer_clear (&buffer);
+}
+
+/* --- migration --- */
+/* A game moves to another server (see router.c) by being frozen and
+   written out by /export here, then read in by /import there.
+   The state is text: numbers separated by spaces, and names
+   as LENGTH:NAME, in this order:
+     snipez-game VERSION
+     NAME WIDTH HEIGHT WRAP BOUNCE KILL_PLAYERS KILL_GENERATORS FOG
+     LATEST_UPDATE LATEST_FRAME TARGET_PERIOD_USECS
+     H_WALLS V_WALLS                    -- a 0 or 1 for each cell
+     N_GENERATORS, then CELL_INDEX PROB for each
+     N_ENEMIES, then X Y VELOCITY for each; likewise bullets
+     N_USERS, then NAME X Y WIDTH HEIGHT MOVE_X MOVE_Y BULLET_X BULLET_Y
+                   BULLET_BLOCK DEAD_COUNT LAST_SEQ for each
+   Spectated regions are not kept; spectators just ask again. */
+#define GAME_STATE_VERSION      1
+
+static void
+append_state_name (DskBuffer *out, const char *name)
+{
+  dsk_buffer_printf (out, "%u:%s", (unsigned) strlen (name), name);
+}
+
+/* Called with world_lock held. */
+static void
+serialize_game (Game *game, DskBuffer *out)
+{
+  unsigned usize = game->universe_width * game->universe_height;
+  Generator *generator;
+  Object *object;
+  unsigned i, k, n;
+
+  dsk_buffer_printf (out, "snipez-game %u\n", GAME_STATE_VERSION);
+  append_state_name (out, game->name);
+  dsk_buffer_printf (out, " %u %u %u %u %u %u %u\n",
+                     game->universe_width, game->universe_height,
+                     game->rules.wrap, game->rules.diag_bullets_bounce,
+                     game->rules.bullet_kills_player,
+                     game->rules.bullet_kills_generator, game->rules.fog);
+  dsk_buffer_printf (out, "%u %u %u\n", game->latest_update,
+                     game->latest_frame, game->target_period_usecs);
+  for (i = 0; i < usize; i++)
+    dsk_buffer_append_byte (out, game->h_walls[i] ? '1' : '0');
+  dsk_buffer_append_byte (out, ' ');
+  for (i = 0; i < usize; i++)
+    dsk_buffer_append_byte (out, game->v_walls[i] ? '1' : '0');
+
+  n = 0;
+  for (generator = game->generators; generator; generator = generator->next_in_game)
+    n++;
+  dsk_buffer_printf (out, "\n%u\n", n);
+  for (generator = game->generators; generator; generator = generator->next_in_game)
+    dsk_buffer_printf (out, "%u %.17g\n",
+                       generator->x / CELL_SIZE
+                       + generator->y / CELL_SIZE * game->universe_width,
+                       generator->generator_prob);
+
+  for (k = 0; k < N_ENTITY_KINDS; k++)
+    {
+      EntityPool *pool = game->pools + k;
+      dsk_buffer_printf (out, "%u\n", pool->n_entities - pool->n_dead);
+      for (i = 0; i < pool->n_entities; i++)
+        if (ENTITY_IS_ALIVE (pool, i))
+          dsk_buffer_printf (out, "%u %u %u\n",
+                             pool->x[i], pool->y[i], pool->velocity[i]);
+    }
+
+  n = 0;
+  for (object = game->users; object; object = object->next_in_game)
+    n++;
+  dsk_buffer_printf (out, "%u\n", n);
+  for (object = game->users; object; object = object->next_in_game)
+    {
+      User *user = (User *) object;
+      append_state_name (out, user->name);
+      dsk_buffer_printf (out, " %u %u %u %u %d %d %d %d %u %u %u\n",
+                         object->x, object->y, user->width, user->height,
+                         user->move_x, user->move_y,
+                         user->bullet_x, user->bullet_y,
+                         user->bullet_block, user->dead_count, user->last_seq);
+    }
+}
+
+typedef struct _StateReader StateReader;
+struct _StateReader
+{
+  const char *at, *end;
+  dsk_boolean ok;                       /* cleared by the first error */
+};
+
+static unsigned
+read_state_uint (StateReader *reader, unsigned max)
+{
+  char *end;
+  unsigned long v;
+  if (!reader->ok)
+    return 0;
+  v = strtoul (reader->at, &end, 10);
+  if (end == reader->at || end > reader->end || v > max)
+    {
+      reader->ok = DSK_FALSE;
+      return 0;
+    }
+  reader->at = end;
+  return v;
+}
+
+static int
+read_state_int (StateReader *reader, int min, int max)
+{
+  char *end;
+  long v;
+  if (!reader->ok)
+    return 0;
+  v = strtol (reader->at, &end, 10);
+  if (end == reader->at || end > reader->end || v < min || v > max)
+    {
+      reader->ok = DSK_FALSE;
+      return 0;
+    }
+  reader->at = end;
+  return v;
+}
+
+static double
+read_state_double (StateReader *reader)
+{
+  char *end;
+  double v;
+  if (!reader->ok)
+    return 0;
+  v = strtod (reader->at, &end);
+  if (end == reader->at || end > reader->end)
+    {
+      reader->ok = DSK_FALSE;
+      return 0;
+    }
+  reader->at = end;
+  return v;
+}
+
+/* a LENGTH:NAME, as a new string, or NULL */
+static char *
+read_state_name (StateReader *reader)
+{
+  unsigned len = read_state_uint (reader, 4096);
+  char *name;
+  if (!reader->ok || *reader->at != ':' || (unsigned) (reader->end - reader->at) <= len)
+    {
+      reader->ok = DSK_FALSE;
+      return NULL;
+    }
+  name = dsk_malloc (len + 1);
+  memcpy (name, reader->at + 1, len);
+  name[len] = 0;
+  reader->at += len + 1;
+  return name;
+}
+
+static void
+read_state_bits (StateReader *reader, unsigned n, uint8_t *out)
+{
+  unsigned i;
+  while (reader->at < reader->end && (*reader->at == ' ' || *reader->at == '\n'))
+    reader->at++;
+  if (!reader->ok || (unsigned) (reader->end - reader->at) < n)
+    {
+      reader->ok = DSK_FALSE;
+      return;
+    }
+  for (i = 0; i < n; i++)
+    {
+      if (reader->at[i] != '0' && reader->at[i] != '1')
+        reader->ok = DSK_FALSE;
+      out[i] = reader->at[i] == '1';
+    }
+  reader->at += n;
+}
+
+static void destroy_game (Game *game);
+
+/* Make the game written by serialize_game(), or return NULL if
+   the state is malformed.  The game is not started. */
+static Game *
+unserialize_game (const char *state, unsigned length)
+{
+  StateReader reader = { state, state + length, DSK_TRUE };
+  GameRules rules = GAME_RULES_DEFAULT;
+  unsigned width, height, usize, tiles_x, tiles_y;
+  unsigned i, k, n;
+  char *name;
+  Game *game;
+
+  if (length < 12 || memcmp (state, "snipez-game ", 12) != 0)
+    return NULL;
+  reader.at += 12;
+  if (read_state_uint (&reader, GAME_STATE_VERSION) != GAME_STATE_VERSION)
+    return NULL;
+  name = read_state_name (&reader);
+  width = read_state_uint (&reader, MAX_UNIVERSE_TILES / CELL_SIZE);
+  height = read_state_uint (&reader, MAX_UNIVERSE_TILES / CELL_SIZE);
+  rules.wrap = read_state_uint (&reader, 1);
+  rules.diag_bullets_bounce = read_state_uint (&reader, 1);
+  rules.bullet_kills_player = read_state_uint (&reader, 1);
+  rules.bullet_kills_generator = read_state_uint (&reader, 1);
+  rules.fog = read_state_uint (&reader, 1);
+  if (!reader.ok || !universe_size_ok (width, height))
+    {
+      dsk_free (name);
+      return NULL;
+    }
+  game = alloc_game (name, width, height, &rules);
+  dsk_free (name);
+  usize = width * height;
+  tiles_x = width * CELL_SIZE;
+  tiles_y = height * CELL_SIZE;
+
+  game->latest_update = read_state_uint (&reader, UINT_MAX);
+  game->latest_frame = read_state_uint (&reader, UINT_MAX);
+  game->target_period_usecs = read_state_uint (&reader, 10000000);
+  if (game->target_period_usecs == 0)
+    reader.ok = DSK_FALSE;
+  game->period_usecs = game->target_period_usecs;
+  read_state_bits (&reader, usize, game->h_walls);
+  read_state_bits (&reader, usize, game->v_walls);
+  if (reader.ok)
+    compute_wall_bits (game);
+
+  n = read_state_uint (&reader, usize);
+  for (i = 0; i < n && reader.ok; i++)
+    {
+      unsigned index = read_state_uint (&reader, usize - 1);
+      double prob = read_state_double (&reader);
+      if (reader.ok && game->cells[index].generator == NULL)
+        create_generator (game, index, prob);
+    }
+
+  for (k = 0; k < N_ENTITY_KINDS && reader.ok; k++)
+    {
+      n = read_state_uint (&reader, UINT_MAX);
+      for (i = 0; i < n && reader.ok; i++)
+        {
+          unsigned x = read_state_uint (&reader, tiles_x - 1);
+          unsigned y = read_state_uint (&reader, tiles_y - 1);
+          unsigned velocity = read_state_uint (&reader, 15);
+          if (reader.ok)
+            add_entity (game, k, x, y, velocity);
+        }
+    }
+
+  n = read_state_uint (&reader, UINT_MAX);
+  for (i = 0; i < n && reader.ok; i++)
+    {
+      User *user;
+      char *user_name = read_state_name (&reader);
+      if (user_name == NULL)
+        break;
+      user = dsk_malloc0 (sizeof (User));
+      user->name = user_name;
+      user->base.game = game;
+      user->base.x = read_state_uint (&reader, tiles_x - 1);
+      user->base.y = read_state_uint (&reader, tiles_y - 1);
+      user->width = read_state_uint (&reader, MAX_CANVAS_SIZE);
+      user->height = read_state_uint (&reader, MAX_CANVAS_SIZE);
+      if (user->width < MIN_CANVAS_SIZE || user->height < MIN_CANVAS_SIZE)
+        reader.ok = DSK_FALSE;          /* as parse_canvas_size() clamps */
+      user->move_x = read_state_int (&reader, -1, 1);
+      user->move_y = read_state_int (&reader, -1, 1);
+      user->bullet_x = read_state_int (&reader, -1, 1);
+      user->bullet_y = read_state_int (&reader, -1, 1);
+      user->bullet_block = read_state_uint (&reader, UINT_MAX);
+      user->dead_count = read_state_uint (&reader, UINT_MAX);
+      user->last_seq = read_state_uint (&reader, UINT_MAX);
+      user->canvas = user->width << 16 | user->height;
+      user->input = pack_user_input (user->move_x, user->move_y,
+                                     user->bullet_x, user->bullet_y);
+      user->last_polled = game->latest_frame;
+      user->last_frame = (unsigned)(-1);
+      user->last_seen_time = dsk_dispatch_default ()->last_dispatch_secs;
+      add_object_to_game_list (&user->base);
+      if (user->dead_count == 0)
+        add_object_to_cell_list (&user->base);
+    }
+
+  if (!reader.ok)
+    {
+      destroy_game (game);
+      return NULL;
+    }
+  return game;
+}
+
+static void
+free_user (User *user)
+{
+  dsk_assert (user->pending_request == NULL);
+  if (user->frame != NULL)
+    dsk_json_value_free (user->frame);
+  dsk_free (user->name);
+  dsk_free (user);
+}
+
+/* Free a game nothing refers to any more: one that was never
+   started, or a retired one that retire_game() has let go of. */
+static void
+destroy_game (Game *game)
+{
+  Object *object;
+  User *user;
+  Generator *generator;
+  Watch *watch;
+  unsigned i, k;
+
+  while ((object = game->users) != NULL)
+    {
+      game->users = object->next_in_game;
+      free_user ((User *) object);
+    }
+  while ((user = game->departed_users) != NULL)
+    {
+      game->departed_users = (User *) user->base.next_in_game;
+      free_user (user);
+    }
+  while ((watch = game->watches) != NULL)
+    {
+      game->watches = watch->next_in_game;
+      free_watch (watch);
+    }
+  while ((generator = game->generators) != NULL)
+    {
+      game->generators = generator->next_in_game;
+      dsk_free (generator);
+    }
+  for (k = 0; k < N_ENTITY_KINDS; k++)
+    {
+      EntityPool *pool = game->pools + k;
+      dsk_free (pool->x);
+      dsk_free (pool->y);
+      dsk_free (pool->velocity);
+      dsk_free (pool->generation);
+      dsk_free (pool->prev_in_cell);
+      dsk_free (pool->next_in_cell);
+    }
+  for (i = 0; i < 2; i++)
+    snapshot_clear (game->snapshots + i);
+  dsk_free (game->flow_scratch);
+  for (i = 0; i < game->n_regions; i++)
+    dsk_free (game->regions[i].enemies);
+  dsk_free (game->proposed_x);
+  dsk_free (game->proposed_y);
+  dsk_free (game->random_words);
+  dsk_free (game->move_occupancy);
+  dsk_free (game->lobby_entry);
+  arena_free (game->arena);             /* walls, cells, per-tile arrays, regions */
+  dsk_free (game->name);
+  dsk_free (game);
+}
+
+/* Take a game out of play: it is frozen, so the simulation stops
+   ticking it, and it is no longer found by name.  Requests waiting
+   on it get no content; their clients will ask again, and the router
+   sends them wherever the game has gone.  It is freed by
+   housekeeping, once the simulation has stopped it, the render thread
+   is done with its snapshots, and the network thread has taken
+   every frame that may have been queued for it. */
+static void
+retire_game (Game *game)
+{
+  Game **pgame;
+  Watch *watch;
+
+  pthread_mutex_lock (&world_lock);
+  game->frozen = DSK_TRUE;
+  for (pgame = &all_games; *pgame != game; pgame = &(*pgame)->next_game)
+    ;
+  *pgame = game->next_game;
+  pthread_mutex_unlock (&world_lock);
+  game->retire_queue_marked = DSK_FALSE;
+  game->next_retired = retired_games;
+  retired_games = game;
+  lobby_changed (NULL);
+
+  while (game->pending_users != NULL)
+    {
+      DskHttpServerRequest *request = game->pending_users->pending_request;
+      remove_pending_update (game->pending_users);
+      respond_no_content (request);
+    }
+  for (watch = game->watches; watch; watch = watch->next_in_game)
+    {
+      unsigned i;
+      for (i = 0; i < watch->n_waiting; i++)
+        respond_no_content (watch->waiting[i]);
+      __atomic_store_n (&watch->n_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* Free the retired games that nothing refers to any more. */
+static void
+destroy_retired_games (void)
+{
+  Game **pgame = &retired_games;
+  while (*pgame != NULL)
+    {
+      Game *game = *pgame;
+      dsk_boolean stopped;
+      pthread_mutex_lock (&world_lock);
+      stopped = game->stopped;
+      pthread_mutex_unlock (&world_lock);
+      if (!stopped
+       || __atomic_load_n (&game->snapshots[0].busy, __ATOMIC_ACQUIRE)
+       || __atomic_load_n (&game->snapshots[1].busy, __ATOMIC_ACQUIRE))
+        {
+          pgame = &game->next_retired;
+          continue;
+        }
+
+      /* frames already rendered may still be in the queue:
+         wait until the network thread is past them */
+      if (!game->retire_queue_marked)
+        {
+          game->retire_queue_head = __atomic_load_n (&frame_queue_head, __ATOMIC_ACQUIRE);
+          game->retire_queue_marked = DSK_TRUE;
+          pgame = &game->next_retired;
+          continue;
+        }
+      if ((int) (frame_queue_tail - game->retire_queue_head) < 0)
+        {
+          pgame = &game->next_retired;
+          continue;
+        }
+      *pgame = game->next_retired;
+      destroy_game (game);
+    }
+}
+
+static void
+respond_text (DskHttpServerRequest *request, DskBuffer *buffer, const char *content_type)
+{
+  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
+  options.content_type = content_type;
+  options.source_buffer = buffer;
+  dsk_http_server_request_respond (request, &options);
+  dsk_buffer_clear (buffer);
+}
+
+/* --- leaving ---
+   Players leave by /leave, or by asking for nothing for --idle-timeout
+   seconds.  A game is retired when its last player leaves, or by
+   /destroy, and freed once nothing refers to it. */
+
+/* Take a user out of their game.  The render thread may still be
+   drawing it from a snapshot taken before, and frames for it may be
+   in the queue, so it waits in departed_users until
+   free_departed_users() finds it safe to free. */
+static void
+remove_user (User *user)
+{
+  Game *game = user->base.game;
+  if (user->pending_request != NULL)
+    {
+      DskHttpServerRequest *request = user->pending_request;
+      remove_pending_update (user);
+      respond_no_content (request);
+    }
+  pthread_mutex_lock (&world_lock);
+  if (user->dead_count == 0)
+    remove_object_from_cell_list (&user->base);
+  remove_object_from_game_list (&user->base);
+  if (user->in_flow_field)
+    game->flow_stale = DSK_TRUE;
+  pthread_mutex_unlock (&world_lock);
+
+  user->departed = DSK_TRUE;
+  user->departed_queue_marked = DSK_FALSE;
+  user->base.next_in_game = (Object *) game->departed_users;
+  game->departed_users = user;
+  lobby_changed (game);
+  if (game->users == NULL)
+    retire_game (game);
+}
+
+/* Free the users who have left 'game' that nothing refers to any more:
+   once neither snapshot is with the render thread, none taken before
+   they left can be, and once the network thread is past the frames
+   queued by then, none can be in the queue. */
+static void
+free_departed_users (Game *game)
+{
+  User **puser = &game->departed_users;
+  dsk_boolean rendering;
+  if (*puser == NULL)
+    return;
+  rendering = __atomic_load_n (&game->snapshots[0].busy, __ATOMIC_ACQUIRE)
+           || __atomic_load_n (&game->snapshots[1].busy, __ATOMIC_ACQUIRE);
+  while (*puser != NULL)
+    {
+      User *user = *puser;
+      if (!user->departed_queue_marked)
+        {
+          if (!rendering)
+            {
+              user->departed_queue_head = __atomic_load_n (&frame_queue_head, __ATOMIC_ACQUIRE);
+              user->departed_queue_marked = DSK_TRUE;
+            }
+        }
+      else if ((int) (frame_queue_tail - user->departed_queue_head) >= 0)
+        {
+          *puser = (User *) user->base.next_in_game;
+          free_user (user);
+          continue;
+        }
+      puser = (User **) &user->base.next_in_game;
+    }
+}
+
+/* Remove the users who have not asked for a frame in a while. */
+static void
+remove_idle_users (void)
+{
+  unsigned now = dsk_dispatch_default ()->last_dispatch_secs;
+  Game *game, *next_game;
+  if (idle_timeout_secs == 0)
+    return;
+  for (game = all_games; game; game = next_game)
+    {
+      Object *object, *next;
+      next_game = game->next_game;      /* the game may be retired */
+      for (object = game->users; object; object = next)
+        {
+          User *user = (User *) object;
+          next = object->next_in_game;
+          if (now - user->last_seen_time > idle_timeout_secs)
+            remove_user (user);
+        }
+    }
+}
+
+static void
+handle_leave_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *user_var = dsk_http_server_request_lookup_cgi (request, "user");
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  User *user;
+  char buf[512];
+  if (user_var == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST,
+                                             "missing user=");
+      return;
+    }
+  user = find_user (user_var->value);
+  if (user == NULL)
+    {
+      snprintf (buf, sizeof (buf), "user %s not found", user_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  remove_user (user);
+  dsk_buffer_append_string (&buffer, "left\n");
+  respond_text (request, &buffer, "text/plain");
+}
+
+/* Requests that can take a game away must carry this, as given
+   to --admin-token, in an X-Admin-Token header; the router is given
+   the same one.  Without --admin-token, they are all refused. */
+static const char *admin_token;
+
+/* Compares in a time that depends on their length, but
+   not on where they differ, so as not to give the token away. */
+static dsk_boolean
+tokens_equal (const char *a, const char *b)
+{
+  size_t length = strlen (b);
+  unsigned diff = 0;
+  size_t i;
+  if (strlen (a) != length)
+    return DSK_FALSE;
+  for (i = 0; i < length; i++)
+    diff |= (unsigned char) a[i] ^ (unsigned char) b[i];
+  return diff == 0;
+}
+
+/* Unless 'request' has the admin token, refuse it
+   and return FALSE. */
+static dsk_boolean
+check_admin_token (DskHttpServerRequest *request)
+{
+  const char *token = request_header (request, "X-Admin-Token");
+  if (admin_token == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_FORBIDDEN,
+                                             "no --admin-token was given");
+      return DSK_FALSE;
+    }
+  if (token == NULL || !tokens_equal (token, admin_token))
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_FORBIDDEN,
+                                             "bad X-Admin-Token");
+      return DSK_FALSE;
+    }
+  return DSK_TRUE;
+}
+
+/* An administrator's end to a game; its players' next
+   requests find them gone. */
+static void
+handle_destroy_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var = dsk_http_server_request_lookup_cgi (request, "game");
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  Game *game;
+  char buf[512];
+  if (!check_admin_token (request))
+    return;
+  if (game_var == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST,
+                                             "missing game=");
+      return;
+    }
+  game = find_game (game_var->value);
+  if (game == NULL)
+    {
+      snprintf (buf, sizeof (buf), "game %s not found", game_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  retire_game (game);
+  dsk_buffer_append_string (&buffer, "destroyed\n");
+  respond_text (request, &buffer, "text/plain");
+}
+
+/* For the router: freeze a game, and answer with its state.
+   The game is gone from here, whatever happens to the state. */
+static void
+handle_export_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *game_var = dsk_http_server_request_lookup_cgi (request, "game");
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  char buf[512];
+  Game *game;
+  if (!check_admin_token (request))
+    return;
+  if (game_var == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "missing game=");
+      return;
+    }
+  game = find_game (game_var->value);
+  if (game == NULL)
+    {
+      snprintf (buf, sizeof (buf), "game %s not found", game_var->value);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
+      return;
+    }
+  pthread_mutex_lock (&world_lock);
+  serialize_game (game, &buffer);
+  pthread_mutex_unlock (&world_lock);
+  retire_game (game);
+  respond_text (request, &buffer, "text/plain");
+}
+
+/* For the router: start a game from a state= made by /export,
+   and answer with the names of its players. */
+static void
+handle_import_game (DskHttpServerRequest *request)
+{
+  DskCgiVariable *state_var = dsk_http_server_request_lookup_cgi (request, "state");
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  char buf[512];
+  Object *object;
+  Game *game;
+  if (!check_admin_token (request))
+    return;
+  if (state_var == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "missing state=");
+      return;
+    }
+  game = unserialize_game (state_var->value, state_var->value_length);
+  if (game == NULL)
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "bad game state");
+      return;
+    }
+  buf[0] = 0;
+  if (find_game (game->name) != NULL)
+    snprintf (buf, sizeof (buf), "game %s already exists", game->name);
+  for (object = game->users; object != NULL && buf[0] == 0; object = object->next_in_game)
+    {
+      User *user = find_user (((User *) object)->name);
+      if (user != NULL)
+        snprintf (buf, sizeof (buf), "user %s already found in %s", user->name, user->base.game->name);
+    }
+  if (buf[0] != 0)
+    {
+      destroy_game (game);
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_CONFLICT, buf);
+      return;
+    }
+
+  dsk_buffer_append_byte (&buffer, '[');
+  for (object = game->users; object != NULL; object = object->next_in_game)
     {
-      Object *object;
-      for (object = game->objects[OBJECT_TYPE_USER]; object != NULL; object = object->next_in_game)
-        if (strcmp (((User*)object)->name, name) == 0)
-          return (User*) object;
+      DskJsonValue *name = dsk_json_value_new_string (strlen (((User *) object)->name),
+                                                      ((User *) object)->name);
+      if (object != game->users)
+        dsk_buffer_append_byte (&buffer, ',');
+      dsk_json_value_to_buffer (name, -1, &buffer);
+      dsk_json_value_free (name);
     }
-  return NULL;
+  dsk_buffer_append_byte (&buffer, ']');
+  pthread_mutex_lock (&world_lock);
+  start_game (game);
+  pthread_mutex_unlock (&world_lock);
+  respond_text (request, &buffer, "application/json");
 }
 
-/* --- CGI handlers --- */
-static void
-handle_main_page (DskHttpServerRequest *request)
+/* About how much memory a game holds: its arena, and what it has
+   allocated as it grew, less the allocator's overhead and frames on
+   their way out.  Called with world_lock held. */
+static size_t
+game_memory_usage (Game *game)
 {
-  DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
-  options.source_filename = "../html/snipez.html";
-  options.content_type = "text/html/UTF-8";
-  dsk_http_server_request_respond (request, &options);
+  size_t rv = sizeof (Game) + strlen (game->name) + 1 + arena_size (game->arena);
+  Object *object;
+  Generator *generator;
+  Watch *watch;
+  unsigned i;
+  for (i = 0; i < N_ENTITY_KINDS; i++)
+    rv += game->pools[i].n_alloced
+        * (sizeof (uint16_t) * 3 + 1 + sizeof (uint32_t) * 2);
+  for (i = 0; i < game->n_regions; i++)
+    rv += sizeof (uint32_t) * game->regions[i].enemies_alloced;
+  rv += game->n_move_scratch * (sizeof (int16_t) * 2 + sizeof (uint32_t) + 1);
+  rv += sizeof (unsigned) * game->flow_scratch_alloced;
+  for (i = 0; i < 2; i++)
+    {
+      FrameSnapshot *snapshot = game->snapshots + i;
+      if (snapshot->cell_start != NULL)
+        rv += sizeof (uint32_t) * (game->universe_width * game->universe_height + 1);
+      rv += sizeof (SnapshotThing) * snapshot->things_alloced
+          + sizeof (RenderTarget) * snapshot->targets_alloced;
+    }
+  for (generator = game->generators; generator; generator = generator->next_in_game)
+    rv += sizeof (Generator);
+  for (object = game->users; object; object = object->next_in_game)
+    rv += sizeof (User) + strlen (((User *) object)->name) + 1;
+  for (watch = game->watches; watch; watch = watch->next_in_game)
+    rv += sizeof (Watch) + watch->frame_length + watch->frame_gzipped_length
+        + sizeof (DskHttpServerRequest *) * watch->waiting_alloced;
+  return rv;
 }
 
+/* For the router: how many games and players we have, how
+   loaded each thread is, where 1 is LOAD_TARGET, and which game
+   loads us most, and by how much, should it want to move one.
+   game=NAME adds that game's memory, as game_memory. */
 static void
-respond_take_json (DskHttpServerRequest *request,
-                   DskJsonValue         *value)
+handle_get_stats (DskHttpServerRequest *request)
 {
-  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
   DskHttpServerResponseOptions options = DSK_HTTP_SERVER_RESPONSE_OPTIONS_DEFAULT;
-  dsk_json_value_to_buffer (value, -1, &buffer);
-  options.source_buffer = &buffer;
-  options.content_type = "application/json";
-  dsk_http_server_request_respond (request, &options);
-
-#if 0
-  dsk_json_value_to_buffer (value, 0, &buffer);
-  while (buffer.size)
-    dsk_buffer_writev (&buffer, 1);
-#endif
-  dsk_json_value_free (value);
-}
-
-static void
-handle_get_games_list (DskHttpServerRequest *request)
-{
-  unsigned n_games = 0;
-  Game *game;
-  DskJsonValue **game_info, **at;
+  DskHttpResponseOptions header_options = DSK_HTTP_RESPONSE_OPTIONS_DEFAULT;
+  DskHttpHeaderMisc header = { "Cache-Control", "no-cache" };
+  DskCgiVariable *game_var = dsk_http_server_request_lookup_cgi (request, "game");
+  DskJsonMember members[8];
+  unsigned n_members = 7;
+  DskJsonValue *stats;
+  DskBuffer buffer = DSK_BUFFER_STATIC_INIT;
+  unsigned n_games = 0, n_users = 0;
+  Game *game, *busiest = NULL;
+  double busiest_load = 0;
+  size_t memory = 0, game_memory = 0;
+  dsk_boolean game_found = DSK_FALSE;
+  pthread_mutex_lock (&world_lock);
   for (game = all_games; game; game = game->next_game)
-    n_games++;
-  game_info = dsk_malloc (sizeof (DskJsonValue *) * n_games);
-
-  at = game_info;
-  for (game = all_games; game; game = game->next_game, at++)
     {
+      size_t usage = game_memory_usage (game);
       Object *object;
-      unsigned n_players = 0;
-      DskJsonValue **pat;
-      DskJsonMember members[2] = {
-        { "name", dsk_json_value_new_string (strlen (game->name), game->name) },
-        { "players", NULL },
-      };
-      DskJsonValue **players;
-      for (object = game->objects[OBJECT_TYPE_USER]; object != NULL; object = object->next_in_game)
-        n_players++;
-      players = dsk_malloc (sizeof (DskJsonValue *) * n_players);
-      pat = players;
-      for (object = game->objects[OBJECT_TYPE_USER]; object != NULL; object = object->next_in_game)
+      double sim_load = (game->sim_cost_usecs
+                       + game->snapshot_cost_usecs / game->frame_interval)
+                      / game->target_period_usecs / LOAD_TARGET;
+      double render_load = game->frame_cost_usecs / game->frame_interval
+                         / game->target_period_usecs / LOAD_TARGET;
+      double load = DSK_MAX (sim_load, render_load);
+      if (busiest == NULL || load > busiest_load)
         {
-          User *player = (User *)object;
-          *pat++ = dsk_json_value_new_string (strlen (player->name), player->name);
+          busiest = game;
+          busiest_load = load;
         }
-      members[1].value = dsk_json_value_new_array (n_players, players);
-      dsk_free (players);
-      *at++ = dsk_json_value_new_object (DSK_N_ELEMENTS (members), members);
+      n_games++;
+      for (object = game->users; object != NULL; object = object->next_in_game)
+        n_users++;
+      memory += usage;
+      if (game_var != NULL && strcmp (game->name, game_var->value) == 0)
+        {
+          game_memory = usage;
+          game_found = DSK_TRUE;
+        }
+    }
+  pthread_mutex_unlock (&world_lock);
+  members[0].name = "games";
+  members[0].value = dsk_json_value_new_number (n_games);
+  members[1].name = "users";
+  members[1].value = dsk_json_value_new_number (n_users);
+  members[2].name = "sim_load";
+  members[2].value = dsk_json_value_new_number (__atomic_load_n (&sim_load_permille, __ATOMIC_RELAXED) / 1000.0);
+  members[3].name = "render_load";
+  members[3].value = dsk_json_value_new_number (__atomic_load_n (&render_load_permille, __ATOMIC_RELAXED) / 1000.0);
+  members[4].name = "busiest_game";
+  members[4].value = busiest ? dsk_json_value_new_string (strlen (busiest->name), busiest->name)
+                             : dsk_json_value_new_null ();
+  members[5].name = "busiest_load";
+  members[5].value = dsk_json_value_new_number (busiest_load);
+  members[6].name = "memory";
+  members[6].value = dsk_json_value_new_number (memory);
+  if (game_var != NULL)
+    {
+      members[7].name = "game_memory";
+      members[7].value = game_found ? dsk_json_value_new_number (game_memory)
+                                    : dsk_json_value_new_null ();
+      n_members++;
     }
+  stats = dsk_json_value_new_object (n_members, members);
+  dsk_json_value_to_buffer (stats, -1, &buffer);
+  dsk_json_value_free (stats);
 
-  respond_take_json (request, dsk_json_value_new_array (n_games, game_info));
-  dsk_free (game_info);
+  header_options.n_unparsed_headers = 1;
+  header_options.unparsed_headers = &header;
+  options.header_options = &header_options;
+  options.content_type = "application/json";
+  options.source_buffer = &buffer;
+  dsk_http_server_request_respond (request, &options);
+  dsk_buffer_clear (&buffer);
 }
 
+/* A user who just joined gets their first frame from a snapshot
+   of their view taken by the network thread, rather than waiting
+   for a tick. */
+static void
+set_first_frame (User *user, FrameSnapshot *snapshot,
+                 int view_x, int view_y, unsigned width, unsigned height)
+{
+  user->frame = render_view (snapshot, view_x, view_y, width, height, user);
+  user->frame_number = snapshot->frame_number;
+  snapshot_clear (snapshot);
+}
 
 static void
 handle_join_existing_game (DskHttpServerRequest *request)
@@ -1324,8 +5546,9 @@ handle_join_existing_game (DskHttpServerRequest *request)
   char buf[512];
   Game *game;
   User *user;
-  DskJsonValue *state_json;
   unsigned width, height;
+  FrameSnapshot snapshot;
+  int view_x, view_y;
   if (game_var == NULL)
     {
       dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "missing game=");
@@ -1351,11 +5574,33 @@ handle_join_existing_game (DskHttpServerRequest *request)
       return;
     }
 
-  width = 700;
-  height = 400;
+  width = DEFAULT_CANVAS_WIDTH;
+  height = DEFAULT_CANVAS_HEIGHT;
+  parse_canvas_size (request, &width, &height);
+  memset (&snapshot, 0, sizeof (snapshot));
+  pthread_mutex_lock (&world_lock);
   user = create_user (game, user_var->value, width, height);
-  state_json = create_user_update (user);
-  respond_take_json (request, state_json);
+  view_x = user->base.x;
+  view_y = user->base.y;
+  snapshot_take_view (&snapshot, game, view_x, view_y, width, height);
+  pthread_mutex_unlock (&world_lock);
+  set_first_frame (user, &snapshot, view_x, view_y, width, height);
+  respond_user_update (request, user);
+}
+
+/* Accepts 0/1, no/yes, false/true; anything else leaves the default. */
+static void parse_boolean (DskCgiVariable *var, dsk_boolean *val_inout)
+{
+  if (var == NULL)
+    return;
+  if (strcmp (var->value, "1") == 0
+   || strcasecmp (var->value, "yes") == 0
+   || strcasecmp (var->value, "true") == 0)
+    *val_inout = DSK_TRUE;
+  else if (strcmp (var->value, "0") == 0
+        || strcasecmp (var->value, "no") == 0
+        || strcasecmp (var->value, "false") == 0)
+    *val_inout = DSK_FALSE;
 }
 
 static void
@@ -1366,8 +5611,12 @@ handle_create_new_game (DskHttpServerRequest *request)
   char buf[512];
   Game *game;
   User *user;
-  DskJsonValue *state_json;
   unsigned width, height;
+  unsigned universe_width = DEFAULT_UNIVERSE_WIDTH;
+  unsigned universe_height = DEFAULT_UNIVERSE_HEIGHT;
+  FrameSnapshot snapshot;
+  int view_x, view_y;
+  GameRules rules = GAME_RULES_DEFAULT;
   if (game_var == NULL)
     {
       dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, "missing game=");
@@ -1393,12 +5642,37 @@ handle_create_new_game (DskHttpServerRequest *request)
       return;
     }
 
-  game = create_game (game_var->value, DEFAULT_UNIVERSE_WIDTH, DEFAULT_UNIVERSE_HEIGHT);
-  width = 700;
-  height = 400;
+  parse_boolean (dsk_http_server_request_lookup_cgi (request, "wrap"),
+                 &rules.wrap);
+  parse_boolean (dsk_http_server_request_lookup_cgi (request, "bounce"),
+                 &rules.diag_bullets_bounce);
+  parse_boolean (dsk_http_server_request_lookup_cgi (request, "kill_players"),
+                 &rules.bullet_kills_player);
+  parse_boolean (dsk_http_server_request_lookup_cgi (request, "kill_generators"),
+                 &rules.bullet_kills_generator);
+  parse_boolean (dsk_http_server_request_lookup_cgi (request, "fog"),
+                 &rules.fog);
+  if (!parse_universe_size (dsk_http_server_request_lookup_cgi (request, "size"),
+                            &universe_width, &universe_height))
+    {
+      dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST,
+                                             "bad size=, expected WIDTHxHEIGHT");
+      return;
+    }
+  game = create_game (game_var->value, universe_width, universe_height, &rules);
+  width = DEFAULT_CANVAS_WIDTH;
+  height = DEFAULT_CANVAS_HEIGHT;
+  parse_canvas_size (request, &width, &height);
+  memset (&snapshot, 0, sizeof (snapshot));
+  pthread_mutex_lock (&world_lock);
   user = create_user (game, user_var->value, width, height);
-  state_json = create_user_update (user);
-  respond_take_json (request, state_json);
+  view_x = user->base.x;
+  view_y = user->base.y;
+  snapshot_take_view (&snapshot, game, view_x, view_y, width, height);
+  start_game (game);
+  pthread_mutex_unlock (&world_lock);
+  set_first_frame (user, &snapshot, view_x, view_y, width, height);
+  respond_user_update (request, user);
 }
 
 static void parse_int_clamp (DskCgiVariable *var, int *val_inout)
@@ -1421,7 +5695,10 @@ handle_update_game (DskHttpServerRequest *request)
   DskCgiVariable *dy_var = dsk_http_server_request_lookup_cgi (request, "dy");
   DskCgiVariable *bx_var = dsk_http_server_request_lookup_cgi (request, "bx");
   DskCgiVariable *by_var = dsk_http_server_request_lookup_cgi (request, "by");
+  DskCgiVariable *seq_var = dsk_http_server_request_lookup_cgi (request, "seq");
   User *user = find_user (user_var->value);
+  int move_x, move_y, bullet_x, bullet_y;
+  unsigned width, height;
   char buf[512];
   if (user == NULL)
     {
@@ -1429,24 +5706,52 @@ handle_update_game (DskHttpServerRequest *request)
       dsk_http_server_request_respond_error (request, DSK_HTTP_STATUS_BAD_REQUEST, buf);
       return;
     }
-  parse_int_clamp (dx_var, &user->move_x);
-  parse_int_clamp (dy_var, &user->move_y);
-  parse_int_clamp (bx_var, &user->bullet_x);
-  parse_int_clamp (by_var, &user->bullet_y);
-  if (user->last_update == user->base.game->latest_update)
+
+  /* seq= numbers a client's requests; one that arrives after
+     a later one has been seen is stale and is not waited on. */
+  if (seq_var != NULL)
     {
-      /* wait for next frame */
-      PendingUpdate *pu = dsk_malloc (sizeof (PendingUpdate));
-      pu->user = user;
-      pu->request = request;
-      pu->next = user->base.game->pending_updates;
-      user->base.game->pending_updates = pu;
+      unsigned seq = strtoul (seq_var->value, NULL, 10);
+      if (user->last_seq != 0 && (int) (seq - user->last_seq) < 0)
+        {
+          respond_no_content (request);
+          return;
+        }
+      user->last_seq = seq;
     }
-  else
+
+  /* only this thread writes the mailbox, so it can read it back */
+  unpack_user_input (user->input, &move_x, &move_y, &bullet_x, &bullet_y);
+  parse_int_clamp (dx_var, &move_x);
+  parse_int_clamp (dy_var, &move_y);
+  parse_int_clamp (bx_var, &bullet_x);
+  parse_int_clamp (by_var, &bullet_y);
+  __atomic_store_n (&user->input,
+                    pack_user_input (move_x, move_y, bullet_x, bullet_y),
+                    __ATOMIC_RELAXED);
+  width = user->canvas >> 16;
+  height = user->canvas & 0xffff;
+  parse_canvas_size (request, &width, &height);
+  __atomic_store_n (&user->canvas, width << 16 | height, __ATOMIC_RELAXED);
+  __atomic_store_n (&user->last_polled,
+                    __atomic_load_n (&user->base.game->latest_frame, __ATOMIC_RELAXED),
+                    __ATOMIC_RELAXED);
+  user->last_seen_time = dsk_dispatch_default ()->last_dispatch_secs;
+
+  /* this request replaces any still waiting */
+  if (user->pending_request != NULL)
+    {
+      DskHttpServerRequest *old = user->pending_request;
+      remove_pending_update (user);
+      respond_no_content (old);
+    }
+  if (user->frame == NULL)
     {
-      DskJsonValue *state_json = create_user_update (user);
-      respond_take_json (request, state_json);
+      /* wait for next frame */
+      add_pending_update (user, request, get_monotonic_usecs ());
     }
+  else
+    respond_user_update (request, user);
 }
 
 /* --- utility modes of the main program --- */
@@ -1473,6 +5778,7 @@ static DSK_CMDLINE_CALLBACK_DECLARE(handle_make_maze)
   unsigned width, height;
   unsigned y;
   Game *game;
+  GameRules rules = GAME_RULES_DEFAULT;
   DSK_UNUSED (arg_name); DSK_UNUSED (callback_data);
   if (arg_value == NULL)
     width = height = 10;
@@ -1486,32 +5792,762 @@ static DSK_CMDLINE_CALLBACK_DECLARE(handle_make_maze)
     }
 
 
-  game = create_game ("name doesn't matter", width, height);
+  if (width * CELL_SIZE > MAX_UNIVERSE_TILES
+   || height * CELL_SIZE > MAX_UNIVERSE_TILES)
+    {
+      dsk_set_error (error, "maze too large for --make-maze");
+      return DSK_FALSE;
+    }
+
+  game = create_game ("name doesn't matter", width, height, &rules);
   for (y = 0; y < height; y++)
     {
       render_hwall_line_ascii (width, game->h_walls + width * y);
       render_vwall_line_ascii (width, game->v_walls + width * y);
     }
   render_hwall_line_ascii (width, game->h_walls);
+
+  /* the per-tile wall bitmap, checked against the cell walls */
+  printf ("\n");
+  for (y = 0; y < height * CELL_SIZE; y++)
+    {
+      unsigned x;
+      for (x = 0; x < width * CELL_SIZE; x++)
+        {
+          dsk_boolean is_wall = tile_is_wall (game, x, y);
+          if (is_wall != compute_tile_is_wall (game, x, y))
+            dsk_die ("wall bitmap wrong at tile %u,%u", x, y);
+          putchar (is_wall ? '#' : '.');
+        }
+      putchar ('\n');
+    }
   exit (0);
   return DSK_TRUE;
 }
 
+/* --check-regions: play the same game, with the same seed and
+   inputs, divided into regions and undivided, and check that
+   they end up exactly the same.  The maze starts out crowded
+   with enemies, so that plenty of them get in each other's way. */
+#define CHECK_REGIONS_TICKS             200
+#define CHECK_REGIONS_SEED              12345
+#define CHECK_REGIONS_ENEMIES_PER_CELL  8
+
+static char *
+replay_check_game (unsigned width, unsigned height, dsk_boolean divided)
+{
+  GameRules rules = GAME_RULES_DEFAULT;
+  unsigned saved_thread_count = region_thread_count;
+  unsigned n_users = DSK_MAX (4, width * height / 256);
+  DskBuffer out = DSK_BUFFER_STATIC_INIT;
+  Game *game;
+  Object *object;
+  unsigned tick, i;
+  char name[32];
+
+  random_seed (CHECK_REGIONS_SEED);
+  if (!divided)
+    region_thread_count = 1;
+  game = create_game ("check", width, height, &rules);
+  region_thread_count = saved_thread_count;
+  for (i = 0; i < n_users; i++)
+    {
+      snprintf (name, sizeof (name), "player%u", i);
+      create_user (game, name, DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT);
+    }
+  for (i = 0; i < width * height * CHECK_REGIONS_ENEMIES_PER_CELL; i++)
+    {
+      unsigned x = random_int_range (width * CELL_SIZE);
+      unsigned y = random_int_range (height * CELL_SIZE);
+      Occupant dummy;
+      if (get_occupancy (game, x, y, &dummy) == OCC_EMPTY)
+        add_entity (game, ENTITY_ENEMY, x, y, PACK_VELOCITY (0, 0));
+    }
+  for (tick = 0; tick < CHECK_REGIONS_TICKS; tick++)
+    {
+      /* everyone wanders and shoots, differently each tick */
+      for (object = game->users, i = 0; object; object = object->next_in_game, i++)
+        {
+          User *user = (User *) object;
+          uint32_t r = tick * 2654435761u + i * 40503u;
+          r ^= r >> 15;
+          r *= 0x2c1b3c6d;
+          r ^= r >> 12;
+          user->move_x = (int) (r % 3) - 1;
+          user->move_y = (int) (r / 3 % 3) - 1;
+          user->bullet_x = (int) (r / 9 % 3) - 1;
+          user->bullet_y = (int) (r / 27 % 3) - 1;
+        }
+      game->tick (game);
+      game->latest_update++;
+    }
+  dsk_warning ("%s: %u enemies, %u bullets after %u ticks",
+               divided ? "regions" : "serial",
+               game->pools[ENTITY_ENEMY].n_entities,
+               game->pools[ENTITY_BULLET].n_entities, tick);
+  serialize_game (game, &out);
+  destroy_game (game);
+  return dsk_buffer_empty_to_string (&out);
+}
+
+static void
+check_regions (const char *size)
+{
+  unsigned width, height;
+  char *serial, *divided;
+  unsigned line = 1, i;
+  if (sscanf (size, "%ux%u", &width, &height) != 2
+   || width * CELL_SIZE > MAX_UNIVERSE_TILES
+   || height * CELL_SIZE > MAX_UNIVERSE_TILES)
+    dsk_die ("error parsing WIDTHxHEIGHT for --check-regions");
+  if (region_thread_count < 2)
+    dsk_die ("--check-regions needs --region-threads=2 or more");
+  start_region_threads ();
+
+  serial = replay_check_game (width, height, DSK_FALSE);
+  divided = replay_check_game (width, height, DSK_TRUE);
+  for (i = 0; serial[i] == divided[i] && serial[i] != 0; i++)
+    if (serial[i] == '\n')
+      line++;
+  if (serial[i] != divided[i])
+    dsk_die ("regions differ from serial at line %u of the game state", line);
+  printf ("regions match serial\n");
+  dsk_free (serial);
+  dsk_free (divided);
+}
+
+/* --check-timer-wheel: check that timers run on the very tick they
+   are due, however far out they were added and wherever that falls
+   relative to the blocks cascaded from level 1, including on the
+   first tick of a block; then that a timer re-adding itself every
+   period keeps to its period across many blocks. */
+#define CHECK_WHEEL_PERIOD_TICKS        10
+
+typedef struct _CheckWheelTimer CheckWheelTimer;
+struct _CheckWheelTimer
+{
+  WheelTimer timer;
+  TimerWheel *wheel;
+  uint64_t ran_at;                      /* wheel tick, or 0 */
+  unsigned n_runs;
+  dsk_boolean periodic;
+};
+
+static void
+check_wheel_timer_func (void *data)
+{
+  CheckWheelTimer *check = data;
+  check->n_runs++;
+  if (check->periodic && check->ran_at != 0
+   && check->wheel->now != check->ran_at + CHECK_WHEEL_PERIOD_TICKS)
+    dsk_die ("periodic timer ran at tick %llu, not %llu",
+             (unsigned long long) check->wheel->now,
+             (unsigned long long) (check->ran_at + CHECK_WHEEL_PERIOD_TICKS));
+  check->ran_at = check->wheel->now;
+  if (check->periodic)
+    timer_wheel_add (check->wheel, &check->timer,
+                     (check->ran_at + CHECK_WHEEL_PERIOD_TICKS) * WHEEL_RESOLUTION_USECS);
+}
+
+static void
+check_timer_wheel (void)
+{
+  static const unsigned starts[] = { 0, 1, WHEEL_SLOTS - 2, WHEEL_SLOTS - 1,
+                                     WHEEL_SLOTS, 5 * WHEEL_SLOTS - 1 };
+  TimerWheel wheel;
+  CheckWheelTimer check;
+  unsigned s, delta;
+  uint64_t start, expire, t;
+
+  for (s = 0; s < DSK_N_ELEMENTS (starts); s++)
+    for (delta = 1; delta <= 3 * WHEEL_SLOTS * WHEEL_SLOTS; delta++)
+      {
+        start = 1000 * WHEEL_SLOTS + starts[s];
+        expire = start + delta;
+        timer_wheel_init (&wheel, start * WHEEL_RESOLUTION_USECS);
+        memset (&check, 0, sizeof (check));
+        check.timer.func = check_wheel_timer_func;
+        check.timer.data = &check;
+        check.wheel = &wheel;
+        timer_wheel_add (&wheel, &check.timer, expire * WHEEL_RESOLUTION_USECS);
+
+        /* one tick at a time up to just before the block it is due
+           in, then by whole blocks, as the simulation thread would
+           if nothing else were on the wheel */
+        for (t = start + 1; check.n_runs == 0 && t <= expire + WHEEL_SLOTS; t++)
+          {
+            uint64_t next = timer_wheel_next_expiry (&wheel);
+            if (next != 0 && next / WHEEL_RESOLUTION_USECS > t)
+              t = next / WHEEL_RESOLUTION_USECS;
+            timer_wheel_advance (&wheel, t * WHEEL_RESOLUTION_USECS);
+          }
+        if (check.n_runs != 1 || check.ran_at != expire)
+          dsk_die ("timer added at tick %llu for tick %llu ran %u times, last at %llu",
+                   (unsigned long long) start, (unsigned long long) expire,
+                   check.n_runs, (unsigned long long) check.ran_at);
+      }
+
+  timer_wheel_init (&wheel, 0);
+  memset (&check, 0, sizeof (check));
+  check.timer.func = check_wheel_timer_func;
+  check.timer.data = &check;
+  check.wheel = &wheel;
+  check.periodic = DSK_TRUE;
+  timer_wheel_add (&wheel, &check.timer, CHECK_WHEEL_PERIOD_TICKS * WHEEL_RESOLUTION_USECS);
+  for (t = 1; t <= 100 * WHEEL_SLOTS; t++)
+    timer_wheel_advance (&wheel, t * WHEEL_RESOLUTION_USECS);
+  if (check.n_runs != 100 * WHEEL_SLOTS / CHECK_WHEEL_PERIOD_TICKS)
+    dsk_die ("periodic timer ran %u times", check.n_runs);
+  printf ("timer wheel runs timers on time\n");
+}
+
+/* --batch-sim: play many headless games, with bots for players,
+   for every combination of the balance settings given, and print
+   how they went, as JSON.  For example,
+     server --port=1 --batch-sim=200 --batch-generator-prob=0.005,0.01,0.02 \
+            --batch-dead-time=10,20 --batch-bots=hunt,flee > balance.json
+   plays 200 games of each of 12 settings.
+
+   Each game is made and played by one thread, from a seed of its
+   own, so it plays out the same however the games are shared out.
+   The games are dealt out into a queue per thread; a thread that
+   finishes its own queue takes games from the others', as the
+   region threads do.  A setting is printed as soon as its last
+   game is done, so settings come out in no particular order:
+     mean_life_ticks    updates a player lives between deaths, or null
+     deaths_per_1000    deaths per 1000 player-updates
+     enemies            the mean number of enemies at each of curve_ticks
+     generators_left    the mean number not shot by the end
+     usecs_per_tick     the mean cost of an update
+   then "tick_cost", the cost of an update by the number of enemies
+   and bullets, over all the games. */
+#define BATCH_CURVE_POINTS      10
+#define BATCH_COST_BUCKETS      24      /* by log2 of enemies and bullets */
+
+/* bots see enemies in the cells this near their own */
+#define BOT_SIGHT_CELLS         1
+
+/* chance a bot with nothing to aim at picks a new way to walk and shoot */
+#define BOT_TURN_PROB           0.1
+
+typedef enum
+{
+  BOT_WANDER,                           /* walk and shoot at random */
+  BOT_HUNT,                             /* line up with the nearest enemy and shoot */
+  BOT_FLEE,                             /* back away from it, shooting */
+  N_BOT_POLICIES
+} BotPolicy;
+static const char *bot_policy_names[N_BOT_POLICIES] = { "wander", "hunt", "flee" };
+
+/* The balance settings and bots that may be swept over,
+   each from a comma-separated list of values. */
+typedef enum
+{
+  BATCH_GENERATOR_PROB,
+  BATCH_ENEMY_MOVE_FRACTION,
+  BATCH_BULLET_SPEED,
+  BATCH_DEAD_TIME,
+  BATCH_BOTS,
+  N_BATCH_SWEEPS
+} BatchSweepType;
+
+typedef struct _BatchSweep BatchSweep;
+struct _BatchSweep
+{
+  const char *option;
+  const char *description;
+  const char *json_name;
+  double min, max;
+  dsk_boolean integer;
+  const char *values;                   /* NULL for just the default */
+  unsigned n_values;
+  double *parsed;                       /* a BotPolicy for BATCH_BOTS */
+};
+static BatchSweep batch_sweeps[N_BATCH_SWEEPS] = {
+  { "batch-generator-prob", "Generator Probabilities to Try",
+    "generator_prob", 0, 1, DSK_FALSE, NULL, 0, NULL },
+  { "batch-enemy-move-fraction", "Enemy Move Fractions to Try",
+    "enemy_move_fraction", 0, 1, DSK_FALSE, NULL, 0, NULL },
+  { "batch-bullet-speed", "Bullet Speeds to Try",
+    "bullet_speed", 1, CELL_SIZE, DSK_TRUE, NULL, 0, NULL },
+  { "batch-dead-time", "Dead Times to Try",
+    "dead_time", 1, 10000, DSK_TRUE, NULL, 0, NULL },
+  { "batch-bots", "Bot Policies to Try (wander, hunt, flee)",
+    "bots", 0, N_BOT_POLICIES - 1, DSK_TRUE, NULL, 0, NULL },
+};
+
+static unsigned batch_games;            /* per setting; 0 unless --batch-sim */
+static unsigned batch_threads;          /* 0 for one per CPU */
+static unsigned batch_ticks = 2000;
+static const char *batch_size = "24x24";
+static unsigned batch_players = 4;
+static unsigned batch_seed = 12345;
+
+/* how one game went */
+typedef struct _BatchResult BatchResult;
+struct _BatchResult
+{
+  uint64_t player_ticks;                /* updates started alive, over all players */
+  unsigned deaths;
+  unsigned enemies[BATCH_CURVE_POINTS];
+  unsigned generators_left;
+  uint64_t tick_usecs;
+};
+
+/* A thread's queue of games, and what its updates cost. */
+typedef struct _BatchWorker BatchWorker;
+struct _BatchWorker
+{
+  unsigned next, end;                   /* in the games; next is atomic */
+  uint64_t cost_ticks[BATCH_COST_BUCKETS];
+  uint64_t cost_usecs[BATCH_COST_BUCKETS];
+  char pad[64];                         /* keeps next off the last worker's line */
+};
+
+static unsigned batch_width, batch_height;
+static unsigned batch_n_settings;
+static unsigned batch_n_workers;
+static BatchWorker *batch_workers;
+static BatchResult *batch_results;      /* game g plays setting g / batch_games */
+static unsigned *batch_remaining;       /* games left in each setting; atomic */
+static unsigned batch_n_printed;
+static pthread_mutex_t batch_output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int
+sign (int v)
+{
+  return v > 0 ? 1 : v < 0 ? -1 : 0;
+}
+
+/* The nearest enemy the bot can see, as dx,dy from it. */
+static dsk_boolean
+bot_find_enemy (Game *game, User *user, int *dx_out, int *dy_out)
+{
+  EntityPool *enemies = game->pools + ENTITY_ENEMY;
+  int w = game->universe_width, h = game->universe_height;
+  int tw = w * CELL_SIZE, th = h * CELL_SIZE;
+  int cx = user->base.x / CELL_SIZE, cy = user->base.y / CELL_SIZE;
+  unsigned best = UINT_MAX;
+  int x, y;
+  for (y = cy - BOT_SIGHT_CELLS; y <= cy + BOT_SIGHT_CELLS; y++)
+    for (x = cx - BOT_SIGHT_CELLS; x <= cx + BOT_SIGHT_CELLS; x++)
+      {
+        Cell *cell;
+        uint32_t i;
+        if (!game->rules.wrap && (x < 0 || y < 0 || x >= w || y >= h))
+          continue;
+        cell = game->cells + mod (x, w) + mod (y, h) * w;
+        for (i = cell->entities[ENTITY_ENEMY]; i != ENTITY_NONE; i = enemies->next_in_cell[i])
+          {
+            int dx = enemies->x[i] - (int) user->base.x;
+            int dy = enemies->y[i] - (int) user->base.y;
+            unsigned d;
+            if (game->rules.wrap)
+              {
+                if (dx > tw / 2) dx -= tw; else if (dx < -tw / 2) dx += tw;
+                if (dy > th / 2) dy -= th; else if (dy < -th / 2) dy += th;
+              }
+            d = DSK_MAX (dx < 0 ? -dx : dx, dy < 0 ? -dy : dy);
+            if (d < best)
+              {
+                best = d;
+                *dx_out = dx;
+                *dy_out = dy;
+              }
+          }
+      }
+  return best != UINT_MAX;
+}
+
+/* Set a live bot's inputs for the next update. */
+static void
+run_bot (Game *game, User *user, BotPolicy policy)
+{
+  int dx, dy;
+  if (policy != BOT_WANDER && bot_find_enemy (game, user, &dx, &dy))
+    {
+      /* bullets fly straight or diagonally, so only hit if lined up */
+      int adx = dx < 0 ? -dx : dx, ady = dy < 0 ? -dy : dy;
+      user->bullet_x = sign (dx);
+      user->bullet_y = sign (dy);
+      if (policy == BOT_FLEE)
+        {
+          user->move_x = -sign (dx);
+          user->move_y = -sign (dy);
+        }
+      else if (adx == 0 || ady == 0 || adx == ady)
+        user->move_x = user->move_y = 0;
+      else if (adx < ady)
+        {
+          user->move_x = sign (dx);
+          user->move_y = 0;
+        }
+      else
+        {
+          user->move_x = 0;
+          user->move_y = sign (dy);
+        }
+      return;
+    }
+  if (random_double () < BOT_TURN_PROB)
+    {
+      user->move_x = (int) random_int_range (3) - 1;
+      user->move_y = (int) random_int_range (3) - 1;
+      user->bullet_x = (int) random_int_range (3) - 1;
+      user->bullet_y = (int) random_int_range (3) - 1;
+    }
+}
+
+/* The rules and bots of setting number 'setting': the first
+   sweep's value varies fastest. */
+static void
+batch_setting (unsigned setting, GameRules *rules, BotPolicy *policy)
+{
+  unsigned s;
+  *rules = (GameRules) GAME_RULES_DEFAULT;
+  for (s = 0; s < N_BATCH_SWEEPS; s++)
+    {
+      BatchSweep *sweep = batch_sweeps + s;
+      double value = sweep->parsed[setting % sweep->n_values];
+      setting /= sweep->n_values;
+      switch ((BatchSweepType) s)
+        {
+        case BATCH_GENERATOR_PROB: rules->generator_prob = value; break;
+        case BATCH_ENEMY_MOVE_FRACTION: rules->enemy_move_fraction = value; break;
+        case BATCH_BULLET_SPEED: rules->bullet_speed = value; break;
+        case BATCH_DEAD_TIME: rules->dead_time = value; break;
+        case BATCH_BOTS: *policy = value; break;
+        case N_BATCH_SWEEPS: break;
+        }
+    }
+}
+
+static void
+parse_batch_sweep (BatchSweepType s)
+{
+  BatchSweep *sweep = batch_sweeps + s;
+  GameRules rules = GAME_RULES_DEFAULT;
+  const char *at = sweep->values;
+  if (at == NULL)
+    {
+      sweep->n_values = 1;
+      sweep->parsed = dsk_malloc (sizeof (double));
+      switch (s)
+        {
+        case BATCH_GENERATOR_PROB: sweep->parsed[0] = rules.generator_prob; break;
+        case BATCH_ENEMY_MOVE_FRACTION: sweep->parsed[0] = rules.enemy_move_fraction; break;
+        case BATCH_BULLET_SPEED: sweep->parsed[0] = rules.bullet_speed; break;
+        case BATCH_DEAD_TIME: sweep->parsed[0] = rules.dead_time; break;
+        case BATCH_BOTS: sweep->parsed[0] = BOT_HUNT; break;
+        case N_BATCH_SWEEPS: break;
+        }
+      return;
+    }
+  sweep->n_values = 0;
+  sweep->parsed = NULL;
+  for (;;)
+    {
+      size_t len = strcspn (at, ",");
+      double value;
+      char *end;
+      sweep->parsed = dsk_realloc (sweep->parsed, sizeof (double) * (sweep->n_values + 1));
+      if (s == BATCH_BOTS)
+        {
+          unsigned p;
+          for (p = 0; p < N_BOT_POLICIES; p++)
+            if (strlen (bot_policy_names[p]) == len
+             && memcmp (bot_policy_names[p], at, len) == 0)
+              break;
+          value = p;                    /* N_BOT_POLICIES, if unknown, is too big */
+          end = (char *) at + len;
+        }
+      else
+        value = strtod (at, &end);
+      if (end != at + len || len == 0
+       || value < sweep->min || value > sweep->max
+       || (sweep->integer && value != (unsigned) value))
+        dsk_die ("bad value '%.*s' for --%s", (int) len, at, sweep->option);
+      sweep->parsed[sweep->n_values++] = value;
+      if (at[len] == 0)
+        break;
+      at += len + 1;
+    }
+}
+
+static void
+batch_print_setting (unsigned setting)
+{
+  BatchResult *results = batch_results + setting * batch_games;
+  GameRules rules;
+  BotPolicy policy = BOT_HUNT;
+  uint64_t player_ticks = 0, deaths = 0, generators_left = 0, tick_usecs = 0;
+  uint64_t enemies[BATCH_CURVE_POINTS];
+  unsigned g, i;
+
+  batch_setting (setting, &rules, &policy);
+  memset (enemies, 0, sizeof (enemies));
+  for (g = 0; g < batch_games; g++)
+    {
+      player_ticks += results[g].player_ticks;
+      deaths += results[g].deaths;
+      generators_left += results[g].generators_left;
+      tick_usecs += results[g].tick_usecs;
+      for (i = 0; i < BATCH_CURVE_POINTS; i++)
+        enemies[i] += results[g].enemies[i];
+    }
+
+  pthread_mutex_lock (&batch_output_lock);
+  printf ("%s\n {\"generator_prob\":%g,\"enemy_move_fraction\":%g,"
+          "\"bullet_speed\":%u,\"dead_time\":%u,\"bots\":\"%s\",",
+          batch_n_printed++ ? "," : "",
+          rules.generator_prob, rules.enemy_move_fraction,
+          rules.bullet_speed, rules.dead_time, bot_policy_names[policy]);
+  if (deaths > 0)
+    printf ("\"mean_life_ticks\":%.1f,", (double) player_ticks / deaths);
+  else
+    printf ("\"mean_life_ticks\":null,");
+  printf ("\"deaths_per_1000\":%.3f,\"enemies\":[",
+          player_ticks ? deaths * 1000.0 / player_ticks : 0.0);
+  for (i = 0; i < BATCH_CURVE_POINTS; i++)
+    printf ("%s%.1f", i ? "," : "", (double) enemies[i] / batch_games);
+  printf ("],\"generators_left\":%.2f,\"usecs_per_tick\":%.2f}",
+          (double) generators_left / batch_games,
+          (double) tick_usecs / ((uint64_t) batch_games * batch_ticks));
+  fflush (stdout);
+  pthread_mutex_unlock (&batch_output_lock);
+}
+
+/* Play game number 'g', and if it was the last of its
+   setting to finish, print the setting. */
+static void
+batch_play (unsigned g, BatchWorker *worker)
+{
+  unsigned setting = g / batch_games;
+  BatchResult *result = batch_results + g;
+  EntityPool *enemies, *bullets;
+  GameRules rules;
+  BotPolicy policy = BOT_HUNT;
+  Generator *generator;
+  Object *object;
+  unsigned tick, i, sample = 0;
+  char name[32];
+  Game *game;
+
+  batch_setting (setting, &rules, &policy);
+  random_seed (batch_seed + g * 2654435761u);
+  game = create_game ("batch", batch_width, batch_height, &rules);
+  enemies = game->pools + ENTITY_ENEMY;
+  bullets = game->pools + ENTITY_BULLET;
+
+  /* create_user() tells the lobby, which is shared */
+  pthread_mutex_lock (&world_lock);
+  for (i = 0; i < batch_players; i++)
+    {
+      snprintf (name, sizeof (name), "bot%u", i);
+      create_user (game, name, DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT);
+    }
+  pthread_mutex_unlock (&world_lock);
+
+  memset (result, 0, sizeof (BatchResult));
+  for (tick = 0; tick < batch_ticks; tick++)
+    {
+      unsigned n_entities = enemies->n_entities + bullets->n_entities;
+      unsigned bucket = 0;
+      uint64_t start, usecs;
+      for (object = game->users; object; object = object->next_in_game)
+        {
+          User *user = (User *) object;
+          if (user->dead_count > 0)
+            continue;
+          result->player_ticks++;
+          run_bot (game, user, policy);
+        }
+
+      start = get_monotonic_usecs ();
+      game->tick (game);
+      usecs = get_monotonic_usecs () - start;
+      game->latest_update++;
+
+      /* a player who died this update has all of dead_time to go */
+      for (object = game->users; object; object = object->next_in_game)
+        if (((User *) object)->dead_count == rules.dead_time)
+          result->deaths++;
+
+      while (bucket < BATCH_COST_BUCKETS - 1 && (n_entities >> bucket) != 0)
+        bucket++;
+      worker->cost_ticks[bucket]++;
+      worker->cost_usecs[bucket] += usecs;
+      result->tick_usecs += usecs;
+
+      while (sample < BATCH_CURVE_POINTS
+          && tick + 1 >= (uint64_t) (sample + 1) * batch_ticks / BATCH_CURVE_POINTS)
+        result->enemies[sample++] = enemies->n_entities - enemies->n_dead;
+    }
+  for (generator = game->generators; generator; generator = generator->next_in_game)
+    result->generators_left++;
+  destroy_game (game);
+
+  if (__atomic_sub_fetch (batch_remaining + setting, 1, __ATOMIC_ACQ_REL) == 0)
+    batch_print_setting (setting);
+}
+
+/* Like run_worker_regions(): play the games in this
+   thread's own queue, then those left in the others'. */
+static void *
+batch_thread_main (void *data)
+{
+  unsigned worker = (uintptr_t) data;
+  unsigned w;
+  for (w = 0; w < batch_n_workers; w++)
+    {
+      BatchWorker *queue = batch_workers + (worker + w) % batch_n_workers;
+      unsigned g;
+      while ((g = __atomic_fetch_add (&queue->next, 1, __ATOMIC_RELAXED)) < queue->end)
+        batch_play (g, batch_workers + worker);
+    }
+  return NULL;
+}
+
+static void
+batch_sim (void)
+{
+  pthread_t *threads;
+  unsigned n_games, s, w, b, n_printed = 0;
+  uint64_t start = get_monotonic_usecs ();
+
+  if (sscanf (batch_size, "%ux%u", &batch_width, &batch_height) != 2
+   || !universe_size_ok (batch_width, batch_height))
+    dsk_die ("error parsing WIDTHxHEIGHT for --batch-size");
+  batch_n_settings = 1;
+  for (s = 0; s < N_BATCH_SWEEPS; s++)
+    {
+      parse_batch_sweep (s);
+      batch_n_settings *= batch_sweeps[s].n_values;
+    }
+  n_games = batch_n_settings * batch_games;
+
+  /* the games are the parallelism; don't divide them too */
+  region_thread_count = 1;
+
+  batch_n_workers = batch_threads;
+  if (batch_n_workers == 0)
+    batch_n_workers = DSK_MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+  batch_workers = dsk_malloc0 (sizeof (BatchWorker) * batch_n_workers);
+  for (w = 0; w < batch_n_workers; w++)
+    {
+      batch_workers[w].next = (uint64_t) n_games * w / batch_n_workers;
+      batch_workers[w].end = (uint64_t) n_games * (w + 1) / batch_n_workers;
+    }
+  batch_results = dsk_malloc (sizeof (BatchResult) * n_games);
+  batch_remaining = dsk_malloc (sizeof (unsigned) * batch_n_settings);
+  for (s = 0; s < batch_n_settings; s++)
+    batch_remaining[s] = batch_games;
+
+  printf ("{\"seed\":%u,\"games\":%u,\"ticks\":%u,\"size\":\"%ux%u\",\"players\":%u,"
+          "\"curve_ticks\":[",
+          batch_seed, batch_games, batch_ticks, batch_width, batch_height,
+          batch_players);
+  for (s = 0; s < BATCH_CURVE_POINTS; s++)
+    printf ("%s%u", s ? "," : "",
+            (unsigned) ((uint64_t) (s + 1) * batch_ticks / BATCH_CURVE_POINTS));
+  printf ("],\"settings\":[");
+  fflush (stdout);
+
+  threads = dsk_malloc (sizeof (pthread_t) * batch_n_workers);
+  for (w = 1; w < batch_n_workers; w++)
+    if (pthread_create (threads + w, NULL, batch_thread_main, (void *) (uintptr_t) w) != 0)
+      dsk_die ("error starting batch thread");
+  batch_thread_main (NULL);
+  for (w = 1; w < batch_n_workers; w++)
+    pthread_join (threads[w], NULL);
+
+  printf ("\n],\"tick_cost\":[");
+  for (b = 0; b < BATCH_COST_BUCKETS; b++)
+    {
+      uint64_t ticks = 0, usecs = 0;
+      for (w = 0; w < batch_n_workers; w++)
+        {
+          ticks += batch_workers[w].cost_ticks[b];
+          usecs += batch_workers[w].cost_usecs[b];
+        }
+      if (ticks > 0)
+        printf ("%s\n {\"min_entities\":%u,\"max_entities\":%u,"
+                "\"ticks\":%llu,\"usecs_per_tick\":%.2f}",
+                n_printed++ ? "," : "",
+                b ? 1u << (b - 1) : 0,
+                b == BATCH_COST_BUCKETS - 1 ? UINT_MAX : b ? (1u << b) - 1 : 0,
+                (unsigned long long) ticks, (double) usecs / ticks);
+    }
+  printf ("\n]}\n");
+  dsk_warning ("played %u games in %.1f seconds on %u threads",
+               n_games, (get_monotonic_usecs () - start) / 1e6, batch_n_workers);
+
+  for (s = 0; s < N_BATCH_SWEEPS; s++)
+    dsk_free (batch_sweeps[s].parsed);
+  dsk_free (threads);
+  dsk_free (batch_remaining);
+  dsk_free (batch_results);
+  dsk_free (batch_workers);
+}
+
 /* --- main program --- */
+static void
+start_threads (void)
+{
+  pthread_condattr_t attr;
+  sigset_t all_signals, old_signals;
+  unsigned i;
+
+  timer_wheel_init (&game_wheel, get_monotonic_usecs ());
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&sim_wakeup, &attr);
+  pthread_condattr_destroy (&attr);
+
+  if (pipe (frame_queue_wakeup_fds) < 0)
+    dsk_die ("error creating pipe: %s", strerror (errno));
+  for (i = 0; i < 2; i++)
+    fcntl (frame_queue_wakeup_fds[i], F_SETFL,
+           fcntl (frame_queue_wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+  dsk_main_watch_fd (frame_queue_wakeup_fds[0], DSK_EVENT_READABLE,
+                     handle_frame_queue_wakeup, NULL);
+  dsk_main_add_timer_millis (HOUSEKEEPING_MILLIS, housekeeping_timer_callback, NULL);
+
+  /* signals are for the main loop */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_BLOCK, &all_signals, &old_signals);
+  if (pthread_create (&sim_thread, NULL, sim_thread_main, NULL) != 0)
+    dsk_die ("error starting simulation thread");
+  if (pthread_create (&render_thread, NULL, render_thread_main, NULL) != 0)
+    dsk_die ("error starting render thread");
+  start_region_threads ();
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+}
+
+/* bench.c includes this file for its functions, and has a main of its own */
+#ifndef SNIPEZ_EMBEDDED
 static struct {
   const char *pattern;
   void (*handler) (DskHttpServerRequest *request);
 } handlers[] = {
   { "/", handle_main_page },
-  { "/games(\\?.*)", handle_get_games_list },
+  { "/games(\\?.*)?", handle_get_games_list },
   { "/join\\?.*", handle_join_existing_game },
   { "/newgame\\?.*", handle_create_new_game },
   { "/update\\?.*", handle_update_game },
+  { "/watch\\?.*", handle_watch_game },
+  { "/stats(\\?.*)?", handle_get_stats },
+  { "/export\\?.*", handle_export_game },
+  { "/import(\\?.*)?", handle_import_game },
+  { "/leave\\?.*", handle_leave_game },
+  { "/destroy\\?.*", handle_destroy_game },
 };
 
 int main(int argc, char **argv)
 {
   unsigned port = 0;
+  const char *check_regions_size = NULL;
+  dsk_boolean check_wheel = DSK_FALSE;
   DskHttpServer *server;
   unsigned i;
   DskError *error = NULL;
@@ -1519,13 +6555,64 @@ int main(int argc, char **argv)
   dsk_cmdline_init ("snipez server", "Run a snipez server", NULL, 0);
   dsk_cmdline_add_uint ("port", "Port Number",
                         "PORT", DSK_CMDLINE_MANDATORY, &port);
-  dsk_cmdline_add_uint ("update-period", "Update Period",
+  dsk_cmdline_add_uint ("update-period", "Target Update Period",
                         "MILLIS", 0, &update_period_msecs);
+  dsk_cmdline_add_uint ("region-threads", "Threads to Run Big Games' Regions",
+                        "N", 0, &region_thread_count);
+  dsk_cmdline_add_uint ("idle-timeout", "Remove Players Silent this Long (0 for never)",
+                        "SECS", 0, &idle_timeout_secs);
+  dsk_cmdline_add_string ("html-dir", "Directory of Static Files (reloaded on SIGHUP)",
+                          "DIR", 0, &html_dir);
+  dsk_cmdline_add_string ("admin-token", "Secret Required by /destroy, /export and /import",
+                          "TOKEN", 0, &admin_token);
   dsk_cmdline_add_func ("make-maze", "Make a Maze",
                         "WIDTHxHEIGHT", DSK_CMDLINE_OPTIONAL,
                         handle_make_maze, NULL);
+  dsk_cmdline_add_string ("check-regions", "Check that Regions Tick a Maze as One Thread Does",
+                          "WIDTHxHEIGHT", 0, &check_regions_size);
+  dsk_cmdline_add_boolean ("check-timer-wheel", "Check that the Timer Wheel Runs Timers on Time",
+                           NULL, 0, &check_wheel);
+  dsk_cmdline_add_uint ("batch-sim", "Play Headless Games of Bots, this Many per Setting, then Exit",
+                        "GAMES", 0, &batch_games);
+  dsk_cmdline_add_uint ("batch-threads", "Threads for --batch-sim (0 for one per CPU)",
+                        "N", 0, &batch_threads);
+  dsk_cmdline_add_uint ("batch-ticks", "Updates in Each --batch-sim Game",
+                        "N", 0, &batch_ticks);
+  dsk_cmdline_add_string ("batch-size", "Maze Size for --batch-sim",
+                          "WIDTHxHEIGHT", 0, &batch_size);
+  dsk_cmdline_add_uint ("batch-players", "Bots in Each --batch-sim Game",
+                        "N", 0, &batch_players);
+  dsk_cmdline_add_uint ("batch-seed", "Random Seed for --batch-sim",
+                        "N", 0, &batch_seed);
+  for (i = 0; i < N_BATCH_SWEEPS; i++)
+    dsk_cmdline_add_string (batch_sweeps[i].option, batch_sweeps[i].description,
+                            "LIST", 0, &batch_sweeps[i].values);
   dsk_cmdline_add_shortcut ('p', "port");
   dsk_cmdline_process_args (&argc, &argv);
+  if (region_thread_count < 1)
+    dsk_die ("--region-threads must be at least 1");
+
+  if (check_regions_size != NULL)
+    {
+      check_regions (check_regions_size);
+      return 0;
+    }
+  if (check_wheel)
+    {
+      check_timer_wheel ();
+      return 0;
+    }
+  if (batch_games > 0)
+    {
+      batch_sim ();
+      return 0;
+    }
+
+  /* the API works without them; / answers 404 until SIGHUP finds them */
+  if (!load_static_assets ())
+    dsk_warning ("error loading static files from %s", html_dir);
+  dsk_main_add_signal (SIGHUP, handle_sighup, NULL);
+  start_threads ();
 
   server = dsk_http_server_new ();
   for (i = 0; i < DSK_N_ELEMENTS (handlers); i++)
@@ -1543,3 +6630,4 @@ int main(int argc, char **argv)
 
   return dsk_main_run ();
 }
+#endif